@@ -0,0 +1,629 @@
+#include <string.h>
+#include "APU.h"
+
+static const BYTE DUTY_PATTERNS[4][8] = {
+    {0, 0, 0, 0, 0, 0, 0, 1},  // 12.5%
+    {1, 0, 0, 0, 0, 0, 0, 1},  // 25%
+    {1, 0, 0, 0, 0, 1, 1, 1},  // 50%
+    {0, 1, 1, 1, 1, 1, 1, 0},  // 75%
+};
+
+static const int NOISE_DIVISORS[8] = {8, 16, 32, 48, 64, 80, 96, 112};
+
+// wave volume code -> right shift of the 4-bit sample (0 = mute)
+static const int WAVE_SHIFTS[4] = {4, 0, 1, 2};
+
+// Moves a channel's frequency timer on by `cycles` and returns how many
+// times it expired. Doing this in one step rather than per cycle means
+// running a block in one go or in pieces gives exactly the same state.
+static inline int advance_timer(int& timer, int cycles, int period)
+{
+    if (cycles < timer)
+    {
+        timer -= cycles;
+        return 0;
+    }
+    cycles -= timer;
+    timer = period - (cycles % period);
+    return 1 + (cycles / period);
+}
+
+// Shift the noise LFSR `steps` times. In 7-bit mode the feedback bit
+// is also copied into bit 6, which gives the shorter, buzzier pattern.
+static inline void clock_lfsr(NoiseChannel& ch, int steps)
+{
+    for (int i = 0; i < steps; i++)
+    {
+        WORD bit = (ch.lfsr ^ (ch.lfsr >> 1)) & 1;
+        ch.lfsr = (ch.lfsr >> 1) | (bit << 14);
+        if (ch.width_7bit)
+            ch.lfsr = (ch.lfsr & ~0x40) | (bit << 6);
+    }
+}
+
+// DAC turns the 0-15 digital level into -1..1
+static inline float dac_output(int digital)
+{
+    return digital / 7.5f - 1.0f;
+}
+
+static inline int16_t clamp_sample(float value)
+{
+    if (value > 32767.0f)
+        return 32767;
+    if (value < -32768.0f)
+        return -32768;
+    return (int16_t)value;
+}
+
+APU::APU()
+{
+    reset();
+    output_enabled = true;
+    sample_rate = APU_SAMPLE_RATE;
+    latency_ms = APU_DEFAULT_LATENCY_MS;
+    set_rate_adjust(0.0);
+    clear_output();
+    capacitor_left = 0;
+    capacitor_right = 0;
+    // 0.999958 per cycle on DMG, compounded over one output sample
+    capacitor_charge = 0.99634f;
+}
+
+void APU::reset()
+{
+    memset(&state, 0, sizeof(state));
+    state.sequencer_timer = APU_SEQUENCER_PERIOD;
+    state.noise.lfsr = 0x7FFF;
+    for (int i = 0; i < 2; i++)
+        state.square[i].timer = 2048 * 4;
+    state.wave.timer = 2048 * 2;
+    state.noise.timer = 8;
+}
+
+// Catch the channels up to `cycle`, one block per sequencer tick
+void APU::run_until(uint64_t cycle)
+{
+    while (state.last_cycle < cycle)
+    {
+        uint64_t remaining = cycle - state.last_cycle;
+        int block = (remaining < (uint64_t)state.sequencer_timer) ? (int)remaining : state.sequencer_timer;
+
+        run_block(block);
+        state.last_cycle += block;
+        state.sequencer_timer -= block;
+        if (state.sequencer_timer == 0)
+        {
+            state.sequencer_timer = APU_SEQUENCER_PERIOD;
+            clock_sequencer();
+        }
+    }
+}
+
+// Run every channel through one block. With output on, each channel
+// steps through its level changes and hands them to the blip buffers
+// at the exact cycle they happen; with output off the timers are just
+// moved on arithmetically. Both leave the channels in the same state.
+void APU::run_block(int cycles)
+{
+    if (!output_enabled)
+    {
+        skip_block(cycles);
+        return;
+    }
+
+    // nobody's draining us, drop the oldest output to make room
+    APUOutput& out = writable_output();
+    if (out.left.room() < cycles / 64 + 2)
+    {
+        out.left.read_samples(NULL, output_capacity() / 2);
+        out.right.read_samples(NULL, output_capacity() / 2);
+    }
+
+    // NR50 sets each terminal's master volume (0-7), NR51 routes each
+    // channel to the left and/or right terminal. Both only change between
+    // blocks, a change shows up as a step in the channel levels below.
+    float left_volume = (((state.nr50 >> 4) & 7) + 1) / 32.0f;
+    float right_volume = ((state.nr50 & 7) + 1) / 32.0f;
+    for (int i = 0; i < 4; i++)
+    {
+        left_gain[i] = (state.nr51 & (0x10 << i)) ? left_volume : 0.0f;
+        right_gain[i] = (state.nr51 & (0x01 << i)) ? right_volume : 0.0f;
+    }
+
+    output_square(0, cycles);
+    output_square(1, cycles);
+    output_wave(cycles);
+    output_noise(cycles);
+
+    out.left.advance(cycles);
+    out.right.advance(cycles);
+}
+
+void APU::skip_block(int cycles)
+{
+    int steps;
+    steps = advance_timer(state.square[0].timer, cycles, (2048 - state.square[0].frequency) * 4);
+    state.square[0].phase = (state.square[0].phase + steps) & 7;
+    steps = advance_timer(state.square[1].timer, cycles, (2048 - state.square[1].frequency) * 4);
+    state.square[1].phase = (state.square[1].phase + steps) & 7;
+    steps = advance_timer(state.wave.timer, cycles, (2048 - state.wave.frequency) * 2);
+    state.wave.position = (state.wave.position + steps) & 31;
+
+    NoiseChannel& ch = state.noise;
+    clock_lfsr(ch, advance_timer(ch.timer, cycles, NOISE_DIVISORS[ch.divisor_code] << ch.clock_shift));
+}
+
+// A channel's level moved to `level` at `clock` cycles into the block.
+// Only actual changes cost anything.
+void APU::set_level(int channel, int clock, float level)
+{
+    float l = level * left_gain[channel];
+    float r = level * right_gain[channel];
+    if (l != left_level[channel])
+    {
+        output->left.add_delta(clock, l - left_level[channel]);
+        left_level[channel] = l;
+    }
+    if (r != right_level[channel])
+    {
+        output->right.add_delta(clock, r - right_level[channel]);
+        right_level[channel] = r;
+    }
+}
+
+static inline float square_level(const SquareChannel& ch)
+{
+    int digital = (ch.enabled && DUTY_PATTERNS[ch.duty][ch.phase]) ? ch.volume : 0;
+    return ch.dac_enabled ? dac_output(digital) : 0.0f;
+}
+
+static inline float wave_level(const WaveChannel& ch)
+{
+    BYTE sample = ch.wave_ram[ch.position >> 1];
+    sample = (ch.position & 1) ? (sample & 0xF) : (sample >> 4);
+    int digital = ch.enabled ? (sample >> WAVE_SHIFTS[ch.volume_code]) : 0;
+    return ch.dac_enabled ? dac_output(digital) : 0.0f;
+}
+
+static inline float noise_level(const NoiseChannel& ch)
+{
+    int digital = (ch.enabled && !(ch.lfsr & 1)) ? ch.volume : 0;
+    return ch.dac_enabled ? dac_output(digital) : 0.0f;
+}
+
+// Each output_* walks its channel's timer expiries through the block.
+// The timer semantics match advance_timer: an expiry landing exactly on
+// the end of the block belongs to this block.
+void APU::output_square(int channel, int cycles)
+{
+    SquareChannel& ch = state.square[channel];
+    int period = (2048 - ch.frequency) * 4;
+    int clock = 0;
+    set_level(channel, 0, square_level(ch));
+    while (cycles - clock >= ch.timer)
+    {
+        clock += ch.timer;
+        ch.timer = period;
+        ch.phase = (ch.phase + 1) & 7;
+        set_level(channel, clock, square_level(ch));
+    }
+    ch.timer -= cycles - clock;
+}
+
+void APU::output_wave(int cycles)
+{
+    WaveChannel& ch = state.wave;
+    int period = (2048 - ch.frequency) * 2;
+    int clock = 0;
+    set_level(2, 0, wave_level(ch));
+    while (cycles - clock >= ch.timer)
+    {
+        clock += ch.timer;
+        ch.timer = period;
+        ch.position = (ch.position + 1) & 31;
+        set_level(2, clock, wave_level(ch));
+    }
+    ch.timer -= cycles - clock;
+}
+
+void APU::output_noise(int cycles)
+{
+    NoiseChannel& ch = state.noise;
+    int period = NOISE_DIVISORS[ch.divisor_code] << ch.clock_shift;
+    int clock = 0;
+    set_level(3, 0, noise_level(ch));
+    while (cycles - clock >= ch.timer)
+    {
+        clock += ch.timer;
+        ch.timer = period;
+        clock_lfsr(ch, 1);
+        set_level(3, clock, noise_level(ch));
+    }
+    ch.timer -= cycles - clock;
+}
+
+// 512Hz: length on even steps, sweep on 2 and 6, envelope on 7
+void APU::clock_sequencer()
+{
+    int step = state.sequencer_step;
+    if ((step & 1) == 0)
+        clock_length();
+    if ((step == 2) || (step == 6))
+        clock_sweep();
+    if (step == 7)
+        clock_envelopes();
+    state.sequencer_step = (step + 1) & 7;
+}
+
+void APU::clock_length()
+{
+    for (int i = 0; i < 2; i++)
+    {
+        SquareChannel& ch = state.square[i];
+        if (ch.length_enable && (ch.length > 0) && (--ch.length == 0))
+            ch.enabled = false;
+    }
+    if (state.wave.length_enable && (state.wave.length > 0) && (--state.wave.length == 0))
+        state.wave.enabled = false;
+    if (state.noise.length_enable && (state.noise.length > 0) && (--state.noise.length == 0))
+        state.noise.enabled = false;
+}
+
+static void clock_envelope(int& volume, bool up, int period, int& timer)
+{
+    if (period == 0)
+        return;
+    if (--timer > 0)
+        return;
+    timer = period;
+    if (up && (volume < 15))
+        volume++;
+    else if (!up && (volume > 0))
+        volume--;
+}
+
+void APU::clock_envelopes()
+{
+    for (int i = 0; i < 2; i++)
+    {
+        SquareChannel& ch = state.square[i];
+        clock_envelope(ch.volume, ch.envelope_up, ch.envelope_period, ch.envelope_timer);
+    }
+    NoiseChannel& noise = state.noise;
+    clock_envelope(noise.volume, noise.envelope_up, noise.envelope_period, noise.envelope_timer);
+}
+
+// New sweep frequency, disables channel 1 on overflow past 2047
+int APU::sweep_calculate()
+{
+    SquareChannel& ch = state.square[0];
+    int delta = ch.sweep_shadow >> ch.sweep_shift;
+    int frequency = ch.sweep_negate ? ch.sweep_shadow - delta : ch.sweep_shadow + delta;
+    if (frequency > 2047)
+        ch.enabled = false;
+    return frequency;
+}
+
+void APU::clock_sweep()
+{
+    SquareChannel& ch = state.square[0];
+    if (--ch.sweep_timer > 0)
+        return;
+    ch.sweep_timer = ch.sweep_period ? ch.sweep_period : 8;
+    if (!ch.sweep_enabled || (ch.sweep_period == 0))
+        return;
+
+    int frequency = sweep_calculate();
+    if ((frequency <= 2047) && (ch.sweep_shift > 0))
+    {
+        ch.frequency = frequency;
+        ch.sweep_shadow = frequency;
+        sweep_calculate();
+    }
+}
+
+void APU::trigger_square(int channel)
+{
+    SquareChannel& ch = state.square[channel];
+    ch.enabled = ch.dac_enabled;
+    if (ch.length == 0)
+        ch.length = 64;
+    ch.timer = (2048 - ch.frequency) * 4;
+    ch.volume = ch.envelope_initial;
+    ch.envelope_timer = ch.envelope_period;
+
+    if (channel == 0)
+    {
+        ch.sweep_shadow = ch.frequency;
+        ch.sweep_timer = ch.sweep_period ? ch.sweep_period : 8;
+        ch.sweep_enabled = (ch.sweep_period != 0) || (ch.sweep_shift != 0);
+        if (ch.sweep_shift)
+            sweep_calculate();
+    }
+}
+
+void APU::trigger_wave()
+{
+    WaveChannel& ch = state.wave;
+    ch.enabled = ch.dac_enabled;
+    if (ch.length == 0)
+        ch.length = 256;
+    ch.timer = (2048 - ch.frequency) * 2;
+    ch.position = 0;
+}
+
+void APU::trigger_noise()
+{
+    NoiseChannel& ch = state.noise;
+    ch.enabled = ch.dac_enabled;
+    if (ch.length == 0)
+        ch.length = 64;
+    ch.timer = NOISE_DIVISORS[ch.divisor_code] << ch.clock_shift;
+    ch.lfsr = 0x7FFF;
+    ch.volume = ch.envelope_initial;
+    ch.envelope_timer = ch.envelope_period;
+}
+
+// Register layout is documented at the top of GB.cpp. The channels are
+// caught up to the write first, so the change lands at the right sample.
+void APU::write_register(WORD address, BYTE data, uint64_t cycle)
+{
+    run_until(cycle);
+
+    // wave RAM is always writable
+    if ((address >= 0xFF30) && (address <= 0xFF3F))
+    {
+        state.wave.wave_ram[address - 0xFF30] = data;
+        return;
+    }
+
+    // while powered off everything but NR52 ignores writes
+    if (!state.power && (address != 0xFF26))
+        return;
+
+    int channel = (address >= 0xFF15) ? 1 : 0;
+    SquareChannel& square = state.square[channel];
+    WaveChannel& wave = state.wave;
+    NoiseChannel& noise = state.noise;
+
+    switch (address)
+    {
+        case 0xFF10: // NR10
+            square.sweep_period = (data >> 4) & 7;
+            square.sweep_negate = (data & 0x08) != 0;
+            square.sweep_shift = data & 7;
+            break;
+        case 0xFF11: // NR11
+        case 0xFF16: // NR21
+            square.duty = data >> 6;
+            square.length = 64 - (data & 0x3F);
+            break;
+        case 0xFF12: // NR12
+        case 0xFF17: // NR22
+            square.envelope_initial = data >> 4;
+            square.envelope_up = (data & 0x08) != 0;
+            square.envelope_period = data & 7;
+            square.dac_enabled = (data & 0xF8) != 0;
+            if (!square.dac_enabled)
+                square.enabled = false;
+            break;
+        case 0xFF13: // NR13
+        case 0xFF18: // NR23
+            square.frequency = (square.frequency & 0x700) | data;
+            break;
+        case 0xFF14: // NR14
+        case 0xFF19: // NR24
+            square.frequency = (square.frequency & 0xFF) | ((data & 7) << 8);
+            square.length_enable = (data & 0x40) != 0;
+            if (data & 0x80)
+                trigger_square(channel);
+            break;
+
+        case 0xFF1A: // NR30
+            wave.dac_enabled = (data & 0x80) != 0;
+            if (!wave.dac_enabled)
+                wave.enabled = false;
+            break;
+        case 0xFF1B: // NR31
+            wave.length = 256 - data;
+            break;
+        case 0xFF1C: // NR32
+            wave.volume_code = (data >> 5) & 3;
+            break;
+        case 0xFF1D: // NR33
+            wave.frequency = (wave.frequency & 0x700) | data;
+            break;
+        case 0xFF1E: // NR34
+            wave.frequency = (wave.frequency & 0xFF) | ((data & 7) << 8);
+            wave.length_enable = (data & 0x40) != 0;
+            if (data & 0x80)
+                trigger_wave();
+            break;
+
+        case 0xFF20: // NR41
+            noise.length = 64 - (data & 0x3F);
+            break;
+        case 0xFF21: // NR42
+            noise.envelope_initial = data >> 4;
+            noise.envelope_up = (data & 0x08) != 0;
+            noise.envelope_period = data & 7;
+            noise.dac_enabled = (data & 0xF8) != 0;
+            if (!noise.dac_enabled)
+                noise.enabled = false;
+            break;
+        case 0xFF22: // NR43
+            noise.clock_shift = data >> 4;
+            noise.width_7bit = (data & 0x08) != 0;
+            noise.divisor_code = data & 7;
+            break;
+        case 0xFF23: // NR44
+            noise.length_enable = (data & 0x40) != 0;
+            if (data & 0x80)
+                trigger_noise();
+            break;
+
+        case 0xFF24: // NR50
+            state.nr50 = data;
+            break;
+        case 0xFF25: // NR51
+            state.nr51 = data;
+            break;
+        case 0xFF26: // NR52, only the power bit is writable
+            if (!(data & 0x80) && state.power)
+            {
+                // powering off clears every register but wave RAM
+                BYTE wave_ram[16];
+                memcpy(wave_ram, state.wave.wave_ram, sizeof(wave_ram));
+                uint64_t last_cycle = state.last_cycle;
+                int sequencer_timer = state.sequencer_timer;
+                reset();
+                memcpy(state.wave.wave_ram, wave_ram, sizeof(wave_ram));
+                state.last_cycle = last_cycle;
+                state.sequencer_timer = sequencer_timer;
+            }
+            else if ((data & 0x80) && !state.power)
+            {
+                state.power = true;
+                state.sequencer_step = 0;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// NR52 read: power in bit 7, channel on flags in bits 0-3
+BYTE APU::read_status(uint64_t cycle)
+{
+    run_until(cycle);
+    BYTE status = 0x70;
+    if (state.power)
+        status |= 0x80;
+    if (state.square[0].enabled)
+        status |= 0x01;
+    if (state.square[1].enabled)
+        status |= 0x02;
+    if (state.wave.enabled)
+        status |= 0x04;
+    if (state.noise.enabled)
+        status |= 0x08;
+    return status;
+}
+
+void APU::set_output_enabled(bool enabled)
+{
+    output_enabled = enabled;
+    if (!enabled)
+        clear_output();
+}
+
+void APU::set_output_latency(int latency)
+{
+    if (latency == latency_ms)
+        return;
+    latency_ms = latency;
+    clear_output();
+}
+
+// Enough for the latency, plus a couple of frames since a frame's worth
+// arrives at once
+int APU::output_capacity() const
+{
+    return sample_rate * latency_ms / 1000 + sample_rate / 30;
+}
+
+// The output buffers, allocated if there are none and made this APU's
+// own if a copy still shares them
+APUOutput& APU::writable_output()
+{
+    if (!output)
+    {
+        output = std::make_shared<APUOutput>(output_capacity());
+        set_rate_adjust(rate_adjust);
+    }
+    else if (output.use_count() != 1)
+        output = std::make_shared<APUOutput>(*output);
+    return *output;
+}
+
+// Copies out up to max_frames stereo frames, returns how many. The
+// band-limited output goes through the DC blocking high pass on the way.
+size_t APU::read_samples(int16_t* out, size_t max_frames)
+{
+    if (!output)
+        return 0;
+    APUOutput& in = writable_output();
+    float l[256], r[256];
+    size_t frames = 0;
+    while (frames < max_frames)
+    {
+        int chunk = (max_frames - frames < 256) ? (int)(max_frames - frames) : 256;
+        chunk = in.left.read_samples(l, chunk);
+        in.right.read_samples(r, chunk);
+        if (chunk == 0)
+            break;
+
+        for (int k = 0; k < chunk; k++)
+        {
+            float filtered_left = l[k] - capacitor_left;
+            capacitor_left = l[k] - filtered_left * capacitor_charge;
+            float filtered_right = r[k] - capacitor_right;
+            capacitor_right = r[k] - filtered_right * capacitor_charge;
+
+            out[(frames + k) * 2] = clamp_sample(filtered_left * 16000.0f);
+            out[(frames + k) * 2 + 1] = clamp_sample(filtered_right * 16000.0f);
+        }
+        frames += chunk;
+    }
+    return frames;
+}
+
+size_t APU::samples_available() const
+{
+    return output ? output->left.samples_available() : 0;
+}
+
+// Lets go of the buffers, the next block that makes sound starts fresh
+// ones from silence
+size_t APU::output_memory() const
+{
+    if (!output || (output.use_count() != 1))
+        return 0;
+    return sizeof(APUOutput) + output->left.memory() + output->right.memory();
+}
+
+void APU::clear_output()
+{
+    output.reset();
+    for (int i = 0; i < 4; i++)
+    {
+        left_level[i] = 0;
+        right_level[i] = 0;
+    }
+}
+
+// Sample rate and the small speed-up/slow-down used by dynamic rate
+// control: adjust = +0.001 makes 0.1% more samples per emulated second
+void APU::set_sample_rate(int rate)
+{
+    if (rate == sample_rate)
+        return;
+    sample_rate = rate;
+    clear_output();
+}
+
+void APU::set_rate_adjust(double adjust)
+{
+    rate_adjust = adjust;
+    if (!output)
+        return;
+    APUOutput& out = writable_output();
+    out.left.set_rates(APU_CLOCKSPEED, sample_rate * (1.0 + adjust));
+    out.right.set_rates(APU_CLOCKSPEED, sample_rate * (1.0 + adjust));
+}
+
+int APU::get_sample_rate() const
+{
+    return sample_rate;
+}
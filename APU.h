@@ -0,0 +1,190 @@
+#ifndef APU_H
+#define APU_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "Blip.h"
+
+typedef unsigned char BYTE;
+typedef unsigned short WORD;
+
+#define APU_SAMPLE_RATE 48000
+#define APU_CLOCKSPEED 4194304
+// Latency the output buffers are sized for until told otherwise, the
+// same as AudioOutput's default
+#define APU_DEFAULT_LATENCY_MS 40
+
+// Frame sequencer ticks at 512Hz and clocks length, sweep and envelope
+#define APU_SEQUENCER_PERIOD (APU_CLOCKSPEED / 512)
+
+// Channel 1 and 2. Channel 2 just never uses the sweep fields.
+struct SquareChannel
+{
+    bool enabled;
+    bool dac_enabled;
+    BYTE duty;
+    int length;
+    bool length_enable;
+    WORD frequency;
+    int timer;          // cycles until the next duty step
+    int phase;          // 0-7 position in the duty pattern
+
+    int volume;
+    int envelope_initial;
+    bool envelope_up;
+    int envelope_period;
+    int envelope_timer;
+
+    int sweep_period;
+    bool sweep_negate;
+    int sweep_shift;
+    int sweep_timer;
+    bool sweep_enabled;
+    WORD sweep_shadow;
+};
+
+// Channel 3, plays the 32 4-bit samples in wave RAM (0xFF30-0xFF3F)
+struct WaveChannel
+{
+    bool enabled;
+    bool dac_enabled;
+    int length;
+    bool length_enable;
+    WORD frequency;
+    int timer;
+    int position;
+    int volume_code;
+    BYTE wave_ram[16];
+};
+
+// Channel 4, pseudo random noise from a 15-bit LFSR
+struct NoiseChannel
+{
+    bool enabled;
+    bool dac_enabled;
+    int length;
+    bool length_enable;
+    int timer;
+    int clock_shift;
+    bool width_7bit;
+    int divisor_code;
+    WORD lfsr;
+
+    int volume;
+    int envelope_initial;
+    bool envelope_up;
+    int envelope_period;
+    int envelope_timer;
+};
+
+// Everything that's emulated state, as opposed to output buffering.
+// Plain struct so it can live in GBState and be hashed / snapshotted.
+struct APUState
+{
+    SquareChannel square[2];
+    WaveChannel wave;
+    NoiseChannel noise;
+
+    BYTE nr50;
+    BYTE nr51;
+    bool power;
+
+    int sequencer_step;
+    int sequencer_timer;
+
+    // emulated cycle the channels have been brought up to
+    uint64_t last_cycle;
+};
+
+// The band-limited output, one step buffer per side
+struct APUOutput
+{
+    explicit APUOutput(int capacity) : left(capacity), right(capacity) {}
+
+    BlipBuffer left;
+    BlipBuffer right;
+};
+
+// Sound, registers 0xFF10-0xFF3F.
+//
+// Nothing runs per CPU cycle. Channel state is only brought forward
+// lazily, when a register is written, NR52 is read or the frame ends,
+// and then a whole block is run at once. Blocks are split at frame
+// sequencer ticks, so every channel parameter is constant inside one.
+// Within a block each channel hands its level changes to a pair of
+// band-limited step buffers at the exact cycle they happen, which
+// downsamples the ~1MHz channel output to the output rate without
+// aliasing.
+//
+// The buffers only exist while output is enabled and hold the output
+// latency plus a couple of frames. They're allocated by the first block
+// that makes sound and shared copy-on-write between copies of the APU,
+// so a clone that's switched off at once never allocates any.
+class APU
+{
+public:
+    APU();
+
+    void reset();
+    void write_register(WORD address, BYTE data, uint64_t cycle);
+    BYTE read_status(uint64_t cycle);
+    void run_until(uint64_t cycle);
+
+    // Output, interleaved stereo 16-bit. With output disabled the
+    // channels still run, they just don't make samples, and whatever
+    // was queued is dropped. Changing the rate or latency drops it too.
+    void set_output_enabled(bool enabled);
+    void set_output_latency(int latency_ms);
+    void set_sample_rate(int rate);
+    int get_sample_rate() const;
+    void set_rate_adjust(double adjust);
+    size_t read_samples(int16_t* out, size_t max_frames);
+    size_t samples_available() const;
+    void clear_output();
+    // bytes of output buffer only this APU holds
+    size_t output_memory() const;
+
+    APUState state;
+
+private:
+    void run_block(int cycles);
+    void skip_block(int cycles);
+    int output_capacity() const;
+    APUOutput& writable_output();
+    void clock_sequencer();
+    void clock_length();
+    void clock_envelopes();
+    void clock_sweep();
+    int sweep_calculate();
+
+    void trigger_square(int channel);
+    void trigger_wave();
+    void trigger_noise();
+
+    void set_level(int channel, int clock, float level);
+    void output_square(int channel, int cycles);
+    void output_wave(int cycles);
+    void output_noise(int cycles);
+
+    bool output_enabled;
+    int sample_rate;
+    int latency_ms;
+    double rate_adjust;
+
+    // NULL until a block makes sound
+    std::shared_ptr<APUOutput> output;
+    float left_gain[4];
+    float right_gain[4];
+    // each channel's current contribution to each side
+    float left_level[4];
+    float right_level[4];
+
+    // high pass (the DAC coupling capacitor), removes the DC offset
+    float capacitor_left;
+    float capacitor_right;
+    float capacitor_charge;
+};
+
+#endif
@@ -0,0 +1,148 @@
+#include <chrono>
+#include "AudioOutput.h"
+
+// most the output rate gets nudged, 0.5% is below what anyone hears
+#define MAX_RATE_ADJUST 0.005
+
+AudioOutput::AudioOutput(int latency_ms, int sample_rate)
+    : sample_rate(sample_rate), latency(latency_ms),
+      period_frames(sample_rate * latency_ms / 4000),
+      target_frames(sample_rate * latency_ms / 1000),
+      // pull_from() delivers a whole frame at once, so leave room for
+      // a couple of those on top of the target
+      ring(target_frames + sample_rate / 30),
+      running(false), underrun_count(0), overrun_count(0), counters(NULL), adjust(0)
+{
+    if (period_frames == 0)
+        period_frames = 1;
+}
+
+AudioOutput::~AudioOutput()
+{
+    stop();
+}
+
+void AudioOutput::start(Sink output_sink)
+{
+    if (running)
+        return;
+    sink = output_sink;
+    running = true;
+    consumer = std::thread(&AudioOutput::consumer_loop, this);
+}
+
+void AudioOutput::stop()
+{
+    if (!running)
+        return;
+    running = false;
+    consumer.join();
+}
+
+// Emulation thread side, call once per emulated frame
+void AudioOutput::pull_from(GB& gb)
+{
+    if (gb.get_audio_sample_rate() != sample_rate)
+        gb.set_audio_sample_rate(sample_rate);
+    gb.set_audio_latency(latency);
+
+    // Steer towards target_frames still buffered when the next frame
+    // arrives, which is the real safety margin: more than that means
+    // we're producing too fast, so make fewer samples per emulated
+    // second. The step is smoothed so the pitch never jumps.
+    double error = ((double)ring.size() - target_frames) / target_frames;
+    if (error > 1.0)
+        error = 1.0;
+    if (error < -1.0)
+        error = -1.0;
+    adjust += (-MAX_RATE_ADJUST * error - adjust) * 0.05;
+
+    // The APU is drained even when the ring is full, or its own buffer
+    // would overflow and drop the oldest sound instead of the newest
+    AudioFrame frames[1024];
+    size_t count;
+    size_t dropped = 0;
+    while ((count = gb.read_audio((int16_t*)frames, 1024)) > 0)
+        dropped += count - ring.push(frames, count);
+    if (dropped)
+    {
+        overrun_count.fetch_add(dropped, std::memory_order_relaxed);
+        if (counters)
+            counters->audio_overruns.fetch_add(dropped, std::memory_order_relaxed);
+    }
+    gb.set_audio_rate_adjust(adjust);
+}
+
+// Stands in for the sound card: every period, take a period of frames.
+// Nothing counts as an underrun until the ring first reaches half the
+// target, so start-up doesn't look like a glitch.
+void AudioOutput::consumer_loop()
+{
+    std::vector<AudioFrame> block(period_frames);
+    std::chrono::steady_clock::duration period = std::chrono::microseconds(
+        (long long)period_frames * 1000000 / sample_rate);
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    bool primed = false;
+
+    while (running)
+    {
+        next += period;
+        std::this_thread::sleep_until(next);
+
+        size_t got = 0;
+        if (!primed && (ring.size() >= target_frames / 2))
+            primed = true;
+        if (primed)
+        {
+            got = ring.pop(&block[0], period_frames);
+            if (got < period_frames)
+            {
+                underrun_count.fetch_add(1, std::memory_order_relaxed);
+                if (counters)
+                    counters->audio_underruns.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        for (size_t i = got; i < period_frames; i++)
+        {
+            block[i].left = 0;
+            block[i].right = 0;
+        }
+        if (sink)
+            sink(&block[0], period_frames);
+    }
+}
+
+void AudioOutput::set_counters(InstanceCounters* instance_counters)
+{
+    counters = instance_counters;
+}
+
+int AudioOutput::latency_ms() const
+{
+    return latency;
+}
+
+long AudioOutput::underruns() const
+{
+    return underrun_count.load(std::memory_order_relaxed);
+}
+
+long AudioOutput::overruns() const
+{
+    return overrun_count.load(std::memory_order_relaxed);
+}
+
+double AudioOutput::rate_adjust() const
+{
+    return adjust;
+}
+
+size_t AudioOutput::buffered() const
+{
+    return ring.size();
+}
+
+size_t AudioOutput::target_buffered() const
+{
+    return target_frames;
+}
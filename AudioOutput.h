@@ -0,0 +1,72 @@
+#ifndef AUDIOOUTPUT_H
+#define AUDIOOUTPUT_H
+
+#include <atomic>
+#include <functional>
+#include <thread>
+#include "SpscRing.h"
+#include "GB.h"
+#include "Metrics.h"
+
+struct AudioFrame
+{
+    int16_t left;
+    int16_t right;
+};
+
+// Moves sound from the emulation thread to an audio consumer thread.
+//
+// The emulation thread calls pull_from() once per frame, which drains
+// the APU into a lock-free ring. The consumer thread wakes every
+// period (a quarter of the latency), takes one period worth of frames
+// and hands them to the sink, which is where a sound card backend
+// plugs in. Running out counts as an underrun and is padded with
+// silence; sound that arrives with the ring full is dropped and counted
+// as overrun frames.
+//
+// The emulator and the sound card never run at exactly the same speed,
+// so pull_from() also nudges the APU's output rate by up to
+// MAX_RATE_ADJUST to keep about latency_ms of sound queued. That keeps video
+// and audio in sync without audible pitch changes or dropouts.
+class AudioOutput
+{
+public:
+    typedef std::function<void(const AudioFrame* frames, size_t count)> Sink;
+
+    AudioOutput(int latency_ms = 40, int sample_rate = APU_SAMPLE_RATE);
+    ~AudioOutput();
+
+    void start(Sink sink);
+    void stop();
+    void pull_from(GB& gb);
+    // underruns also go to these, set before start()
+    void set_counters(InstanceCounters* counters);
+
+    int latency_ms() const;
+    long underruns() const;
+    // frames of sound dropped because the ring was full
+    long overruns() const;
+    double rate_adjust() const;
+    size_t buffered() const;
+    // what pull_from() steers buffered() towards
+    size_t target_buffered() const;
+
+private:
+    void consumer_loop();
+
+    int sample_rate;
+    int latency;
+    size_t period_frames;
+    size_t target_frames;
+    SpscRing<AudioFrame> ring;
+
+    Sink sink;
+    std::thread consumer;
+    std::atomic<bool> running;
+    std::atomic<long> underrun_count;
+    std::atomic<long> overrun_count;
+    InstanceCounters* counters;
+    double adjust;
+};
+
+#endif
@@ -0,0 +1,687 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <initializer_list>
+#include <string>
+#include <vector>
+#include "GB.h"
+#include "Debugger.h"
+#include "Lockstep.h"
+#include "RamSearch.h"
+#include "Rewind.h"
+
+// Benchmark suite. Builds its own test ROMs, so it needs no game and the
+// numbers only change when the emulator does:
+//
+//   alu     tight loop of 8-bit/16-bit ALU, CB prefixed and DAA opcodes
+//   memcpy  4KB ROM -> WRAM copy loop, LD (HL+)/LD (DE) and a DEC BC loop
+//   scroll  background plus window, SCX/SCY moved every vblank
+//   sprites 40 8x16 sprites, moved and DMA'd to OAM every vblank
+//   diverge loop whose trip count comes from the joypad, for lockstep
+//           batches whose lanes hold different keys
+//
+// Each scene is also run as a batch of LOCKSTEP_LANES instances, one
+// after another with update() and by a LockstepBatch. RAM search filter
+// passes over WRAM are timed on the memcpy scene, and rewind history on
+// the sprites scene, as is state hashing once a frame. The debugger is
+// timed with a breakpoint and a read watchpoint that never hit, and
+// checked on the memcpy loop for where it stops.
+//
+// Results are one JSON record per line (scene, metric, value, unit), so
+// two runs can be diffed, or compared with --baseline.
+//
+// benchmark [--frames N] [--out results.json] [--baseline old.json] [--label name]
+
+#define BENCH_ENTRY 0x150
+#define BENCH_VBLANK_HANDLER 0x200
+// pseudo random tile data the scenes copy to VRAM
+#define BENCH_TILE_DATA 0x4000
+// the sprite scene's OAM table
+#define BENCH_SPRITE_TABLE 0x5000
+#define BENCH_WARMUP_FRAMES 30
+#define BENCH_INSTANCES 200
+// lockstep batches run this share of --frames
+#define BENCH_LOCKSTEP_DIVISOR 10
+// RAM search: instances in the batch pass, and passes timed
+#define BENCH_SEARCH_INSTANCES 64
+#define BENCH_SEARCH_PASSES 1000
+
+// A 32KB no-MBC ROM, assembled by hand a byte at a time
+class SyntheticRom
+{
+public:
+    SyntheticRom() : image(0x8000, 0), pc(BENCH_ENTRY)
+    {
+        // entry point: NOP; JP BENCH_ENTRY
+        put(0x100, {0x00, 0xC3, BENCH_ENTRY & 0xFF, BENCH_ENTRY >> 8});
+        memcpy(&image[0x134], "BENCHMARK", 9);
+        // vblank interrupt: JP BENCH_VBLANK_HANDLER
+        put(0x40, {0xC3, BENCH_VBLANK_HANDLER & 0xFF, BENCH_VBLANK_HANDLER >> 8});
+
+        uint32_t seed = 0x12345678;
+        for (int i = 0; i < 0x1000; i++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            image[BENCH_TILE_DATA + i] = seed >> 24;
+        }
+    }
+
+    void emit(std::initializer_list<BYTE> bytes)
+    {
+        put(pc, bytes);
+        pc += bytes.size();
+    }
+
+    // JR/JR cc (opcode) back to an earlier address
+    void jump_back(BYTE opcode, WORD target)
+    {
+        emit({opcode, (BYTE)(target - (pc + 2))});
+    }
+
+    void put(WORD address, std::initializer_list<BYTE> bytes)
+    {
+        for (BYTE value : bytes)
+            image[address++] = value;
+    }
+
+    void origin(WORD address)
+    {
+        pc = address;
+    }
+
+    WORD here() const
+    {
+        return pc;
+    }
+
+    // LD HL,source; LD DE,destination; LD BC,length; then
+    // LD A,(HL+); LD (DE),A; INC DE; DEC BC; LD A,B; OR C; JR NZ
+    void copy(WORD source, WORD destination, WORD length)
+    {
+        emit({0x21, (BYTE)source, (BYTE)(source >> 8)});
+        emit({0x11, (BYTE)destination, (BYTE)(destination >> 8)});
+        emit({0x01, (BYTE)length, (BYTE)(length >> 8)});
+        WORD loop = here();
+        emit({0x2A, 0x12, 0x13, 0x0B, 0x78, 0xB1});
+        jump_back(0x20, loop);
+    }
+
+    // Tile data from the pseudo random block, both tile maps filled with
+    // incrementing tile numbers, ordinary palettes
+    void video_setup()
+    {
+        copy(BENCH_TILE_DATA, 0x8000, 0x1000);
+        emit({0x21, 0x00, 0x98, 0x01, 0x00, 0x08});
+        WORD loop = here();
+        // LD A,L; XOR H; LD (HL+),A; DEC BC; LD A,B; OR C; JR NZ
+        emit({0x7D, 0xAC, 0x22, 0x0B, 0x78, 0xB1});
+        jump_back(0x20, loop);
+        emit({0x3E, 0xE4, 0xE0, 0x47, 0xE0, 0x48, 0xE0, 0x49});
+    }
+
+    // LCDC = control, IE = vblank, EI, then HALT until the next frame forever
+    void halt_loop(BYTE control)
+    {
+        emit({0x3E, control, 0xE0, 0x40});
+        emit({0x3E, 0x01, 0xE0, 0xFF, 0xFB});
+        WORD loop = here();
+        emit({0x76});
+        jump_back(0x18, loop);
+    }
+
+    std::vector<BYTE> image;
+
+private:
+    WORD pc;
+};
+
+static std::vector<BYTE> alu_rom()
+{
+    SyntheticRom rom;
+    rom.emit({0x31, 0xFE, 0xFF});
+    WORD loop = rom.here();
+    // ADD A,B; XOR C; INC C; DEC D; ADC A,E; SUB B; AND 0x7F; OR L; RLCA;
+    // CP H; SWAP A; RL C; INC HL; ADD HL,DE; DAA; JR loop
+    rom.emit({0x80, 0xA9, 0x0C, 0x15, 0x8B, 0x90, 0xE6, 0x7F, 0xB5, 0x07,
+              0xBC, 0xCB, 0x37, 0xCB, 0x11, 0x23, 0x19, 0x27});
+    rom.jump_back(0x18, loop);
+    return rom.image;
+}
+
+static std::vector<BYTE> memcpy_rom()
+{
+    SyntheticRom rom;
+    WORD loop = rom.here();
+    rom.copy(BENCH_TILE_DATA, 0xC000, 0x1000);
+    rom.jump_back(0x18, loop);
+    return rom.image;
+}
+
+static std::vector<BYTE> scroll_rom()
+{
+    SyntheticRom rom;
+    rom.video_setup();
+    // window at (0x50, 0x40) from the 0x9C00 map
+    rom.emit({0x3E, 0x40, 0xE0, 0x4A, 0x3E, 0x57, 0xE0, 0x4B});
+    // LCD on, window map 0x9C00, window on, tiles at 0x8000, BG on
+    rom.halt_loop(0xF1);
+
+    // PUSH AF; SCX += 1; SCY += 1; POP AF; RETI
+    rom.origin(BENCH_VBLANK_HANDLER);
+    rom.emit({0xF5, 0xF0, 0x43, 0x3C, 0xE0, 0x43, 0xF0, 0x42, 0x3C, 0xE0, 0x42, 0xF1, 0xD9});
+    return rom.image;
+}
+
+static std::vector<BYTE> sprites_rom()
+{
+    SyntheticRom rom;
+    for (int sprite = 0; sprite < 40; sprite++)
+    {
+        rom.put(BENCH_SPRITE_TABLE + sprite * 4, {
+            (BYTE)(16 + (sprite * 37) % 136),
+            (BYTE)(8 + (sprite * 23) % 152),
+            (BYTE)(sprite * 2),
+            (BYTE)(((sprite & 3) << 5) | ((sprite & 4) << 2))});
+    }
+    rom.video_setup();
+    rom.copy(BENCH_SPRITE_TABLE, 0xC100, 0xA0);
+    rom.emit({0x3E, 0xC1, 0xE0, 0x46});
+    // LCD on, tiles at 0x8000, 8x16 sprites on, BG on
+    rom.halt_loop(0x97);
+
+    // every sprite one pixel right, then DMA the table to OAM
+    rom.origin(BENCH_VBLANK_HANDLER);
+    rom.emit({0xF5, 0xC5, 0xE5, 0x21, 0x01, 0xC1, 0x06, 0x28});
+    WORD loop = rom.here();
+    rom.emit({0x34, 0x2C, 0x2C, 0x2C, 0x2C, 0x05});
+    rom.jump_back(0x20, loop);
+    rom.emit({0x3E, 0xC1, 0xE0, 0x46, 0xE1, 0xC1, 0xF1, 0xD9});
+    return rom.image;
+}
+
+static std::vector<BYTE> diverge_rom()
+{
+    SyntheticRom rom;
+    rom.emit({0x31, 0xFE, 0xFF, 0x21, 0x00, 0xC0});
+    WORD loop = rom.here();
+    // select the direction keys and loop once more than there are held:
+    // LD A,0x20; LDH (0x00),A; LDH A,(0x00); CPL; AND 0x0F; INC A; LD B,A
+    rom.emit({0x3E, 0x20, 0xE0, 0x00, 0xF0, 0x00, 0x2F, 0xE6, 0x0F, 0x3C, 0x47});
+    WORD inner = rom.here();
+    // ADD A,C; XOR B; INC HL; LD (HL),A; DEC B; JR NZ
+    rom.emit({0x81, 0xA8, 0x23, 0x77, 0x05});
+    rom.jump_back(0x20, inner);
+    // the same for every lane: SUB L; RLCA; LD C,A; PUSH HL; CALL mix;
+    // POP HL; LD A,H; AND 0x1F; OR 0xC0; LD H,A; JR loop
+    rom.emit({0x95, 0x07, 0x4F, 0xE5, 0xCD, 0x00, 0x03, 0xE1, 0x7C, 0xE6, 0x1F, 0xF6, 0xC0, 0x67});
+    rom.jump_back(0x18, loop);
+
+    // mix: SWAP C; ADC A,C; BIT 3,A; JR Z,+1; INC E; RET
+    rom.origin(0x300);
+    rom.emit({0xCB, 0x31, 0x89, 0xCB, 0x5F, 0x28, 0x01, 0x1C, 0xC9});
+    return rom.image;
+}
+
+struct Result
+{
+    string scene;
+    string metric;
+    double value;
+    string unit;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Resident set size in bytes
+static size_t resident_bytes()
+{
+    long pages_total = 0;
+    long pages_resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+        return 0;
+    if (fscanf(statm, "%ld %ld", &pages_total, &pages_resident) != 2)
+        pages_resident = 0;
+    fclose(statm);
+    return (size_t)pages_resident * sysconf(_SC_PAGESIZE);
+}
+
+// Frames per second and instructions per second for `frames` frames
+static void run_frames(GB& gb, int frames, double& frames_per_second, double& instructions_per_second)
+{
+    InstanceCounters counters("bench");
+    gb.set_counters(&counters);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+        gb.update();
+    double elapsed = seconds_since(start);
+    gb.set_counters(NULL);
+    frames_per_second = frames / elapsed;
+    instructions_per_second = counters.instructions.load() / elapsed;
+}
+
+// Draws each visible line of whatever is in VRAM/OAM `repeats` times,
+// timing render_tiles() and render_sprites() separately. LY is set
+// through load_page so nothing else about the machine moves.
+static void time_renderers(GB& gb, int repeats, double& tiles_ns, double& sprites_ns)
+{
+    BYTE io[MEM_PAGE_SIZE];
+    memcpy(io, gb.page_data(IO_PAGE), MEM_PAGE_SIZE);
+    BYTE saved_line = io[0x44];
+    double tiles = 0;
+    double sprites = 0;
+    for (int repeat = 0; repeat < repeats; repeat++)
+    {
+        for (int line = 0; line < 144; line++)
+        {
+            io[0x44] = line;
+            gb.load_page(IO_PAGE, io);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            gb.render_tiles();
+            std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+            gb.render_sprites();
+            std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+            tiles += std::chrono::duration<double>(middle - start).count();
+            sprites += std::chrono::duration<double>(end - middle).count();
+        }
+    }
+    io[0x44] = saved_line;
+    gb.load_page(IO_PAGE, io);
+    tiles_ns = tiles * 1e9 / (repeats * 144);
+    sprites_ns = sprites * 1e9 / (repeats * 144);
+}
+
+static void bench_scene(const string& scene, const std::vector<BYTE>& rom, int frames,
+                        bool renders, std::vector<Result>& results)
+{
+    GB gb(rom);
+    gb.set_audio_enabled(false);
+    for (int frame = 0; frame < BENCH_WARMUP_FRAMES; frame++)
+        gb.update();
+
+    double fps = 0;
+    double ips = 0;
+    gb.set_rendering(false);
+    run_frames(gb, frames, fps, ips);
+    results.push_back({scene, "instructions_per_second", ips, "1/s"});
+    results.push_back({scene, "frames_per_second_headless", fps, "1/s"});
+
+    gb.set_rendering(true);
+    run_frames(gb, frames, fps, ips);
+    results.push_back({scene, "frames_per_second_rendered", fps, "1/s"});
+
+    if (renders)
+    {
+        double tiles_ns = 0;
+        double sprites_ns = 0;
+        time_renderers(gb, std::max(1, frames / 10), tiles_ns, sprites_ns);
+        results.push_back({scene, "render_tiles_per_scanline", tiles_ns, "ns"});
+        results.push_back({scene, "render_sprites_per_scanline", sprites_ns, "ns"});
+    }
+}
+
+// Power on and clone cost, and what each instance keeps resident
+static void bench_instances(const std::vector<BYTE>& rom, std::vector<Result>& results)
+{
+    std::vector<GB*> instances;
+    size_t resident_before = resident_bytes();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_INSTANCES; i++)
+        instances.push_back(new GB(rom));
+    double startup = seconds_since(start);
+    size_t resident_after = resident_bytes();
+    results.push_back({"instance", "startup_time", startup * 1e6 / BENCH_INSTANCES, "us"});
+    results.push_back({"instance", "instance_memory", (double)instances[0]->instance_memory(), "bytes"});
+    results.push_back({"instance", "resident_per_instance",
+                       (double)(resident_after - resident_before) / BENCH_INSTANCES, "bytes"});
+
+    // clones, after a frame so there is something to share
+    instances[0]->update();
+    std::vector<GB*> clones;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_INSTANCES; i++)
+        clones.push_back(instances[0]->clone());
+    double clone_time = seconds_since(start);
+    clones[0]->update();
+    results.push_back({"instance", "clone_time", clone_time * 1e6 / BENCH_INSTANCES, "us"});
+    results.push_back({"instance", "clone_memory_after_frame", (double)clones[0]->instance_memory(), "bytes"});
+
+    for (size_t i = 0; i < clones.size(); i++)
+        delete clones[i];
+    for (size_t i = 0; i < instances.size(); i++)
+        delete instances[i];
+}
+
+// Frames per second under the debugger with `watch` set on an address
+// the scene never touches, a breakpoint otherwise
+static double debugger_fps(const std::vector<BYTE>& rom, int frames, bool watch)
+{
+    GB gb(rom);
+    gb.set_audio_enabled(false);
+    gb.set_rendering(false);
+    Debugger debugger(gb);
+    if (watch)
+        debugger.add_watchpoint(0xFF80, 0xFF80, WATCH_READ);
+    else
+        debugger.add_breakpoint(0x7FFF);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+        debugger.run();
+    return frames / seconds_since(start);
+}
+
+// The memcpy loop starts LD HL,nn at the entry point, then LD DE,nn;
+// LD BC,nn; LD A,(HL+) reading the tile data. With a read watch on the
+// tile data, a breakpoint on the LD A,(HL+) has to stop before it runs,
+// a step from the LD BC has to land on it, and the watch has to stop
+// right after it.
+static void bench_debugger(const std::vector<BYTE>& rom, int frames, std::vector<Result>& results)
+{
+    const WORD load_bc = BENCH_ENTRY + 6;
+    const WORD load_a = BENCH_ENTRY + 9;
+
+    GB first(rom);
+    Debugger breaking(first);
+    breaking.add_watchpoint(BENCH_TILE_DATA, BENCH_TILE_DATA + 0xFFF, WATCH_READ);
+    breaking.add_breakpoint(load_a);
+    breaking.run();
+    const DebugStop& at_breakpoint = breaking.last_stop();
+    bool breakpoint_stops = (at_breakpoint.reason == DEBUG_BREAKPOINT) && (at_breakpoint.pc == load_a);
+    breaking.run();
+    const DebugStop& at_watch = breaking.last_stop();
+    bool watch_stops = (at_watch.reason == DEBUG_WATCH_READ) && (at_watch.pc == load_a + 1) &&
+                       (at_watch.address == BENCH_TILE_DATA);
+
+    GB second(rom);
+    Debugger stepping(second);
+    stepping.add_watchpoint(BENCH_TILE_DATA, BENCH_TILE_DATA + 0xFFF, WATCH_READ);
+    stepping.add_breakpoint(load_bc);
+    stepping.run();
+    stepping.step();
+    const DebugStop& after_step = stepping.last_stop();
+    bool step_stops = (after_step.reason == DEBUG_STEP) && (after_step.pc == load_a);
+
+    results.push_back({"debugger", "frames_per_second_breakpoint", debugger_fps(rom, frames, false), "1/s"});
+    results.push_back({"debugger", "frames_per_second_read_watch", debugger_fps(rom, frames, true), "1/s"});
+    results.push_back({"debugger", "stops_match", (breakpoint_stops && watch_stops && step_stops) ? 1.0 : 0.0, ""});
+}
+
+// state_hash() once a frame against a full rehash of the same state,
+// timing only the hashing
+static void bench_hash(const std::vector<BYTE>& rom, int frames, std::vector<Result>& results)
+{
+    GB gb(rom);
+    gb.set_audio_enabled(false);
+    for (int frame = 0; frame < BENCH_WARMUP_FRAMES; frame++)
+        gb.update();
+    gb.state_hash();
+
+    double incremental = 0;
+    double full = 0;
+    bool match = true;
+    for (int frame = 0; frame < frames; frame++)
+    {
+        gb.update();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        uint64_t hash = gb.state_hash();
+        std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+        uint64_t full_hash = gb.full_state_hash();
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        incremental += std::chrono::duration<double>(middle - start).count();
+        full += std::chrono::duration<double>(end - middle).count();
+        if (hash != full_hash)
+            match = false;
+    }
+    results.push_back({"hash", "incremental_hash_per_frame", incremental * 1e6 / frames, "us"});
+    results.push_back({"hash", "full_rehash_per_frame", full * 1e6 / frames, "us"});
+    results.push_back({"hash", "hashes_match", match ? 1.0 : 0.0, ""});
+}
+
+// Rewind history over `frames` frames of a scene, then stepped all the
+// way back one frame at a time. Where it lands has to be where the
+// history starts.
+static void bench_rewind(const string& scene, const std::vector<BYTE>& rom, int frames,
+                         std::vector<Result>& results)
+{
+    GB gb(rom);
+    gb.set_audio_enabled(false);
+    for (int frame = 0; frame < BENCH_WARMUP_FRAMES; frame++)
+        gb.update();
+
+    Rewind rewind(gb);
+    std::vector<uint64_t> hashes(1, gb.full_state_hash());
+    for (int frame = 0; frame < frames; frame++)
+    {
+        gb.update();
+        rewind.capture();
+        hashes.push_back(gb.full_state_hash());
+    }
+    double bytes_per_second = rewind.bytes_per_second();
+    double capture_time = rewind.capture_time();
+
+    int stepped = 0;
+    while (rewind.step_back())
+        stepped++;
+    bool match = gb.full_state_hash() == hashes[frames - stepped];
+
+    string name = "rewind_" + scene;
+    results.push_back({name, "history_bytes_per_second", bytes_per_second, "bytes"});
+    results.push_back({name, "capture_time", capture_time * 1e6, "us"});
+    results.push_back({name, "rewind_step_time", rewind.step_time() * 1e6, "us"});
+    results.push_back({name, "states_match", match ? 1.0 : 0.0, ""});
+}
+
+// LOCKSTEP_LANES instances of a scene, each holding a different set of
+// direction keys, run for the same frames one after another and as a
+// LockstepBatch. The two batches have to end up in the same states.
+static void bench_lockstep(const string& scene, const std::vector<BYTE>& rom, int frames,
+                           std::vector<Result>& results)
+{
+    std::vector<GB*> batch;
+    std::vector<GB*> lanes;
+    for (int lane = 0; lane < 2 * LOCKSTEP_LANES; lane++)
+    {
+        GB* gb = new GB(rom);
+        gb->set_audio_enabled(false);
+        gb->set_rendering(false);
+        gb->set_joypad(lane % LOCKSTEP_LANES);
+        (lane < LOCKSTEP_LANES ? batch : lanes).push_back(gb);
+    }
+
+    InstanceCounters batch_counters("batch");
+    for (size_t i = 0; i < batch.size(); i++)
+        batch[i]->set_counters(&batch_counters);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        for (size_t i = 0; i < batch.size(); i++)
+            batch[i]->update();
+    }
+    double batch_time = seconds_since(start);
+
+    InstanceCounters lockstep_counters("lockstep");
+    for (size_t i = 0; i < lanes.size(); i++)
+        lanes[i]->set_counters(&lockstep_counters);
+    LockstepBatch lockstep(lanes);
+    start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+        lockstep.update();
+    double lockstep_time = seconds_since(start);
+
+    bool match = true;
+    for (size_t i = 0; i < batch.size(); i++)
+        match = match && (batch[i]->full_state_hash() == lanes[i]->full_state_hash());
+
+    const LockstepStats& stats = lockstep.stats();
+    string name = "lockstep_" + scene;
+    results.push_back({name, "batch_instructions_per_second", batch_counters.instructions.load() / batch_time, "1/s"});
+    results.push_back({name, "lockstep_instructions_per_second",
+                       lockstep_counters.instructions.load() / lockstep_time, "1/s"});
+    results.push_back({name, "lane_utilization", 100.0 * stats.utilization(), "%"});
+    results.push_back({name, "vector_share", 100.0 * stats.vector_share(), "%"});
+    results.push_back({name, "states_match", match ? 1.0 : 0.0, ""});
+
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        delete batch[i];
+        delete lanes[i];
+    }
+}
+
+// Average time for a "changed" filter over all of WRAM from a full
+// candidate set, per instance, frames apart so the memory has moved
+static double time_search(RamSearch& search, std::vector<GB*>& instances, int passes)
+{
+    double total = 0;
+    for (int pass = 0; pass < passes; pass++)
+    {
+        search.reset();
+        for (size_t i = 0; i < instances.size(); i++)
+            instances[i]->update();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        search.filter(RAM_CHANGED);
+        total += seconds_since(start);
+    }
+    return total * 1e6 / (passes * instances.size());
+}
+
+static void bench_ram_search(const std::vector<BYTE>& rom, std::vector<Result>& results)
+{
+    std::vector<GB*> instances;
+    for (int i = 0; i < BENCH_SEARCH_INSTANCES; i++)
+    {
+        instances.push_back(new GB(rom));
+        instances[i]->set_audio_enabled(false);
+        instances[i]->set_rendering(false);
+    }
+    std::vector<GB*> single(1, instances[0]);
+    RamSearch bytes(single, RAM_WRAM, 1);
+    RamSearch words(single, RAM_WRAM, 2);
+    RamSearch batch(instances, RAM_WRAM, 1);
+    results.push_back({"ram_search", "wram_filter_8bit", time_search(bytes, single, BENCH_SEARCH_PASSES), "us"});
+    results.push_back({"ram_search", "wram_filter_16bit", time_search(words, single, BENCH_SEARCH_PASSES), "us"});
+    results.push_back({"ram_search", "batch_wram_filter_per_instance",
+                       time_search(batch, instances, BENCH_SEARCH_PASSES / BENCH_SEARCH_INSTANCES), "us"});
+    for (size_t i = 0; i < instances.size(); i++)
+        delete instances[i];
+}
+
+static void write_results(FILE* out, const string& label, int frames, const std::vector<Result>& results)
+{
+    fprintf(out, "{\"label\": \"%s\", \"frames\": %d, \"results\": [\n", label.c_str(), frames);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        fprintf(out, "  {\"scene\": \"%s\", \"metric\": \"%s\", \"value\": %.6g, \"unit\": \"%s\"}%s\n",
+                results[i].scene.c_str(), results[i].metric.c_str(), results[i].value,
+                results[i].unit.c_str(), (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+// Reads the records back out of an earlier run's output
+static bool read_results(const char* path, std::vector<Result>& results)
+{
+    FILE* in = fopen(path, "r");
+    if (!in)
+        return false;
+    char line[512];
+    while (fgets(line, sizeof(line), in))
+    {
+        char scene[64];
+        char metric[64];
+        double value;
+        if (sscanf(line, " {\"scene\": \"%63[^\"]\", \"metric\": \"%63[^\"]\", \"value\": %lf",
+                   scene, metric, &value) == 3)
+            results.push_back({scene, metric, value, ""});
+    }
+    fclose(in);
+    return true;
+}
+
+static void print_comparison(const std::vector<Result>& baseline, const std::vector<Result>& results)
+{
+    fprintf(stderr, "%-10s %-30s %14s %14s %8s\n", "scene", "metric", "baseline", "now", "change");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        for (size_t j = 0; j < baseline.size(); j++)
+        {
+            if ((baseline[j].scene != results[i].scene) || (baseline[j].metric != results[i].metric))
+                continue;
+            fprintf(stderr, "%-10s %-30s %14.6g %14.6g %+7.1f%%\n", results[i].scene.c_str(),
+                    results[i].metric.c_str(), baseline[j].value, results[i].value,
+                    baseline[j].value ? 100.0 * (results[i].value / baseline[j].value - 1) : 0.0);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int frames = 600;
+    const char* out_path = NULL;
+    const char* baseline_path = NULL;
+    string label = "";
+    for (int i = 1; i < argc; i += 2)
+    {
+        string option = argv[i];
+        // every option takes a value
+        if (i + 1 >= argc)
+            option = "";
+        if (option == "--frames")
+            frames = std::max(1, atoi(argv[i + 1]));
+        else if (option == "--out")
+            out_path = argv[i + 1];
+        else if (option == "--baseline")
+            baseline_path = argv[i + 1];
+        else if (option == "--label")
+            label = argv[i + 1];
+        else
+        {
+            fprintf(stderr, "usage: benchmark [--frames N] [--out results.json] [--baseline old.json] [--label name]\n");
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    bench_scene("alu", alu_rom(), frames, false, results);
+    bench_scene("memcpy", memcpy_rom(), frames, false, results);
+    bench_scene("scroll", scroll_rom(), frames, true, results);
+    bench_scene("sprites", sprites_rom(), frames, true, results);
+    bench_instances(alu_rom(), results);
+    bench_hash(sprites_rom(), frames, results);
+    bench_debugger(memcpy_rom(), frames, results);
+    bench_rewind("sprites", sprites_rom(), frames, results);
+    int lockstep_frames = std::max(1, frames / BENCH_LOCKSTEP_DIVISOR);
+    bench_lockstep("alu", alu_rom(), lockstep_frames, results);
+    bench_lockstep("memcpy", memcpy_rom(), lockstep_frames, results);
+    bench_lockstep("scroll", scroll_rom(), lockstep_frames, results);
+    bench_lockstep("sprites", sprites_rom(), lockstep_frames, results);
+    bench_lockstep("diverge", diverge_rom(), lockstep_frames, results);
+    bench_ram_search(memcpy_rom(), results);
+
+    FILE* out = stdout;
+    if (out_path && !(out = fopen(out_path, "w")))
+    {
+        fprintf(stderr, "Couldn't open %s\n", out_path);
+        return 1;
+    }
+    write_results(out, label, frames, results);
+    if (out != stdout)
+        fclose(out);
+
+    if (baseline_path)
+    {
+        std::vector<Result> baseline;
+        if (!read_results(baseline_path, baseline))
+        {
+            fprintf(stderr, "Couldn't read %s\n", baseline_path);
+            return 1;
+        }
+        print_comparison(baseline, results);
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include <math.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "Blip.h"
+
+// passband edge as a fraction of the output Nyquist frequency
+#define BLIP_CUTOFF 0.9
+
+// One band-limited impulse per sub-sample phase, each normalized to a
+// sum of 1 so a step of `delta` integrates to exactly `delta`
+struct BlipKernel
+{
+    float taps[BLIP_PHASES][BLIP_TAPS];
+
+    BlipKernel()
+    {
+        const double half = BLIP_TAPS / 2;
+        for (int phase = 0; phase < BLIP_PHASES; phase++)
+        {
+            double sum = 0;
+            for (int k = 0; k < BLIP_TAPS; k++)
+            {
+                // impulse centred half the kernel after the step
+                double t = (k - half + 1) - (double)phase / BLIP_PHASES;
+                double x = M_PI * BLIP_CUTOFF * t;
+                double sinc = (fabs(x) < 1e-9) ? 1.0 : sin(x) / x;
+                double w = (t + half) / BLIP_TAPS;
+                double blackman = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+                taps[phase][k] = (float)(sinc * blackman);
+                sum += taps[phase][k];
+            }
+            for (int k = 0; k < BLIP_TAPS; k++)
+                taps[phase][k] = (float)(taps[phase][k] / sum);
+        }
+    }
+};
+
+static const BlipKernel& blip_kernel()
+{
+    static BlipKernel kernel;
+    return kernel;
+}
+
+BlipBuffer::BlipBuffer(int capacity)
+    : factor(0), offset(0), buffer(capacity + BLIP_TAPS, 0.0f), integrator(0)
+{
+    blip_kernel();
+}
+
+void BlipBuffer::set_rates(double clock_rate, double sample_rate)
+{
+    factor = (uint64_t)(sample_rate / clock_rate * 4294967296.0);
+}
+
+void BlipBuffer::add_delta(int clock, float delta)
+{
+    uint64_t position = offset + clock * factor;
+    int index = (int)(position >> 32);
+    int phase = (int)(position >> (32 - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1);
+    const float* taps = blip_kernel().taps[phase];
+    float* out = &buffer[index];
+
+#ifdef __SSE2__
+    __m128 scale = _mm_set1_ps(delta);
+    for (int k = 0; k < BLIP_TAPS; k += 4)
+    {
+        __m128 sum = _mm_add_ps(_mm_loadu_ps(out + k), _mm_mul_ps(_mm_loadu_ps(taps + k), scale));
+        _mm_storeu_ps(out + k, sum);
+    }
+#else
+    for (int k = 0; k < BLIP_TAPS; k++)
+        out[k] += taps[k] * delta;
+#endif
+}
+
+void BlipBuffer::advance(int clocks)
+{
+    offset += clocks * factor;
+}
+
+int BlipBuffer::samples_available() const
+{
+    return (int)(offset >> 32);
+}
+
+// samples that can still be produced before the buffer is full
+int BlipBuffer::room() const
+{
+    return (int)buffer.size() - BLIP_TAPS - samples_available();
+}
+
+// Integrate and remove up to `count` finished samples
+int BlipBuffer::read_samples(float* out, int count)
+{
+    int available = samples_available();
+    if (count > available)
+        count = available;
+
+    float sum = integrator;
+    for (int i = 0; i < count; i++)
+    {
+        sum += buffer[i];
+        if (out)
+            out[i] = sum;
+    }
+    integrator = sum;
+
+    // keep the tails of impulses that reach past what we read
+    int remaining = available - count + BLIP_TAPS;
+    memmove(&buffer[0], &buffer[count], remaining * sizeof(float));
+    memset(&buffer[remaining], 0, count * sizeof(float));
+    offset -= (uint64_t)count << 32;
+    return count;
+}
+
+void BlipBuffer::clear()
+{
+    offset &= 0xFFFFFFFFULL;
+    integrator = 0;
+    memset(&buffer[0], 0, buffer.size() * sizeof(float));
+}
+
+size_t BlipBuffer::memory() const
+{
+    return buffer.capacity() * sizeof(float);
+}
@@ -0,0 +1,42 @@
+#ifndef BLIP_H
+#define BLIP_H
+
+#include <stdint.h>
+#include <vector>
+
+#define BLIP_PHASE_BITS 5
+#define BLIP_PHASES (1 << BLIP_PHASE_BITS)
+#define BLIP_TAPS 16
+
+// Band-limited step synthesis. The APU channels only ever change level
+// in steps, so instead of point sampling them at 48kHz (which aliases
+// badly) each step is added as a windowed sinc impulse at its exact
+// sub-sample position, and reading integrates the impulses back into
+// band-limited steps.
+//
+// Time is given in input clocks relative to the start of the current
+// block; advance() ends the block.
+class BlipBuffer
+{
+public:
+    explicit BlipBuffer(int capacity);
+
+    void set_rates(double clock_rate, double sample_rate);
+    void add_delta(int clock, float delta);
+    void advance(int clocks);
+
+    int samples_available() const;
+    int room() const;
+    int read_samples(float* out, int count);
+    void clear();
+    // heap bytes behind the buffer
+    size_t memory() const;
+
+private:
+    uint64_t factor;    // 32.32 output samples per input clock
+    uint64_t offset;    // 32.32 position of clock 0 from the buffer start
+    std::vector<float> buffer;
+    float integrator;
+};
+
+#endif
@@ -0,0 +1,323 @@
+#include <string.h>
+#include <algorithm>
+#include "Debugger.h"
+#include "GB.h"
+
+Debugger::Debugger(GB& instance)
+    : gb(instance), next_id(1), checking(false), watching_reads(false), steps_left(-1), evaluating(false),
+      current_subsystem(PROFILE_OTHER), skip_once(false), skip_pc(0)
+{
+    memset(pc_bits, 0, sizeof(pc_bits));
+    memset(&pending, 0, sizeof(pending));
+    memset(&stop, 0, sizeof(stop));
+    gb.attach_debugger(this);
+}
+
+Debugger::~Debugger()
+{
+    gb.attach_debugger(NULL);
+}
+
+int Debugger::add_breakpoint(WORD pc, DebugCondition condition)
+{
+    Breakpoint breakpoint = {next_id++, pc, condition, false, 0};
+    breakpoints.push_back(breakpoint);
+    update_pc_bits();
+    return breakpoint.id;
+}
+
+int Debugger::add_watchpoint(WORD start, WORD end, int kinds, DebugCondition condition)
+{
+    Watchpoint watchpoint = {next_id++, start, std::max(start, end), kinds, condition};
+    watchpoints.push_back(watchpoint);
+    update_watched_pages();
+    return watchpoint.id;
+}
+
+void Debugger::remove(int id)
+{
+    breakpoints.erase(std::remove_if(breakpoints.begin(), breakpoints.end(),
+                                     [id](const Breakpoint& b) { return b.id == id; }), breakpoints.end());
+    watchpoints.erase(std::remove_if(watchpoints.begin(), watchpoints.end(),
+                                     [id](const Watchpoint& w) { return w.id == id; }), watchpoints.end());
+    update_pc_bits();
+    update_watched_pages();
+}
+
+void Debugger::clear()
+{
+    breakpoints.clear();
+    watchpoints.clear();
+    update_pc_bits();
+    update_watched_pages();
+}
+
+bool Debugger::run()
+{
+    stop.reason = DEBUG_NONE;
+    return !gb.run_frame(*this);
+}
+
+void Debugger::step()
+{
+    steps_left = 1;
+    update_checking();
+    run();
+}
+
+// A CALL or RST gets a temporary breakpoint on the instruction after it,
+// which only counts once the stack is back where it is now, so recursion
+// doesn't stop early
+void Debugger::step_over()
+{
+    CpuSnapshot cpu = gb.cpu_snapshot();
+    evaluating = true;
+    BYTE opcode = gb.read_memory(cpu.pc);
+    evaluating = false;
+
+    int length = 0;
+    if ((opcode == 0xCD) || (opcode == 0xC4) || (opcode == 0xCC) || (opcode == 0xD4) || (opcode == 0xDC))
+        length = 3;
+    else if ((opcode & 0xC7) == 0xC7)
+        length = 1;
+    if (length == 0)
+    {
+        step();
+        return;
+    }
+
+    Breakpoint breakpoint = {0, (WORD)(cpu.pc + length), DebugCondition(), true, cpu.sp};
+    breakpoints.push_back(breakpoint);
+    update_pc_bits();
+    run();
+}
+
+const DebugStop& Debugger::last_stop() const
+{
+    return stop;
+}
+
+// Stops before the instruction at pc, in order: a watch hit from the
+// instruction before, the end of a step, a breakpoint. Only once none of
+// them stop it, and the instruction is really going to run, are its reads
+// checked against the read watchpoints; a hit stops before the next one.
+bool Debugger::check_stop(WORD pc)
+{
+    if (evaluating)
+        return false;
+    bool skip = skip_once && (pc == skip_pc);
+    skip_once = false;
+
+    debug_reason reason = DEBUG_NONE;
+    int id = 0;
+    if (pending.reason != DEBUG_NONE)
+    {
+        reason = pending.reason;
+        id = pending.id;
+    }
+    else if (steps_left == 0)
+        reason = DEBUG_STEP;
+    else if (!skip && (pc_bits[pc >> 6] & ((uint64_t)1 << (pc & 63))))
+    {
+        for (size_t i = 0; (i < breakpoints.size()) && (reason == DEBUG_NONE); i++)
+        {
+            const Breakpoint& breakpoint = breakpoints[i];
+            if (breakpoint.pc != pc)
+                continue;
+            if (breakpoint.temporary)
+            {
+                if (gb.cpu_snapshot().sp >= breakpoint.stack_pointer)
+                    reason = DEBUG_STEP;
+            }
+            else if (passes(breakpoint.condition))
+            {
+                reason = DEBUG_BREAKPOINT;
+                id = breakpoint.id;
+            }
+        }
+    }
+
+    if (reason == DEBUG_NONE)
+    {
+        WORD start;
+        WORD end;
+        if (watching_reads && data_reads(pc, start, end))
+        {
+            for (int address = start; address <= end; address++)
+                watch_hit(WATCH_READ, DEBUG_WATCH_READ, address, gb.read_memory(address));
+        }
+        if (steps_left > 0)
+            steps_left--;
+        update_checking();
+        return false;
+    }
+
+    stop = pending;
+    stop.reason = reason;
+    stop.id = id;
+    stop.pc = pc;
+    memset(&pending, 0, sizeof(pending));
+    steps_left = -1;
+    // whatever stopped us, a step over in progress is finished
+    breakpoints.erase(std::remove_if(breakpoints.begin(), breakpoints.end(),
+                                     [](const Breakpoint& b) { return b.temporary; }), breakpoints.end());
+    update_pc_bits();
+    skip_once = true;
+    skip_pc = pc;
+    update_checking();
+    return true;
+}
+
+// The range of memory the instruction at pc reads as data (instruction
+// fetches don't count), from the registers before it runs. An OAM DMA
+// started by the instruction counts as reading its source.
+bool Debugger::data_reads(WORD pc, WORD& start, WORD& end)
+{
+    evaluating = true;
+    CpuSnapshot cpu = gb.cpu_snapshot();
+    BYTE opcode = gb.read_memory(pc);
+    BYTE operand = gb.read_memory(pc + 1);
+    WORD immediate = operand | (gb.read_memory(pc + 2) << 8);
+    evaluating = false;
+
+    BYTE a = cpu.af >> 8;
+    BYTE flags = cpu.af & 0xFF;
+    WORD store = 0;
+    bool stores = false;
+    switch (opcode)
+    {
+        case 0x0A: start = cpu.bc; break;
+        case 0x1A: start = cpu.de; break;
+        case 0x2A: case 0x3A: case 0x34: case 0x35: start = cpu.hl; break;
+        case 0xF0: start = 0xFF00 | operand; break;
+        case 0xF2: start = 0xFF00 | (cpu.bc & 0xFF); break;
+        case 0xFA: start = immediate; break;
+        // POP, RET, RETI and RET cc when taken
+        case 0xC0: if (flags & 0x80) return false; start = cpu.sp; end = cpu.sp + 1; return true;
+        case 0xC8: if (!(flags & 0x80)) return false; start = cpu.sp; end = cpu.sp + 1; return true;
+        case 0xD0: if (flags & 0x10) return false; start = cpu.sp; end = cpu.sp + 1; return true;
+        case 0xD8: if (!(flags & 0x10)) return false; start = cpu.sp; end = cpu.sp + 1; return true;
+        case 0xC1: case 0xD1: case 0xE1: case 0xF1: case 0xC9: case 0xD9:
+            start = cpu.sp;
+            end = cpu.sp + 1;
+            return true;
+        // stores, only for the OAM DMA check
+        case 0xE0: stores = true; store = 0xFF00 | operand; break;
+        case 0xE2: stores = true; store = 0xFF00 | (cpu.bc & 0xFF); break;
+        case 0xEA: stores = true; store = immediate; break;
+        case 0x36: stores = true; store = cpu.hl; a = operand; break;
+        case 0xCB:
+            if ((operand & 7) != 6)
+                return false;
+            start = cpu.hl;
+            break;
+        default:
+            // LD r,(HL) and ALU A,(HL)
+            if ((opcode >= 0x40) && (opcode < 0xC0) && ((opcode & 7) == 6) && (opcode != 0x76))
+                start = cpu.hl;
+            // LD (HL),r
+            else if ((opcode >= 0x70) && (opcode < 0x78) && (opcode != 0x76))
+            {
+                BYTE registers[8] = {(BYTE)(cpu.bc >> 8), (BYTE)cpu.bc, (BYTE)(cpu.de >> 8), (BYTE)cpu.de,
+                                     (BYTE)(cpu.hl >> 8), (BYTE)cpu.hl, 0, a};
+                stores = true;
+                store = cpu.hl;
+                a = registers[opcode & 7];
+            }
+            else
+                return false;
+    }
+    if (stores)
+    {
+        if (store != 0xFF46)
+            return false;
+        start = a << 8;
+        end = start + 0x9F;
+        return true;
+    }
+    end = start;
+    return true;
+}
+
+// The PPU and timers updating their registers aren't the program writing
+void Debugger::memory_written(WORD address, BYTE data)
+{
+    if ((current_subsystem == PROFILE_CPU) || (current_subsystem == PROFILE_INTERRUPTS))
+        watch_hit(WATCH_WRITE, DEBUG_WATCH_WRITE, address, data);
+}
+
+// Only the first hit before the next instruction is kept
+void Debugger::watch_hit(int kinds, debug_reason reason, WORD address, BYTE value)
+{
+    if (evaluating || (pending.reason != DEBUG_NONE))
+        return;
+    for (size_t i = 0; i < watchpoints.size(); i++)
+    {
+        const Watchpoint& watchpoint = watchpoints[i];
+        if (!(watchpoint.kinds & kinds) || (address < watchpoint.start) || (address > watchpoint.end))
+            continue;
+        if (!passes(watchpoint.condition))
+            continue;
+        pending.reason = reason;
+        pending.id = watchpoint.id;
+        pending.address = address;
+        pending.value = value;
+        update_checking();
+        return;
+    }
+}
+
+bool Debugger::passes(const DebugCondition& condition)
+{
+    if (!condition)
+        return true;
+    evaluating = true;
+    bool result = condition(gb);
+    evaluating = false;
+    return result;
+}
+
+void Debugger::update_pc_bits()
+{
+    memset(pc_bits, 0, sizeof(pc_bits));
+    for (size_t i = 0; i < breakpoints.size(); i++)
+        pc_bits[breakpoints[i].pc >> 6] |= (uint64_t)1 << (breakpoints[i].pc & 63);
+}
+
+// Writes are watched by GB memory page, so a watch on 0xA000-0xBFFF
+// covers that part of every cart RAM bank. ROM pages can't be written
+// (writes there go to the cartridge controller) so they're never marked.
+void Debugger::update_watched_pages()
+{
+    uint64_t write_pages[MEM_PAGE_COUNT / 64];
+    memset(write_pages, 0, sizeof(write_pages));
+    watching_reads = false;
+    for (size_t i = 0; i < watchpoints.size(); i++)
+    {
+        const Watchpoint& watchpoint = watchpoints[i];
+        if (watchpoint.kinds & WATCH_READ)
+            watching_reads = true;
+        for (int page = watchpoint.start >> MEM_PAGE_SHIFT; page <= (watchpoint.end >> MEM_PAGE_SHIFT); page++)
+        {
+            if (!(watchpoint.kinds & WATCH_WRITE) || (page < FIRST_RAM_PAGE))
+                continue;
+            if ((page >= 0xA0) && (page < 0xC0))
+            {
+                for (int bank = 0; bank < CART_RAM_BANKS; bank++)
+                {
+                    int cart_page = CART_RAM_PAGE_BASE + bank * 0x20 + (page - 0xA0);
+                    write_pages[cart_page >> 6] |= (uint64_t)1 << (cart_page & 63);
+                }
+            }
+            else
+                write_pages[page >> 6] |= (uint64_t)1 << (page & 63);
+        }
+    }
+    gb.set_watched_pages(write_pages);
+    update_checking();
+}
+
+void Debugger::update_checking()
+{
+    checking = (pending.reason != DEBUG_NONE) || (steps_left >= 0) || skip_once || watching_reads;
+}
@@ -0,0 +1,134 @@
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include <stdint.h>
+#include <functional>
+#include <vector>
+#include "Profiler.h"
+
+class GB;
+
+// Watchpoint kinds, or'd together
+#define WATCH_READ 1
+#define WATCH_WRITE 2
+
+enum debug_reason {DEBUG_NONE=0, DEBUG_BREAKPOINT=1, DEBUG_WATCH_READ=2,
+                   DEBUG_WATCH_WRITE=3, DEBUG_STEP=4};
+
+// Why run() stopped. pc is the next instruction to execute; for
+// watchpoints address is what was accessed and the instruction that did
+// it is the one just before pc.
+struct DebugStop
+{
+    debug_reason reason;
+    int id;
+    WORD pc;
+    WORD address;
+    BYTE value;
+};
+
+// Breakpoint and watchpoint conditions, checked when the address matches
+typedef std::function<bool(const GB&)> DebugCondition;
+
+// Debugger policy for GB::run_frame. Attaches itself to one instance for
+// its lifetime. PC breakpoints are looked up in a bitmap before every
+// instruction, which only this policy's instantiation of run_frame does.
+// Write watchpoints mark their pages slow path, so only writes to those
+// pages ever reach the debugger. Read watchpoints leave read_memory alone
+// (the renderers call it for every pixel): while one is set, the debugger
+// works out which addresses each instruction is about to read instead.
+// Reads and writes are both reported before the next instruction. Only
+// the CPU's accesses (and interrupt dispatch) count, not the PPU's or the
+// timers'.
+class Debugger
+{
+public:
+    enum { enabled = 1 };
+
+    explicit Debugger(GB& gb);
+    ~Debugger();
+
+    // each returns an id for remove()
+    int add_breakpoint(WORD pc, DebugCondition condition = DebugCondition());
+    // start and end inclusive
+    int add_watchpoint(WORD start, WORD end, int kinds, DebugCondition condition = DebugCondition());
+    void remove(int id);
+    void clear();
+
+    // Runs until a break or the end of the frame, true for a break
+    bool run();
+    // run() then stops after one instruction
+    void step();
+    // like step(), but a CALL or RST runs until it returns
+    void step_over();
+    const DebugStop& last_stop() const;
+
+    // run_frame hooks
+    void enter(int subsystem)
+    {
+        current_subsystem = subsystem;
+    }
+    void instruction(WORD bank, WORD pc, BYTE opcode, BYTE extended, int cycles) {}
+    void registers(const CpuSnapshot& cpu) {}
+    void halted(int cycles) {}
+    void end_frame() {}
+    bool stop_before(WORD pc)
+    {
+        if (!(checking || (pc_bits[pc >> 6] & ((uint64_t)1 << (pc & 63)))))
+            return false;
+        return check_stop(pc);
+    }
+
+    // from GB's write slow path, for watched pages only
+    void memory_written(WORD address, BYTE data);
+
+private:
+    struct Breakpoint
+    {
+        int id;
+        WORD pc;
+        DebugCondition condition;
+        // step over: only once the stack is back up to this
+        bool temporary;
+        WORD stack_pointer;
+    };
+    struct Watchpoint
+    {
+        int id;
+        WORD start;
+        WORD end;
+        int kinds;
+        DebugCondition condition;
+    };
+
+    bool check_stop(WORD pc);
+    bool data_reads(WORD pc, WORD& start, WORD& end);
+    void watch_hit(int kinds, debug_reason reason, WORD address, BYTE value);
+    bool passes(const DebugCondition& condition);
+    void update_pc_bits();
+    void update_watched_pages();
+    void update_checking();
+
+    GB& gb;
+    std::vector<Breakpoint> breakpoints;
+    std::vector<Watchpoint> watchpoints;
+    int next_id;
+    // one bit per PC with a breakpoint on it
+    uint64_t pc_bits[0x10000 / 64];
+    // stop_before has more to do than the bitmap: a step, a watch hit
+    // or read watchpoints to check
+    bool checking;
+    bool watching_reads;
+    // instructions left to run when stepping, -1 when not
+    int steps_left;
+    // conditions and step_over read memory, which mustn't hit watchpoints
+    bool evaluating;
+    int current_subsystem;
+    DebugStop pending;
+    DebugStop stop;
+    // resuming from a breakpoint mustn't stop on it again straight away
+    bool skip_once;
+    WORD skip_pc;
+};
+
+#endif
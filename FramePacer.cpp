@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "FramePacer.h"
+
+FramePacer::FramePacer(double frame_rate)
+    : frame_rate(frame_rate), speed(1.0), audio(NULL), audio_adjust(0), counters(NULL),
+      deadline(0), last_return(0), next_record(0), frames(0), late(0), dropped(0)
+{
+}
+
+void FramePacer::set_speed(double multiplier)
+{
+    // the deadlines carry on from wherever the last one was, at the new rate
+    speed = (multiplier > 0) ? multiplier : 0;
+    audio_adjust = 0;
+}
+
+double FramePacer::get_speed() const
+{
+    return speed;
+}
+
+void FramePacer::set_audio_clock(const AudioOutput* audio_output)
+{
+    audio = audio_output;
+    audio_adjust = 0;
+}
+
+void FramePacer::set_counters(InstanceCounters* instance_counters)
+{
+    counters = instance_counters;
+}
+
+void FramePacer::reset()
+{
+    deadline = 0;
+    last_return = 0;
+}
+
+int64_t FramePacer::now_ns()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void FramePacer::wait()
+{
+    int64_t now = now_ns();
+    int64_t period = 0;
+    if (speed > 0)
+    {
+        // Same steering as AudioOutput::pull_from(), on the frame period
+        // instead of the sample rate: too much sound queued means the
+        // frames are coming too fast for the card. Smoothed so frame
+        // times don't jump.
+        if (audio && (speed == 1.0) && audio->target_buffered())
+        {
+            double target = (double)audio->target_buffered();
+            double error = ((double)audio->buffered() - target) / target;
+            if (error > 1.0)
+                error = 1.0;
+            if (error < -1.0)
+                error = -1.0;
+            audio_adjust += (PACER_MAX_AUDIO_ADJUST * error - audio_adjust) * 0.05;
+        }
+        period = (int64_t)(1e9 / (frame_rate * speed) * (1.0 + audio_adjust));
+    }
+
+    if (period == 0)
+        deadline = now;
+    else if (deadline == 0)
+        deadline = now + period;
+    else
+    {
+        deadline += period;
+        if (now > deadline)
+        {
+            late++;
+            // a little late is made up over the next frames, a whole
+            // period or more is given up on
+            if (now - deadline >= period)
+            {
+                long skipped = (long)((now - deadline) / period);
+                dropped += skipped;
+                if (counters)
+                    counters->dropped_frames.fetch_add(skipped, std::memory_order_relaxed);
+                deadline = now;
+            }
+        }
+    }
+
+    // sleep most of the way, the kernel wakes us up to a few hundred
+    // microseconds late, then spin to the deadline
+    int64_t wake = deadline - PACER_SPIN_NS;
+    if (wake > now)
+    {
+        timespec until;
+        until.tv_sec = wake / 1000000000;
+        until.tv_nsec = wake % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+            ;
+    }
+    while ((now = now_ns()) < deadline)
+    {
+#ifdef __SSE2__
+        _mm_pause();
+#endif
+    }
+
+    if (last_return)
+        record(now - last_return, period);
+    last_return = now;
+}
+
+void FramePacer::record(int64_t frame_ns, int64_t period)
+{
+    if (frame_times.size() < PACER_HISTORY)
+    {
+        frame_times.push_back(frame_ns);
+        jitter.push_back(std::abs(frame_ns - period));
+    }
+    else
+    {
+        frame_times[next_record] = frame_ns;
+        jitter[next_record] = std::abs(frame_ns - period);
+        next_record = (next_record + 1) % PACER_HISTORY;
+    }
+    frames++;
+}
+
+static double percentile_ms(std::vector<int64_t> values, double p)
+{
+    if (values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    size_t index = (size_t)(p / 100 * (values.size() - 1) + 0.5);
+    if (index >= values.size())
+        index = values.size() - 1;
+    return values[index] / 1e6;
+}
+
+double FramePacer::frame_time_percentile(double p) const
+{
+    return percentile_ms(frame_times, p);
+}
+
+double FramePacer::jitter_percentile(double p) const
+{
+    return percentile_ms(jitter, p);
+}
+
+long FramePacer::late_frames() const
+{
+    return late;
+}
+
+long FramePacer::dropped_frames() const
+{
+    return dropped;
+}
+
+void FramePacer::print_stats(FILE* out) const
+{
+    fprintf(out, "Pacing: %ld frames at %.4f Hz x%.2f, %ld late, %ld dropped",
+            frames, frame_rate, speed, late, dropped);
+    if (audio)
+        fprintf(out, ", audio clock adjust %+.3f%%", audio_adjust * 100);
+    fprintf(out, "\n  %-12s %9s %9s %9s %9s %9s\n", "ms", "p50", "p90", "p99", "p99.9", "max");
+    fprintf(out, "  %-12s %9.3f %9.3f %9.3f %9.3f %9.3f\n", "frame time",
+            frame_time_percentile(50), frame_time_percentile(90), frame_time_percentile(99),
+            frame_time_percentile(99.9), frame_time_percentile(100));
+    fprintf(out, "  %-12s %9.3f %9.3f %9.3f %9.3f %9.3f\n", "jitter",
+            jitter_percentile(50), jitter_percentile(90), jitter_percentile(99),
+            jitter_percentile(99.9), jitter_percentile(100));
+}
@@ -0,0 +1,85 @@
+#ifndef FRAMEPACER_H
+#define FRAMEPACER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include "AudioOutput.h"
+
+// How long before a deadline the pacer stops sleeping and spins, which
+// covers the kernel's timer slack and wakeup latency
+#define PACER_SPIN_NS 300000
+// Most the frame period is stretched or shrunk to follow the audio clock
+#define PACER_MAX_AUDIO_ADJUST 0.005
+// Frame times kept for the percentiles, ten minutes' worth
+#define PACER_HISTORY 36000
+
+// Real time pacing for the frame loop. wait() is called once per frame,
+// after update(), and returns at the next frame's deadline. Deadlines
+// are absolute (on CLOCK_MONOTONIC), each one a period after the last,
+// so time spent emulating or woken late doesn't accumulate. The pacer
+// sleeps with clock_nanosleep(TIMER_ABSTIME) until PACER_SPIN_NS before
+// the deadline and spins the rest of the way. A frame that misses its
+// deadline by more than a whole period restarts the schedule from now
+// instead of rushing to catch up, and the periods it skipped count as
+// dropped frames.
+//
+// With an AudioOutput attached the period follows the sound card's
+// clock: more sound queued than its target means the emulator is
+// running ahead of the card, so frames are stretched a little (and the
+// other way round), by at most PACER_MAX_AUDIO_ADJUST. The AudioOutput's
+// own resampling takes out what's left. Fast forward (speed above 1)
+// divides the period and leaves the audio clock out of it.
+//
+// The rate defaults to GB_FRAME_RATE, which is what update() needs for
+// real speed; pass 59.73 for a display that wants the LCD's own rate.
+class FramePacer
+{
+public:
+    explicit FramePacer(double frame_rate = GB_FRAME_RATE);
+
+    // 2.0 runs twice as fast, 0 doesn't wait at all
+    void set_speed(double multiplier);
+    double get_speed() const;
+    // NULL for none
+    void set_audio_clock(const AudioOutput* audio);
+    // dropped frames also go to these
+    void set_counters(InstanceCounters* counters);
+    // start the schedule again from now, after a pause
+    void reset();
+
+    void wait();
+
+    // of the time between successive wait() returns, in ms, p from 0 to 100
+    double frame_time_percentile(double p) const;
+    // of how far each frame time was from the period
+    double jitter_percentile(double p) const;
+    // frames the emulator took longer than the period to produce
+    long late_frames() const;
+    long dropped_frames() const;
+    void print_stats(FILE* out) const;
+
+private:
+    static int64_t now_ns();
+    void record(int64_t frame_ns, int64_t period);
+
+    double frame_rate;
+    double speed;
+    const AudioOutput* audio;
+    double audio_adjust;
+    InstanceCounters* counters;
+
+    // 0 until the first wait()
+    int64_t deadline;
+    int64_t last_return;
+
+    // frame times and deviations from the period, in ns, as rings
+    std::vector<int64_t> frame_times;
+    std::vector<int64_t> jitter;
+    size_t next_record;
+    long frames;
+    long late;
+    long dropped;
+};
+
+#endif
@@ -1,9 +1,16 @@
 #include <iostream>
 #include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 #include "GB.h"
+#include "Profiler.h"
+#include "Recompiler.h"
 
-/* TODO
- * NOTE: Sound is not implemented in the tutorial. Judging from the GB docs, these seem to be
+/* SOUND
+ * NOTE: Sound is not implemented in the tutorial, the APU lives in APU.cpp and gets register
+ * writes from write_address. Judging from the GB docs, these seem to be
  * the relevant registers / memory locations and their function;
  * See http://www.codeslinger.co.uk/pages/projects/gameboy/files/GB.pdf around line 40 for more detail
  * on implementing their funcionality
@@ -62,9 +69,47 @@
  * If 1: Sound is generated during the time period set by the length data in NR21. After this period,
  * the sound 2 ON flag (bit 1 of NR52) is reset
  * 
- * WRITE INFO for sound mode registers 3 and 4
+ * FF1A (NR30) Sound Mode 3 register, Sound on/off (R/W)
+ * Bit 7 - Sound Channel 3 Off (0: Stop, 1: Playback)
  *
+ * FF1B (NR31) Sound Mode 3 register, Sound length (W)
+ * Bit 7-0 - Sound length (t1: 0-255)
  *
+ * FF1C (NR32) Sound Mode 3 register, Select output level (R/W)
+ * Bit 6-5 - 0: Mute, 1: 100%, 2: 50% (shift right once), 3: 25% (shift right twice)
+ *
+ * FF1D (NR33) Sound Mode 3 register, frequency lo data (W)
+ * FF1E (NR34) Sound Mode 3 register, frequency hi data (R/W)
+ * Same layout as NR13 / NR14
+ *
+ * FF30-FF3F Wave Pattern RAM
+ * 32 4-bit samples, upper nibble played first
+ *
+ * FF20 (NR41) Sound Mode 4 register, Sound length (R/W)
+ * Bit 5-0 - Sound length data (t1: 0-63)
+ *
+ * FF21 (NR42) Sound Mode 4 register, envelope (R/W)
+ * Same layout as NR12
+ *
+ * FF22 (NR43) Sound Mode 4 register, polynomial counter (R/W)
+ * Bit 7-4 - Shift Clock Frequency (s)
+ * Bit 3 - Counter Step/Width (0: 15 bits, 1: 7 bits)
+ * Bit 2-0 - Dividing Ratio of Frequencies (r)
+ *
+ * FF23 (NR44) Sound Mode 4 register, counter / consecutive; initial (R/W)
+ * Bit 7 - Initial, Bit 6 - Counter / consecutive selection, like NR14
+ *
+ * FF24 (NR50) Channel control / ON-OFF / Volume (R/W)
+ * Bit 6-4 - SO2 (left) output level (0-7)
+ * Bit 2-0 - SO1 (right) output level (0-7)
+ *
+ * FF25 (NR51) Selection of Sound output terminal (R/W)
+ * Bit 7-4 - Output sound 4-1 to SO2 terminal
+ * Bit 3-0 - Output sound 4-1 to SO1 terminal
+ *
+ * FF26 (NR52) Sound on/off
+ * Bit 7 - All sound on/off (0: stop all sound circuits) (R/W)
+ * Bit 3-0 - Sound 4-1 ON flag (Read Only)
  */
 
 
@@ -76,18 +121,98 @@
 // The pandocs have more detailed information, and can help me to implement the sound controller
 
 
-GB::GB()
+// Reads a ROM file whole, empty if it can't be opened
+static std::vector<BYTE> read_rom_file(const char* path)
 {
     std::cout << "About to load game\n";
-    memset(cartridge_memory, 0, sizeof(cartridge_memory));
-    FILE *game_file;
-    game_file = fopen( "SuperMarioLand.gb", "rb" );
-    fread(cartridge_memory, 1, 0x200000, game_file);
+    std::vector<BYTE> rom;
+    FILE* game_file = fopen(path, "rb");
+    if (!game_file)
+        return rom;
+    fseek(game_file, 0, SEEK_END);
+    rom.resize(ftell(game_file));
+    fseek(game_file, 0, SEEK_SET);
+    if (!rom.empty())
+        rom.resize(fread(&rom[0], 1, rom.size(), game_file));
     fclose(game_file);
     std::cout << "Finished Loading game\n";
+    return rom;
+}
+
+GB::GB() : GB(read_rom_file("SuperMarioLand.gb"))
+{
+}
+
+// Power on with a cartridge image already in memory
+
+GB::GB(const std::vector<BYTE>& rom)
+{
+    // the cartridge image is read only, so clones can all share it. It's
+    // sized to a power of two banks covering both the file and the size
+    // the header claims, so banking only needs a mask.
+    size_t file_size = rom.size();
+    BYTE header_size = (file_size > 0x148) ? rom[0x148] : 0;
+    size_t rom_size = 0x8000;
+    while ((rom_size < file_size) || ((header_size <= 8) && (rom_size < ((size_t)0x8000 << header_size))))
+        rom_size <<= 1;
+    std::shared_ptr<std::vector<BYTE> > image(new std::vector<BYTE>(rom_size, 0));
+    std::copy(rom.begin(), rom.end(), image->begin());
+    cartridge = image;
+    cartridge_memory = &(*image)[0];
+    rom_bank_mask = (rom_size / 0x4000) - 1;
+    cartridge_type = cartridge_memory[0x147];
+    set_MBCs(cartridge_type);
+
+    // RAM size from the header. MBC2 has 512 4-bit cells built in.
+    static const size_t ram_sizes[6] = {0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000};
+    BYTE ram_code = cartridge_memory[0x149];
+    cart_ram_size = (ram_code < 6) ? ram_sizes[ram_code] : 0;
+    if (mbc == MBC_2)
+        cart_ram_size = 0x200;
+    cart_ram_size = std::min(cart_ram_size, (size_t)CART_RAM_BANKS * 0x2000);
+    save_file = NULL;
+    counters = NULL;
+    trace = NULL;
+    debugger = NULL;
+    frame_cycles = 0;
+    recompiled_instructions = 0;
+    interpreted_instructions = 0;
+    memset(page_watched, 0, sizeof(page_watched));
+
+    // every RAM page starts out zeroed and owned by this instance only
+    memset(pages, 0, sizeof(pages));
+    memset(page_memory, 0, sizeof(page_memory));
+    for (int page = FIRST_RAM_PAGE; page < MEM_PAGE_COUNT; page++)
+    {
+        pages[page] = new MemoryPage;
+        memset(pages[page]->data, 0, MEM_PAGE_SIZE);
+        pages[page]->ref_count = 1;
+        page_memory[page] = pages[page]->data;
+    }
+    memset(page_private, 0xFF, sizeof(page_private));
+    memset(dirty_pages, 0, sizeof(dirty_pages));
+    memset(untaken_pages, 0, sizeof(untaken_pages));
+    memset(unsaved_pages, 0, sizeof(unsaved_pages));
+
+    // nothing is hashed yet, the first state_hash() does every page
+    memset(page_hash, 0, sizeof(page_hash));
+    memset(unhashed_pages, 0, sizeof(unhashed_pages));
+    for (int page = FIRST_RAM_PAGE; page < MEM_PAGE_COUNT; page++)
+        unhashed_pages[page >> 6] |= (uint64_t)1 << (page & 63);
+    memory_hash = 0;
+    hash_calls = 0;
+    hash_pages = 0;
+
+    screen.reset(new ScreenBuffer);
+    memset(screen->pixels, 0, sizeof(screen->pixels));
+    screen_data = screen->pixels;
 
     //set cpu regs
     regAF.reg = 0x01B0;
+    flag_op = FLAGS_KNOWN;
+    flag_a = 0;
+    flag_b = 0;
+    flag_result = 0;
     regBC.reg = 0x0013;
     regDE.reg = 0x00D8;
     regHL.reg = 0x014D;
@@ -99,61 +224,248 @@ GB::GB()
     timer_counter = 1024;
 
     //Boot Sequence, set register values
-    rom_mem[0xFF05] = 0x00; // TIMA
-    rom_mem[0xFF06] = 0x00; // TMA
-    rom_mem[0xFF07] = 0x00; // TAC
-    rom_mem[0xFF10] = 0x80; // NR10
-    rom_mem[0xFF11] = 0xBF; // NR11
-    rom_mem[0xFF12] = 0xF3; // NR12
-    rom_mem[0xFF14] = 0xBF; // NR14
-    rom_mem[0xFF16] = 0x3F; // NR21
-    rom_mem[0xFF17] = 0x00; // NR22
-    rom_mem[0xFF19] = 0xBF; // NR24
-    rom_mem[0xFF1A] = 0x7F; // NR30
-    rom_mem[0xFF1B] = 0xFF; // NR31
-    rom_mem[0xFF1C] = 0x9F; // NR32
-    rom_mem[0xFF1E] = 0xBF; // NR33
-    rom_mem[0xFF20] = 0xFF; // NR41
-    rom_mem[0xFF21] = 0x00; // NR42
-    rom_mem[0xFF22] = 0x00; // NR43
-    rom_mem[0xFF23] = 0xBF; // NR44
-    rom_mem[0xFF24] = 0x77; // NR50
-    rom_mem[0xFF25] = 0xF3; // NR51
-    rom_mem[0xFF26] = 0xF1; // NR52
-    rom_mem[0xFF40] = 0x91; // LCDC
-    rom_mem[0xFF42] = 0x00; // SCY
-    rom_mem[0xFF43] = 0x00; // SCX
-    rom_mem[0xFF45] = 0x00; // LYC
-    rom_mem[0xFF47] = 0xFC; // BGP
-    rom_mem[0xFF48] = 0xFF; // 0BG0
-    rom_mem[0xFF49] = 0xFF; // 0BG1
-    rom_mem[0xFF4A] = 0x00; // WY
-    rom_mem[0xFF4B] = 0x00; // WX
-    rom_mem[0xFFFF] = 0x00; // IE
+    store_byte(0xFF05, 0x00); // TIMA
+    store_byte(0xFF06, 0x00); // TMA
+    store_byte(0xFF07, 0x00); // TAC
+    store_byte(0xFF10, 0x80); // NR10
+    store_byte(0xFF11, 0xBF); // NR11
+    store_byte(0xFF12, 0xF3); // NR12
+    store_byte(0xFF14, 0xBF); // NR14
+    store_byte(0xFF16, 0x3F); // NR21
+    store_byte(0xFF17, 0x00); // NR22
+    store_byte(0xFF19, 0xBF); // NR24
+    store_byte(0xFF1A, 0x7F); // NR30
+    store_byte(0xFF1B, 0xFF); // NR31
+    store_byte(0xFF1C, 0x9F); // NR32
+    store_byte(0xFF1E, 0xBF); // NR33
+    store_byte(0xFF20, 0xFF); // NR41
+    store_byte(0xFF21, 0x00); // NR42
+    store_byte(0xFF22, 0x00); // NR43
+    store_byte(0xFF23, 0xBF); // NR44
+    store_byte(0xFF24, 0x77); // NR50
+    store_byte(0xFF25, 0xF3); // NR51
+    store_byte(0xFF26, 0xF1); // NR52
+    store_byte(0xFF40, 0x91); // LCDC
+    store_byte(0xFF42, 0x00); // SCY
+    store_byte(0xFF43, 0x00); // SCX
+    store_byte(0xFF45, 0x00); // LYC
+    store_byte(0xFF47, 0xFC); // BGP
+    store_byte(0xFF48, 0xFF); // 0BG0
+    store_byte(0xFF49, 0xFF); // 0BG1
+    store_byte(0xFF4A, 0x00); // WY
+    store_byte(0xFF4B, 0x00); // WX
+    store_byte(0xFFFF, 0x00); // IE
     //Set program counter
     program_counter = 0x100;
     //Which rom bank is loaded. not 0 because bank 0 is always present
     //Rom banking not used in MBC2
     current_ROM_bank = 1;
 
-    
-    memset(&ram_banks,0,sizeof(ram_banks));
+
     current_RAM_bank = 0;
     enable_ram = false;
+
+    // everything that goes into GBState must start out defined, or two
+    // identical power-ons would hash differently
+    rom_banking = true;
+    rtc_register = 0;
+    memset(&rtc, 0, sizeof(rtc));
+    master_interrupt = false;
+    ime_pending = false;
+    halted = false;
+    divider_counter = 0;
+    divider_register = 0;
+    m_scanline_counter = 456;
+
+    joypad_state = 0xFF;
+    render_enabled = true;
+
+    serial_end_cycle = 0;
+    serial_check_cycle = UINT64_MAX;
+    link = NULL;
+    link_side = 0;
+    link_has_next = false;
+
+    // bring the APU to the post boot state the registers above describe.
+    // Writing NR14 retriggers channel 1, matching NR52 = 0xF1.
+    cycle_count = 0;
+    apu.write_register(0xFF26, 0xF1, 0);
+    for (WORD address = 0xFF10; address < 0xFF26; address++)
+        apu.write_register(address, read_memory(address), 0);
+}
+
+GB::~GB()
+{
+    disconnect_link();
+    if (save_file)
+    {
+        sync_save_file();
+        delete save_file;
+    }
+    for (int page = FIRST_RAM_PAGE; page < MEM_PAGE_COUNT; page++)
+    {
+        if (pages[page])
+            release_page(pages[page]);
+    }
+}
+
+// Copy-on-write clone for tree search. The copy starts out sharing every
+// RAM page, the cartridge and the screen with this instance; whichever
+// side writes to a shared page first gets its own copy of just that page.
+// A clone that only touches a handful of pages costs a few KB.
+GB* GB::clone()
+{
+    GB* copy = new GB(*this);
+    copy->save_file = NULL;
+    // lookahead work isn't the instance's emulation speed
+    copy->counters = NULL;
+    copy->trace = NULL;
+    copy->debugger = NULL;
+    memset(copy->page_watched, 0, sizeof(copy->page_watched));
+    memset(copy->unsaved_pages, 0, sizeof(copy->unsaved_pages));
+
+    // neither side may write in place any more until it checks the count
+    memset(page_private, 0, sizeof(page_private));
+    memset(copy->page_private, 0, sizeof(copy->page_private));
+
+    for (int page = FIRST_RAM_PAGE; page < MEM_PAGE_COUNT; page++)
+    {
+        if (pages[page])
+        {
+            pages[page]->ref_count.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        // pages in the .sav mapping stay this instance's own, the clone
+        // gets a copy of them up front
+        MemoryPage* own = new MemoryPage;
+        memcpy(own->data, page_memory[page], MEM_PAGE_SIZE);
+        own->ref_count = 1;
+        copy->pages[page] = own;
+        copy->page_memory[page] = own->data;
+        copy->page_private[page >> 6] |= (uint64_t)1 << (page & 63);
+        if (!trace && !(page_watched[page >> 6] & ((uint64_t)1 << (page & 63))))
+            page_private[page >> 6] |= (uint64_t)1 << (page & 63);
+    }
+
+    // clones are for looking ahead, they stay silent unless asked, and
+    // drop their share of the output buffers before they cost anything
+    copy->apu.set_output_enabled(false);
+    // and unplugged, a transfer in flight completes with nothing on the
+    // other end
+    copy->link = NULL;
+    copy->link_has_next = false;
+    copy->schedule_serial(LINK_DETACHED_PROGRESS);
+    return copy;
+}
+
+// Bytes this instance holds on its own: the object itself, every page
+// nobody else references (the .sav mapping's included), and the heap
+// buffers it doesn't share: screen, sound output and cartridge image
+size_t GB::instance_memory() const
+{
+    size_t bytes = sizeof(GB);
+    for (int page = FIRST_RAM_PAGE; page < MEM_PAGE_COUNT; page++)
+    {
+        if (!pages[page])
+            bytes += MEM_PAGE_SIZE;
+        else if (pages[page]->ref_count.load(std::memory_order_relaxed) == 1)
+            bytes += sizeof(MemoryPage);
+    }
+    if (screen.use_count() == 1)
+        bytes += sizeof(ScreenBuffer);
+    bytes += apu.output_memory();
+    if (cartridge.use_count() == 1)
+        bytes += cartridge->capacity();
+    return bytes;
+}
+
+void GB::release_page(MemoryPage* page)
+{
+    if (page->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete page;
+}
+
+// If another instance still references the page, take a private copy of
+// it, and unless the page is traced or watched let writes to it go in
+// place from now on
+void GB::make_page_private(int page)
+{
+    MemoryPage* shared = pages[page];
+    if (shared && (shared->ref_count.load(std::memory_order_acquire) != 1))
+    {
+        MemoryPage* copy = new MemoryPage;
+        memcpy(copy->data, shared->data, MEM_PAGE_SIZE);
+        copy->ref_count = 1;
+        pages[page] = copy;
+        page_memory[page] = copy->data;
+        release_page(shared);
+    }
+    if (!trace && !(page_watched[page >> 6] & ((uint64_t)1 << (page & 63))))
+        page_private[page >> 6] |= (uint64_t)1 << (page & 63);
+}
+
+// Raw store into a page, no banking or I/O side effects. Every write to
+// RAM ends up here so dirty tracking and copy-on-write happen in one spot.
+void GB::store_page_byte(int page, int offset, BYTE data)
+{
+    if (!(page_private[page >> 6] & ((uint64_t)1 << (page & 63))))
+        write_slow_path(page, offset, data);
+    page_memory[page][offset] = data;
+    mark_page_dirty(page);
+}
+
+// Slow half of the write path, taken the first time a page is written
+// after a clone, and for every write while tracing or to a watched page.
+// Kept out of store_page_byte so that stays small enough to inline.
+void GB::write_slow_path(int page, int offset, BYTE data)
+{
+    make_page_private(page);
+    if (trace)
+        trace->memory_write((page << MEM_PAGE_SHIFT) | offset, data);
+    // cart RAM pages are only ever written through 0xA000-0xBFFF
+    if (page_watched[page >> 6] & ((uint64_t)1 << (page & 63)))
+    {
+        WORD address = (page < CART_RAM_PAGE_BASE) ? ((page << MEM_PAGE_SHIFT) | offset) :
+                       (0xA000 | ((((page - CART_RAM_PAGE_BASE) << MEM_PAGE_SHIFT) | offset) & 0x1FFF));
+        debugger->memory_written(address, data);
+    }
 }
 
-//Pass in cartridge_memory 0x147, which tells us if MBC1 or MBC2 are used
-//then store this 
+void GB::store_byte(WORD address, BYTE data)
+{
+    store_page_byte(address >> MEM_PAGE_SHIFT, address & (MEM_PAGE_SIZE - 1), data);
+}
+
+// Renderers call this before drawing so a clone sharing the parent's
+// screen gets its own copy
+void GB::make_screen_private()
+{
+    if (screen.use_count() != 1)
+    {
+        std::shared_ptr<ScreenBuffer> copy(new ScreenBuffer);
+        memcpy(copy->pixels, screen->pixels, sizeof(screen->pixels));
+        screen = copy;
+        screen_data = screen->pixels;
+    }
+}
+
+//Pass in cartridge_memory 0x147, which tells us which controller the
+//cartridge has. Each one gets its own instantiation of write_mbc, so
+//handle_banking doesn't test the type on every write.
 void GB::set_MBCs(int value)
 {
     switch( value )
     {
-        case 1: MBC1 = true; break;
-        case 2: MBC1 = true; break;
-        case 3: MBC1 = true; break;
-        case 5: MBC2 = true; break;
-        case 6: MBC2 = true; break;
-        default : break;
+        case 0x01: case 0x02: case 0x03:
+            mbc = MBC_1; mbc_write = &GB::write_mbc<MBC_1>; break;
+        case 0x05: case 0x06:
+            mbc = MBC_2; mbc_write = &GB::write_mbc<MBC_2>; break;
+        case 0x0F: case 0x10: case 0x11: case 0x12: case 0x13:
+            mbc = MBC_3; mbc_write = &GB::write_mbc<MBC_3>; break;
+        case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+            mbc = MBC_5; mbc_write = &GB::write_mbc<MBC_5>; break;
+        default :
+            mbc = MBC_NONE; mbc_write = &GB::write_mbc<MBC_NONE>; break;
     }
 }
 
@@ -162,21 +474,37 @@ void GB::set_MBCs(int value)
 // 0xA000 - 0xBFFF is our ram mem ba nk
 BYTE GB::read_memory(WORD address) const
 {
+    // rom bank 0 is always mapped
+    if (address < 0x4000)
+    {
+        return cartridge_memory[address];
+    }
     // are we reading from the rom memory bank
-    if ((address>=0x4000) && (address <= 0x7FFF))
+    else if ((address>=0x4000) && (address <= 0x7FFF))
     {
         WORD new_address = address - 0x4000;
-        return cartridge_memory[new_address + (current_ROM_bank * 0x4000)];
+        return cartridge_memory[new_address + ((current_ROM_bank & rom_bank_mask) * 0x4000)];
     }
     //ram memory bank
     else if ((address >= 0xA000) && (address <= 0xBFFF))
     {
-        WORD new_address = address - 0xA000;
-        return ram_banks[new_address + (current_RAM_bank*0x2000)];
+        if (rtc_register)
+            return rtc.latched[rtc_register - 0x08];
+        int bank_address = (address - 0xA000) + (current_RAM_bank*0x2000);
+        return page_memory[CART_RAM_PAGE_BASE + (bank_address >> MEM_PAGE_SHIFT)][bank_address & 0xFF];
+    }
+
+    else if (address == 0xFF00)
+    {
+        return get_joypad_state();
+    }
+    else if (address == 0xFF26)
+    {
+        return apu.read_status(cycle_count);
     }
 
     //return memory if not ram or rom
-    return rom_mem[address];
+    return page_memory[address >> MEM_PAGE_SHIFT][address & 0xFF];
 }
 
 // Game update cycle. GB renders screen every 69905 instructions,
@@ -184,18 +512,184 @@ BYTE GB::read_memory(WORD address) const
 // so we know the total cycles GB expects
 void GB::update()
 {
-    const int MAX_CYCLES = 69905;
-    int current_cycles = 0;
+    if (debugger)
+    {
+        run_frame(*debugger);
+        return;
+    }
+    if (trace)
+    {
+        run_frame(*trace);
+        return;
+    }
+    NoProfiler none;
+    run_frame(none);
+}
+
+// The frame loop, with a profiling policy. The policy hooks are inline
+// and for NoProfiler empty, and the opcode peek is behind the constant
+// Policy::enabled, so update() pays nothing for them.
+template <class Policy>
+bool GB::run_frame(Policy& policy)
+{
+    const int MAX_CYCLES = CYCLES_PER_FRAME;
+    int current_cycles = frame_cycles;
+    // plain locals, the counters are only touched once a frame
+    int instructions = 0;
+    int recompiled_count = 0;
+    int halted_cycles = 0;
+    bool stopped = false;
     while (current_cycles < MAX_CYCLES)
     {
+        policy.enter(PROFILE_CPU);
+        WORD pc = program_counter;
+        BYTE opcode = 0;
+        BYTE extended = 0;
+        bool was_halted = halted;
+        if (!was_halted && policy.stop_before(pc))
+        {
+            stopped = true;
+            break;
+        }
+        // recompiled code runs whole blocks, so it's only used without
+        // per instruction hooks. EI's one instruction delay is left to
+        // get_opcode.
+        if (!Policy::enabled && recompiled && !was_halted && !ime_pending)
+        {
+            RecompiledBlock block = recompiled->find(pc, current_ROM_bank & rom_bank_mask);
+            if (block)
+            {
+                int count = 0;
+                current_cycles += block(*this, MAX_CYCLES - current_cycles, count);
+                recompiled_count += count;
+                continue;
+            }
+        }
+        if (Policy::enabled && !was_halted)
+        {
+            opcode = read_memory(pc);
+            if (opcode == 0xCB)
+                extended = read_memory(pc + 1);
+        }
         int cycles = get_opcode();
+        if (Policy::enabled)
+        {
+            if (was_halted)
+                policy.halted(cycles);
+            else
+            {
+                policy.instruction(code_bank(pc), pc, opcode, extended, cycles);
+                policy.registers(cpu_snapshot());
+            }
+        }
+        if (was_halted)
+            halted_cycles += cycles;
+        else
+            instructions++;
         current_cycles += cycles;
+        cycle_count += cycles;
+        policy.enter(PROFILE_TIMERS);
         update_timers(cycles);
+        policy.enter(PROFILE_PPU);
         update_graphics(cycles);
+        policy.enter(PROFILE_INTERRUPTS);
         check_interrupts();
+        if (cycle_count >= serial_check_cycle)
+        {
+            policy.enter(PROFILE_OTHER);
+            update_serial();
+        }
+    }
+    policy.enter(PROFILE_OTHER);
+    recompiled_instructions += recompiled_count;
+    interpreted_instructions += instructions;
+    instructions += recompiled_count;
+    if (counters)
+    {
+        counters->instructions.fetch_add(instructions, std::memory_order_relaxed);
+        counters->cycles.fetch_add(current_cycles - frame_cycles, std::memory_order_relaxed);
+        counters->halted_cycles.fetch_add(halted_cycles, std::memory_order_relaxed);
     }
+    if (stopped)
+    {
+        frame_cycles = current_cycles;
+        return false;
+    }
+    frame_cycles = 0;
+    finish_frame();
+    policy.end_frame();
+    return true;
+}
+
+void GB::finish_frame()
+{
+    // sync the APU once a frame so its state at a frame boundary doesn't
+    // depend on when registers happened to be written
+    apu.run_until(cycle_count);
+    if (save_file)
+        sync_save_file();
     draw_screen();
+    if (counters)
+        counters->frames.fetch_add(1, std::memory_order_relaxed);
+}
+
+// The loop body above without the hooks, after each instruction a
+// recompiled block runs
+void GB::run_hardware(int cycles)
+{
+    cycle_count += cycles;
+    update_timers(cycles);
+    update_graphics(cycles);
+    check_interrupts();
+    if (cycle_count >= serial_check_cycle)
+        update_serial();
+}
+
+bool GB::load_recompiled(const string& path)
+{
+    std::shared_ptr<RecompiledCode> code(new RecompiledCode);
+    string error;
+    if (!code->load(path, *cartridge, error))
+    {
+        std::cout << "Couldn't load " << path << ": " << error << "\n";
+        return false;
+    }
+    recompiled = code;
+    return true;
+}
+
+const std::vector<BYTE>& GB::cartridge_image() const
+{
+    return *cartridge;
+}
+
+double GB::recompiled_coverage() const
+{
+    uint64_t total = recompiled_instructions + interpreted_instructions;
+    return total ? (double)recompiled_instructions / total : 0.0;
+}
+
+template bool GB::run_frame<NoProfiler>(NoProfiler& policy);
+template bool GB::run_frame<Profiler>(Profiler& policy);
+template bool GB::run_frame<TraceRecorder>(TraceRecorder& policy);
+template bool GB::run_frame<Debugger>(Debugger& policy);
+
+// cycle is cycle_count, which between instructions is when the next
+// one starts
+CpuSnapshot GB::cpu_snapshot() const
+{
+    CpuSnapshot cpu = {cycle_count, (WORD)((regAF.high << 8) | get_flags()), regBC.reg, regDE.reg,
+                       regHL.reg, stack_pointer.reg, program_counter};
+    return cpu;
+}
 
+WORD GB::code_bank(WORD pc) const
+{
+    if (pc < 0x4000)
+        return 0;
+    if (pc < 0x8000)
+        return current_ROM_bank & rom_bank_mask;
+    return PROFILE_RAM_BANK;
 }
 
 // Overview
@@ -216,18 +710,23 @@ void GB::write_address(WORD address, BYTE data)
     else if ( (address >= 0xA000 ) && (address < 0xC000) )
     {
         //check if ram is enabled. then put data in address.
-        if (enable_ram)
+        if (enable_ram && rtc_register)
+        {
+            write_rtc(data);
+        }
+        else if (enable_ram)
         {
             //since address is overall, but our banks are separate
             //subtract base address, then put data in correct spot
-            //in ram_banks
+            //in the cart RAM pages
             WORD new_address = address - 0xA000;
-            ram_banks[new_address + (current_RAM_bank * 0x2000)] = data;
+            int bank_address = new_address + (current_RAM_bank * 0x2000);
+            store_page_byte(CART_RAM_PAGE_BASE + (bank_address >> MEM_PAGE_SHIFT), bank_address & 0xFF, data);
         }
     }
     else if ( (address >= 0xE000 ) && (address < 0xFE00) )
     {
-        rom_mem[address] = data;
+        store_byte(address, data);
         write_address(address - 0x2000, data);
     } // sprite attribute table
     else if ( ( address >= 0xFEA0 ) && (address < 0xFEFF) )
@@ -240,7 +739,7 @@ void GB::write_address(WORD address, BYTE data)
         BYTE current_freq = get_clock_frequency(); 
         //GAME MEMORY?? not defined..
         //game_memory[TIMER_CONTROLLER] = data;
-        rom_mem[TIMER_CONTROLLER] = data;
+        store_byte(TIMER_CONTROLLER, data);
         BYTE new_frequency = get_clock_frequency();
         
         if (current_freq != new_frequency)
@@ -252,11 +751,35 @@ void GB::write_address(WORD address, BYTE data)
     //trap divide register, baby
     else if (0xFF04 == address)
     {
-        rom_mem[0xFF04] = 0;
+        store_byte(0xFF04, 0);
     }
     else if (address == 0xFF44)
     {
-        rom_mem[address] = 0;
+        store_byte(address, 0);
+    }
+    //sound registers and wave RAM
+    else if ((address >= 0xFF10) && (address <= 0xFF3F))
+    {
+        apu.write_register(address, data, cycle_count);
+        store_byte(address, data);
+    }
+    //serial transfer data / control
+    else if (address == 0xFF01)
+    {
+        store_byte(address, data);
+        publish_serial_latch();
+    }
+    else if (address == 0xFF02)
+    {
+        store_byte(address, data);
+        if ((data & 0x81) == 0x81)
+            start_serial_transfer();
+        publish_serial_latch();
+    }
+    //only the select bits of the joypad register are writable
+    else if (address == 0xFF00)
+    {
+        store_byte(address, data & 0x30);
     }
     else if (address == 0xFF46)
     {
@@ -264,10 +787,536 @@ void GB::write_address(WORD address, BYTE data)
     }
     else
     {
-        rom_mem[address] = data;
+        store_byte(address, data);
     }
 }
 
+// Dirty page tracking. Each write sets one bit, so the write path stays
+// cheap and snapshots only copy the pages that were touched.
+void GB::mark_page_dirty(int page)
+{
+    dirty_pages[page >> 6] |= (uint64_t)1 << (page & 63);
+}
+
+// The write path only sets one bitmap. Each consumer (rewind, hashing)
+// has its own "not seen yet" set, which this brings up to date.
+void GB::collect_dirty_pages()
+{
+    for (int word = 0; word < MEM_PAGE_COUNT / 64; word++)
+    {
+        untaken_pages[word] |= dirty_pages[word];
+        unhashed_pages[word] |= dirty_pages[word];
+        unsaved_pages[word] |= dirty_pages[word];
+        dirty_pages[word] = 0;
+    }
+}
+
+// Hands the set of pages written since the last call to the caller
+// and starts tracking from scratch
+void GB::take_dirty_pages(uint64_t* out)
+{
+    collect_dirty_pages();
+    memcpy(out, untaken_pages, sizeof(untaken_pages));
+    memset(untaken_pages, 0, sizeof(untaken_pages));
+}
+
+static inline uint64_t rotate_left(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Final avalanche step (from murmur3's fmix64)
+static inline uint64_t mix_hash(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDULL;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+// Fast non-cryptographic hash, 8 bytes at a time in two independent
+// lanes so the multiplies overlap. Length must be a multiple of 16.
+static uint64_t hash_block(const BYTE* data, size_t length, uint64_t seed)
+{
+    uint64_t h1 = seed ^ 0x9E3779B97F4A7C15ULL;
+    uint64_t h2 = seed ^ 0xC2B2AE3D27D4EB4FULL;
+    for (size_t i = 0; i < length; i += 16)
+    {
+        uint64_t w1, w2;
+        memcpy(&w1, data + i, 8);
+        memcpy(&w2, data + i + 8, 8);
+        h1 = rotate_left(h1 ^ (w1 * 0x87C37B91114253D5ULL), 31) * 0x4CF5AD432745937FULL;
+        h2 = rotate_left(h2 ^ (w2 * 0x4CF5AD432745937FULL), 29) * 0x87C37B91114253D5ULL;
+    }
+    return mix_hash(h1 ^ rotate_left(h2, 17) ^ length);
+}
+
+// A page's share of memory_hash. Seeding with the page number means the
+// same data in two different pages doesn't cancel out in the xor.
+static inline uint64_t hash_page(int page, const BYTE* data)
+{
+    return hash_block(data, MEM_PAGE_SIZE, (uint64_t)page * 0x9E3779B97F4A7C15ULL);
+}
+
+// 64-bit hash of the whole machine state, for transposition tables and
+// replay checkpoints. memory_hash is the xor of every page's hash, so
+// only pages written since the last call need rehashing; the CPU/IO
+// state is small enough to hash from scratch each time. The screen is
+// output rather than state, so it's left out.
+uint64_t GB::state_hash()
+{
+    collect_dirty_pages();
+
+    for (int word = 0; word < MEM_PAGE_COUNT / 64; word++)
+    {
+        uint64_t bits = unhashed_pages[word];
+        unhashed_pages[word] = 0;
+        while (bits)
+        {
+            int page = (word << 6) + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (page < FIRST_RAM_PAGE)
+                continue;
+            uint64_t new_hash = hash_page(page, page_memory[page]);
+            memory_hash ^= page_hash[page] ^ new_hash;
+            page_hash[page] = new_hash;
+            hash_pages++;
+        }
+    }
+
+    uint64_t hash = memory_hash ^ cpu_state_hash();
+    hash_calls++;
+    return hash;
+}
+
+// Same result as state_hash() but computed from scratch, to check the
+// incremental version against and to show what it saves
+uint64_t GB::full_state_hash() const
+{
+    uint64_t hash = 0;
+    for (int page = FIRST_RAM_PAGE; page < MEM_PAGE_COUNT; page++)
+        hash ^= hash_page(page, page_memory[page]);
+    return hash ^ cpu_state_hash();
+}
+
+uint64_t GB::cpu_state_hash() const
+{
+    // zero first so struct padding doesn't leak into the hash
+    GBState state;
+    memset(&state, 0, sizeof(state));
+    save_cpu_state(state);
+
+    BYTE buffer[(sizeof(GBState) + 15) & ~15];
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, &state, sizeof(state));
+    return hash_block(buffer, sizeof(buffer), 0);
+}
+
+void GB::print_hash_stats() const
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    volatile uint64_t full_hash = full_state_hash();
+    (void)full_hash;
+    double full_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "State hash: " << hash_calls << " calls, ";
+    if (hash_calls > 0)
+    {
+        std::cout << (double)hash_pages / hash_calls << " pages rehashed per call, ";
+    }
+    std::cout << "full rehash " << full_seconds * 1e6 << " us\n";
+}
+
+// Page 0x00-0xFF is the address space, after that the cart RAM banks.
+// Pages below FIRST_RAM_PAGE are ROM and have no data of their own.
+const BYTE* GB::page_data(int page) const
+{
+    if (page < FIRST_RAM_PAGE)
+        return NULL;
+    return page_memory[page];
+}
+
+// Overwrite a whole page, bypassing write_address. Used to restore
+// snapshots, so no banking or DMA side effects should happen here.
+void GB::load_page(int page, const BYTE* data)
+{
+    if (!(page_private[page >> 6] & ((uint64_t)1 << (page & 63))))
+        make_page_private(page);
+    memcpy(page_memory[page], data, MEM_PAGE_SIZE);
+    mark_page_dirty(page);
+}
+
+void GB::save_cpu_state(GBState& state) const
+{
+    state.regAF.high = regAF.high;
+    state.regAF.low = get_flags();
+    state.regBC = regBC;
+    state.regDE = regDE;
+    state.regHL = regHL;
+    state.program_counter = program_counter;
+    state.stack_pointer = stack_pointer;
+
+    state.current_ROM_bank = current_ROM_bank;
+    state.current_RAM_bank = current_RAM_bank;
+    state.current_frequency = current_frequency;
+    state.timer_counter = timer_counter;
+    state.divider_counter = divider_counter;
+    state.divider_register = divider_register;
+    state.m_scanline_counter = m_scanline_counter;
+
+    state.enable_ram = enable_ram;
+    state.rom_banking = rom_banking;
+    state.master_interrupt = master_interrupt;
+    state.ime_pending = ime_pending;
+    state.halted = halted;
+    state.rtc_register = rtc_register;
+    state.rtc = rtc;
+
+    state.joypad_state = joypad_state;
+    state.cycle_count = cycle_count;
+    state.serial_end_cycle = serial_end_cycle;
+    state.apu = apu.state;
+}
+
+void GB::load_cpu_state(const GBState& state)
+{
+    regAF = state.regAF;
+    flag_op = FLAGS_KNOWN;
+    regBC = state.regBC;
+    regDE = state.regDE;
+    regHL = state.regHL;
+    program_counter = state.program_counter;
+    stack_pointer = state.stack_pointer;
+
+    current_ROM_bank = state.current_ROM_bank;
+    current_RAM_bank = state.current_RAM_bank;
+    current_frequency = state.current_frequency;
+    timer_counter = state.timer_counter;
+    divider_counter = state.divider_counter;
+    divider_register = state.divider_register;
+    m_scanline_counter = state.m_scanline_counter;
+
+    enable_ram = state.enable_ram;
+    rom_banking = state.rom_banking;
+    master_interrupt = state.master_interrupt;
+    ime_pending = state.ime_pending;
+    halted = state.halted;
+    rtc_register = state.rtc_register;
+    rtc = state.rtc;
+
+    joypad_state = state.joypad_state;
+    cycle_count = state.cycle_count;
+    serial_end_cycle = state.serial_end_cycle;
+    serial_check_cycle = cycle_count;
+    apu.state = state.apu;
+}
+
+// Save state layout: magic, sizeof(GBState), the GBState itself, then
+// every RAM page in order. Only meant to be read back by the same build.
+void GB::save_state(std::vector<BYTE>& out) const
+{
+    GBState state;
+    memset(&state, 0, sizeof(state));
+    save_cpu_state(state);
+
+    uint32_t state_size = sizeof(GBState);
+    out.clear();
+    out.reserve(8 + sizeof(GBState) + (MEM_PAGE_COUNT - FIRST_RAM_PAGE) * MEM_PAGE_SIZE);
+    out.insert(out.end(), (const BYTE*)"GBSS", (const BYTE*)"GBSS" + 4);
+    out.insert(out.end(), (const BYTE*)&state_size, (const BYTE*)&state_size + 4);
+    out.insert(out.end(), (const BYTE*)&state, (const BYTE*)&state + sizeof(state));
+    for (int page = FIRST_RAM_PAGE; page < MEM_PAGE_COUNT; page++)
+        out.insert(out.end(), page_memory[page], page_memory[page] + MEM_PAGE_SIZE);
+}
+
+bool GB::load_state(const std::vector<BYTE>& in)
+{
+    size_t expected = 8 + sizeof(GBState) + (MEM_PAGE_COUNT - FIRST_RAM_PAGE) * MEM_PAGE_SIZE;
+    uint32_t state_size = 0;
+    if (in.size() != expected)
+        return false;
+    memcpy(&state_size, &in[4], 4);
+    if ((memcmp(&in[0], "GBSS", 4) != 0) || (state_size != sizeof(GBState)))
+        return false;
+
+    GBState state;
+    memcpy(&state, &in[8], sizeof(state));
+    load_cpu_state(state);
+
+    const BYTE* data = &in[8 + sizeof(GBState)];
+    for (int page = FIRST_RAM_PAGE; page < MEM_PAGE_COUNT; page++, data += MEM_PAGE_SIZE)
+        load_page(page, data);
+    return true;
+}
+
+void GB::connect_link(LinkCable* cable, int side)
+{
+    disconnect_link();
+    link = cable;
+    link_side = side;
+    link_has_next = false;
+    link->attach(side, cycle_count);
+    publish_serial_latch();
+    serial_check_cycle = cycle_count;
+}
+
+void GB::disconnect_link()
+{
+    if (!link)
+        return;
+    link->detach(link_side);
+    link = NULL;
+    link_has_next = false;
+    schedule_serial(LINK_DETACHED_PROGRESS);
+}
+
+// SC written with bit 7 (start) and bit 0 (internal clock) set. The
+// other side's byte arrives when the transfer completes. A second start
+// while one is in flight is ignored, so each transfer gets exactly one
+// reply.
+void GB::start_serial_transfer()
+{
+    if (serial_end_cycle)
+        return;
+    serial_end_cycle = cycle_count + SERIAL_TRANSFER_CYCLES;
+    if (link)
+    {
+        LinkMessage message;
+        message.cycle = serial_end_cycle;
+        message.data = read_memory(0xFF01);
+        link->send(link_side, message);
+        link->count_transfer(link_side);
+    }
+    if (serial_end_cycle < serial_check_cycle)
+        serial_check_cycle = serial_end_cycle;
+}
+
+void GB::finish_serial_transfer(BYTE received)
+{
+    serial_end_cycle = 0;
+    store_byte(0xFF01, received);
+    store_byte(0xFF02, read_memory(0xFF02) & 0x7F);
+    request_interrupt(3);
+    publish_serial_latch();
+}
+
+// The other side clocked a byte over. We only take part if we've started
+// a transfer on the external clock; otherwise they read all ones.
+void GB::deliver_serial_byte(const LinkMessage& message)
+{
+    BYTE control = read_memory(0xFF02);
+    BYTE reply = 0xFF;
+    if ((control & 0x81) == 0x80)
+    {
+        reply = read_memory(0xFF01);
+        store_byte(0xFF01, message.data);
+        store_byte(0xFF02, control & 0x7F);
+        request_interrupt(3);
+        publish_serial_latch();
+    }
+    if (link->is_deterministic())
+        link->reply(link_side, reply);
+}
+
+// Free running mode only: what the other side reads if it finishes a
+// transfer without waiting for our reply
+void GB::publish_serial_latch()
+{
+    if (!link || link->is_deterministic())
+        return;
+    WORD latch = read_memory(0xFF01);
+    if ((read_memory(0xFF02) & 0x81) == 0x80)
+        latch |= 0x100;
+    link->publish_latch(link_side, latch);
+}
+
+// Next cycle update_serial() has something to do: our own transfer
+// completing, the next known byte from the other side being due,
+// publishing progress, or (deterministic) the point past which the other
+// side might still send us a byte we haven't seen.
+void GB::schedule_serial(uint64_t partner_progress)
+{
+    uint64_t next = serial_end_cycle ? serial_end_cycle : UINT64_MAX;
+    if (link)
+    {
+        next = std::min(next, cycle_count + LINK_PUBLISH_INTERVAL);
+        if (link_has_next)
+            next = std::min(next, link_next.cycle);
+        if (link->is_deterministic())
+            next = std::min(next, partner_progress + link->max_skew());
+    }
+    serial_check_cycle = next;
+}
+
+// Called between instructions once cycle_count reaches serial_check_cycle.
+// This is the only place the two threads wait for each other: when this
+// side is too far ahead, or (deterministic) its transfer has completed and
+// the other side hasn't replied yet.
+void GB::update_serial()
+{
+    if (!link)
+    {
+        // nothing plugged in, the other end reads as all ones
+        if (serial_end_cycle && (cycle_count >= serial_end_cycle))
+            finish_serial_transfer(0xFF);
+        schedule_serial(LINK_DETACHED_PROGRESS);
+        return;
+    }
+
+    bool deterministic = link->is_deterministic();
+    uint64_t skew = link->max_skew();
+    uint64_t partner = 0;
+    int spins = 0;
+    std::chrono::steady_clock::time_point stall_start;
+
+    for (;;)
+    {
+        // progress first: every byte sent before it is in the inbox now
+        partner = link->partner_progress(link_side);
+        for (;;)
+        {
+            if (!link_has_next)
+                link_has_next = link->receive(link_side, link_next);
+            if (!link_has_next || (link_next.cycle > cycle_count))
+                break;
+            deliver_serial_byte(link_next);
+            link_has_next = false;
+        }
+
+        bool waiting = (cycle_count >= partner + skew);
+        if (!waiting && serial_end_cycle && (cycle_count >= serial_end_cycle))
+        {
+            BYTE received;
+            if (!deterministic)
+            {
+                WORD latch = link->partner_latch(link_side);
+                finish_serial_transfer((latch & 0x100) ? (latch & 0xFF) : 0xFF);
+            }
+            else if (link->take_reply(link_side, received))
+                finish_serial_transfer(received);
+            else if (!link->partner_attached(link_side))
+                finish_serial_transfer(0xFF);
+            else
+                waiting = true;
+        }
+        if (!waiting)
+            break;
+
+        // the other side may be waiting on us too, so it has to see
+        // exactly where we are
+        if (spins == 0)
+        {
+            link->publish_progress(link_side, cycle_count);
+            stall_start = std::chrono::steady_clock::now();
+        }
+        if (++spins > 64)
+            std::this_thread::yield();
+    }
+
+    if (spins)
+    {
+        std::chrono::duration<double> stalled = std::chrono::steady_clock::now() - stall_start;
+        link->count_stall(link_side, stalled.count());
+    }
+    link->publish_progress(link_side, cycle_count);
+    schedule_serial(partner);
+}
+
+void GB::set_counters(InstanceCounters* instance_counters)
+{
+    counters = instance_counters;
+}
+
+void GB::attach_trace(TraceRecorder* recorder)
+{
+    trace = recorder;
+    // send every write through the slow path from here on, or let them
+    // earn their way back to the fast path
+    if (trace)
+        memset(page_private, 0, sizeof(page_private));
+}
+
+void GB::attach_debugger(Debugger* instance)
+{
+    debugger = instance;
+    if (!debugger)
+    {
+        uint64_t none[MEM_PAGE_COUNT / 64] = {0};
+        set_watched_pages(none);
+    }
+}
+
+// Watched pages lose their in place bit so the next write to them takes
+// the slow path, and make_page_private won't give it back
+void GB::set_watched_pages(const uint64_t* pages)
+{
+    memcpy(page_watched, pages, sizeof(page_watched));
+    for (int word = 0; word < MEM_PAGE_COUNT / 64; word++)
+        page_private[word] &= ~page_watched[word];
+}
+
+// Cartridge types with a battery keeping their RAM
+bool GB::has_battery() const
+{
+    switch (cartridge_type)
+    {
+        case 0x03: case 0x06: case 0x09: case 0x0D: case 0x0F: case 0x10:
+        case 0x13: case 0x1B: case 0x1E: case 0xFF:
+            return cart_ram_size > 0;
+        default:
+            return false;
+    }
+}
+
+size_t GB::cart_ram_bytes() const
+{
+    return cart_ram_size;
+}
+
+// Moves the cart RAM pages into a shared mapping of `path`. If the file
+// already has a save in it, that becomes the cart RAM, otherwise the
+// current contents are written to it.
+bool GB::open_save_file(const string& path)
+{
+    if (save_file || (cart_ram_size == 0))
+        return false;
+    SaveFile* file = new SaveFile;
+    if (!file->open(path, cart_ram_size))
+    {
+        delete file;
+        return false;
+    }
+
+    int page_count = (cart_ram_size + MEM_PAGE_SIZE - 1) / MEM_PAGE_SIZE;
+    for (int i = 0; i < page_count; i++)
+    {
+        int page = CART_RAM_PAGE_BASE + i;
+        BYTE* mapped = file->data() + i * MEM_PAGE_SIZE;
+        if (file->existed())
+            mark_page_dirty(page);
+        else
+            memcpy(mapped, page_memory[page], MEM_PAGE_SIZE);
+        release_page(pages[page]);
+        pages[page] = NULL;
+        page_memory[page] = mapped;
+        if (!trace && !(page_watched[page >> 6] & ((uint64_t)1 << (page & 63))))
+            page_private[page >> 6] |= (uint64_t)1 << (page & 63);
+    }
+    save_file = file;
+    return true;
+}
+
+// Hands the cart RAM pages written since last time to the save file's
+// background flush. Called once a frame, so the write path stays as it is.
+void GB::sync_save_file()
+{
+    collect_dirty_pages();
+    save_file->mark_dirty(&unsaved_pages[CART_RAM_PAGE_BASE / 64]);
+    memset(unsaved_pages, 0, sizeof(unsaved_pages));
+}
+
 //clock frequency is a combo of bit 1 and 0 of TIMER_CONTROLLER
 BYTE GB::get_clock_frequency() const
 {
@@ -290,52 +1339,79 @@ void GB::set_clock_frequency()
 
 void GB::handle_banking(WORD address, BYTE data)
 {
-    // RAM enabling
+    (this->*mbc_write)(address, data);
+}
+
+// Writes to 0x0000-0x7FFF for one controller type. MBC is a constant in
+// each instantiation, so all the other types' code folds away.
+template <int MBC>
+void GB::write_mbc(WORD address, BYTE data)
+{
+    if (MBC == MBC_NONE)
+        return;
+
+    // RAM enabling. MBC2 only has the one register range, address
+    // bit 8 picks between RAM enable and ROM bank.
     if (address < 0x2000)
     {
-        if (MBC1 || MBC2)
-        {   
-            //No ram banking without MBC1 or 2
+        if ((MBC == MBC_2) && (address & 0x100))
+            set_rom_bank((data & 0xF) ? (data & 0xF) : 1);
+        else
             enable_ram_bank(address, data);
-        }
     }
     // low ROM bank change
-    else if ((address >= 0x2000) && (address < 0x4000))
+    else if (address < 0x4000)
     {
-        if (MBC1 || MBC2)
-        {
+        if (MBC == MBC_1)
             change_low_rom_bank(data);
+        else if (MBC == MBC_2)
+        {
+            if (address & 0x100)
+                set_rom_bank((data & 0xF) ? (data & 0xF) : 1);
+            else
+                enable_ram_bank(address, data);
         }
+        else if (MBC == MBC_3)
+            set_rom_bank((data & 0x7F) ? (data & 0x7F) : 1);
+        // MBC5 has 9 bit bank numbers, and bank 0 can be mapped here
+        else if (address < 0x3000)
+            set_rom_bank((current_ROM_bank & 0x100) | data);
+        else
+            set_rom_bank((current_ROM_bank & 0xFF) | ((data & 0x1) << 8));
     }
-    else if ((address >= 0x4000) && (address < 0x6000))
+    // high ROM bits / RAM bank / RTC register select
+    else if (address < 0x6000)
     {
-        // there is no rambank in mbc2 always use rambank 0
-        if (MBC1)
+        if (MBC == MBC_1)
         {
             if (rom_banking)
-            {
-                //High rom bank change
                 change_high_rom_bank(data);
-            }
+            else
+                change_ram_bank(data);
+        }
+        else if (MBC == MBC_3)
+        {
+            if ((data >= 0x08) && (data <= 0x0C))
+                rtc_register = data;
             else
             {
-                // Change ram bank
+                rtc_register = 0;
                 change_ram_bank(data);
             }
         }
+        else if (MBC == MBC_5)
+            change_ram_bank(data);
     }
-    // ROM banking or RAM banking bro?
-    else if ((address >= 0x6000) && (address < 0x8000))
+    // ROM banking or RAM banking bro? MBC3 latches the clock here instead
+    else
     {
-        if (MBC1)
-        {
+        if (MBC == MBC_1)
             change_rom_ram_mode(data);
-        }
+        else if (MBC == MBC_3)
+            latch_rtc(data);
     }
-
 }
 
-
 void GB::change_rom_ram_mode(BYTE data)
 {
     BYTE new_data = data & 0x1;
@@ -346,18 +1422,23 @@ void GB::change_rom_ram_mode(BYTE data)
 
 void GB::change_ram_bank(BYTE data)
 {
-    current_RAM_bank = data & 0x3;
+    current_RAM_bank = data & (CART_RAM_BANKS - 1);
 }
 
+// MBC1 bits 5-6 of the ROM bank
 void GB::change_high_rom_bank(BYTE data)
 {
-    //turn off upper 3 bits of the current rom
+    //turn off the upper bits of the current rom
     current_ROM_bank &= 31;
 
-    //turn off the lower 5 bits of the data
-    data &= 224;
-    current_ROM_bank |= data;
-    if (current_ROM_bank == 0) current_ROM_bank++;
+    current_ROM_bank |= (data & 0x3) << 5;
+}
+
+// Bank numbers are kept as the game wrote them, read_memory masks them
+// down to the size of the ROM
+void GB::set_rom_bank(WORD bank)
+{
+    current_ROM_bank = bank;
 }
 
 bool GB::test_bit(WORD address, int bit) const
@@ -371,18 +1452,15 @@ int GB::get_bit(BYTE byte, int bit) const
     //return  (byte & (1 << bit)) >> bit;
 }
 
+// MBC1 bits 0-4 of the ROM bank
 void GB::change_low_rom_bank(BYTE data)
 {
-    if (MBC2)
-    {
-        current_ROM_bank = data & 0xF;
-        if (current_ROM_bank == 0) current_ROM_bank++;
-        return;
-    }
+    // the zero check only looks at these 5 bits, so 0x20, 0x40 and
+    // 0x60 can't be mapped either
     BYTE lower_5 = data & 31;
-    current_ROM_bank &= 224; // turn off the lower 5
+    if (lower_5 == 0) lower_5++;
+    current_ROM_bank &= 0x60; // turn off the lower 5
     current_ROM_bank |= lower_5;
-    if (current_ROM_bank == 0) current_ROM_bank++;
 }
 
 //Overview
@@ -391,32 +1469,89 @@ void GB::change_low_rom_bank(BYTE data)
 
 void GB::enable_ram_bank(WORD address, BYTE data)
 {
-    if (MBC2)
-    {
-        if (test_bit(address, 4) == 1) return;
-    }
     BYTE test_data = data & 0xF;
     if (test_data == 0xA)
         enable_ram = true;
     else if (test_data == 0x0)
+    {
+        // games disable RAM once they're done saving, which is a good
+        // moment to get the save onto disk
+        if (enable_ram && save_file)
+        {
+            sync_save_file();
+            save_file->request_flush();
+        }
         enable_ram = false;
+    }
+}
+
+// Bring the MBC3 clock up to cycle_count, carrying whole seconds into
+// minutes, hours and the 9 bit day counter
+void GB::advance_rtc()
+{
+    if (rtc.regs[4] & 0x40)
+    {
+        // halted
+        rtc.last_cycle = cycle_count;
+        return;
+    }
+    uint64_t seconds = (cycle_count - rtc.last_cycle) / RTC_CYCLES_PER_SECOND;
+    if (seconds == 0)
+        return;
+    rtc.last_cycle += seconds * RTC_CYCLES_PER_SECOND;
+
+    uint64_t total = rtc.regs[0] + seconds;
+    rtc.regs[0] = total % 60;
+    total = rtc.regs[1] + total / 60;
+    rtc.regs[1] = total % 60;
+    total = rtc.regs[2] + total / 60;
+    rtc.regs[2] = total % 24;
+    total = rtc.regs[3] + ((rtc.regs[4] & 0x1) << 8) + total / 24;
+    BYTE carry = (total > 0x1FF) ? 0x80 : 0;
+    rtc.regs[3] = total & 0xFF;
+    rtc.regs[4] = (rtc.regs[4] & 0xC0) | carry | ((total >> 8) & 0x1);
+}
+
+// Writing 0 then 1 copies the running clock into the readable registers
+void GB::latch_rtc(BYTE data)
+{
+    if ((rtc.last_latch_write == 0x00) && (data == 0x01))
+    {
+        advance_rtc();
+        memcpy(rtc.latched, rtc.regs, sizeof(rtc.regs));
+    }
+    rtc.last_latch_write = data;
+}
+
+void GB::write_rtc(BYTE data)
+{
+    static const BYTE masks[5] = {0x3F, 0x3F, 0x1F, 0xFF, 0xC1};
+    int reg = rtc_register - 0x08;
+    advance_rtc();
+    rtc.regs[reg] = data & masks[reg];
+    rtc.latched[reg] = rtc.regs[reg];
+    // setting the seconds restarts the current second
+    if (reg == 0)
+        rtc.last_cycle = cycle_count;
 }
 
 void GB::check_interrupts()
 {
+    BYTE req = read_memory(0xFF0F);
+    BYTE enabled = read_memory(0xFFFF);
+    if ((req & enabled & 0x1F) == 0)
+        return;
+    // a pending interrupt ends HALT even with interrupts disabled
+    halted = false;
     if (master_interrupt == true)
     {
-        BYTE req = read_memory(0xFF0F);
-        BYTE enabled = read_memory(0xFFFF);
-        if (req > 0)
+        for (int i = 0; i < 5; i++) //just 5 possibilties
         {
-            for (int i = 0; i < 5; i++) //just 5 possibilties
+            if (test_bit(req,i) && test_bit(enabled, i))
             {
-                if (test_bit(req,i) == true)
-                {
-                    if (test_bit(enabled, i))
-                        service_interrupt(i);
-                }
+                // lowest bit wins, one at a time
+                service_interrupt(i);
+                return;
             }
         }
     }
@@ -428,6 +1563,7 @@ void GB::service_interrupt(int interrupt)
     //V-Blank: 0x40
     //LCD: 0x48
     //TIMER: 0x50
+    //SERIAL: 0x58
     //JOYPAD: 0x60
     master_interrupt = false;
     BYTE req = read_memory(0xFF0F);
@@ -442,13 +1578,24 @@ void GB::service_interrupt(int interrupt)
         case 0: program_counter = 0x40; break;
         case 1: program_counter = 0x48; break;
         case 2: program_counter = 0x50; break;
-        case 3: program_counter = 0x60; break;
+        case 3: program_counter = 0x58; break;
+        case 4: program_counter = 0x60; break;
     }
 }
 
 void GB::push_word_on_stack(WORD word)
 {
+    stack_pointer.reg -= 2;
+    write_address(stack_pointer.reg + 1, word >> 8);
+    write_address(stack_pointer.reg, word & 0xFF);
+}
 
+WORD GB::pop_word_off_stack()
+{
+    WORD low = read_memory(stack_pointer.reg);
+    WORD high = read_memory(stack_pointer.reg + 1);
+    stack_pointer.reg += 2;
+    return (high << 8) | low;
 }
 
 BYTE GB::reset_bit(BYTE addr, int position)
@@ -473,6 +1620,7 @@ bool GB::is_LCD_enabled() const{
  */
 
 void GB::draw_scanline() {
+    make_screen_private();
     BYTE control = read_memory(0xFF40);
     if ( test_bit( control, 0 ) )
         render_tiles( );
@@ -845,7 +1993,7 @@ void GB::set_LCD_status() {
     {
         // set mode to 1 during lcd disabled, and reset scanline
         m_scanline_counter = 456;
-        rom_mem[0xFF44] = 0;
+        store_byte(0xFF44, 0);
         status &= 252;
         status = set_bit(status, 0);
         write_address(0xFF41, status);
@@ -936,7 +2084,7 @@ void GB::update_graphics(int cycles)
     if (m_scanline_counter <= 0)
     {
         // move to next scanline
-        rom_mem[0xFF44]++;
+        store_byte(0xFF44, read_memory(0xFF44) + 1);
         BYTE current_line = read_memory(0xFF44);
 
         m_scanline_counter = 456;
@@ -947,9 +2095,9 @@ void GB::update_graphics(int cycles)
 
         //if past scanline 153, reset to 0
         else if (current_line > 153)    
-            rom_mem[0xFF44] = 0;
+            store_byte(0xFF44, 0);
 
-        else if (current_line < 144)
+        else if ((current_line < 144) && render_enabled)
             draw_scanline();
 
     }
@@ -991,7 +2139,7 @@ void GB::request_interrupt(int interrupt)
 {
     BYTE req = read_memory(0xFF0F);
     req = set_bit(req, interrupt);
-    write_address(0xFF0F, interrupt);
+    write_address(0xFF0F, req);
 }
 
 
@@ -1009,28 +2157,114 @@ void GB::divide_register(int cycles)
     if (divider_counter >= 255)
     {
         divider_counter = 0;
-        rom_mem[0xFF04]++;
+        store_byte(0xFF04, read_memory(0xFF04) + 1);
     }
 }
 
-int GB::get_opcode()
+/* Joypad register 0xFF00
+ * Bit 5 - Select button keys (0 = Select)
+ * Bit 4 - Select direction keys (0 = Select)
+ * Bit 3 - Down or Start (0 = Pressed)
+ * Bit 2 - Up or Select
+ * Bit 1 - Left or B
+ * Bit 0 - Right or A
+ * The game picks a group with bits 4/5 and reads back the low nibble
+ */
+BYTE GB::get_joypad_state() const
 {
-    return 4;
+    BYTE select = page_memory[IO_PAGE][0x00];
+    BYTE keys = 0x0F;
+    if (!test_bit(select, 4))
+        keys &= joypad_state & 0x0F;
+    if (!test_bit(select, 5))
+        keys &= joypad_state >> 4;
+    return 0xC0 | (select & 0x30) | keys;
 }
 
-void GB::draw_screen()
+void GB::key_pressed(int key)
 {
-    //do something
+    set_joypad(get_joypad() | (1 << key));
 }
 
+void GB::key_released(int key)
+{
+    set_joypad(get_joypad() & ~(1 << key));
+}
 
+//Buttons currently held, one bit per joypad_key, 1 = pressed
+BYTE GB::get_joypad() const
+{
+    return ~joypad_state;
+}
 
-int main() 
+// Set all eight keys at once (1 = pressed). A key going down requests
+// the joypad interrupt if the game has its group selected.
+void GB::set_joypad(BYTE buttons)
 {
-    std::cout << "Hello World!\n";
-    GB gb;
-    return 0;
+    BYTE newly_pressed = buttons & joypad_state;
+    joypad_state = ~buttons;
+
+    BYTE select = page_memory[IO_PAGE][0x00];
+    bool req_int = false;
+    if ((newly_pressed & 0x0F) && !test_bit(select, 4))
+        req_int = true;
+    if ((newly_pressed & 0xF0) && !test_bit(select, 5))
+        req_int = true;
+    if (req_int)
+        request_interrupt(4);
 }
 
+void GB::set_rendering(bool enabled)
+{
+    render_enabled = enabled;
+}
 
+// Everything synthesized so far. The APU only runs lazily, so catch it
+// up to now first.
+size_t GB::read_audio(int16_t* out, size_t max_frames)
+{
+    apu.run_until(cycle_count);
+    return apu.read_samples(out, max_frames);
+}
 
+void GB::set_audio_enabled(bool enabled)
+{
+    apu.set_output_enabled(enabled);
+}
+
+// Sizes the APU's output buffers, AudioOutput passes its latency on
+void GB::set_audio_latency(int latency_ms)
+{
+    apu.set_output_latency(latency_ms);
+}
+
+void GB::set_audio_sample_rate(int rate)
+{
+    apu.set_sample_rate(rate);
+}
+
+int GB::get_audio_sample_rate() const
+{
+    return apu.get_sample_rate();
+}
+
+// Dynamic rate control hook, see AudioOutput
+void GB::set_audio_rate_adjust(double adjust)
+{
+    apu.set_rate_adjust(adjust);
+}
+
+const ScreenBuffer& GB::get_screen() const
+{
+    return *screen;
+}
+
+uint64_t GB::screen_hash() const
+{
+    return hash_block(&screen->pixels[0][0][0], sizeof(screen->pixels), 0);
+}
+
+void GB::draw_screen()
+{
+    //do something
+}
@@ -1,3 +1,6 @@
+#ifndef GB_H
+#define GB_H
+
 #include <stdio.h>
 #include <iostream>
 using std::cout;
@@ -6,8 +9,21 @@ using std::endl;
 
 #include <string.h>
 #include <string>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "APU.h"
+#include "LinkCable.h"
+#include "SaveFile.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Debugger.h"
 using std::string;
 
+class RecompiledCode;
+class LockstepBatch;
+
 #define TIMER 0xFF05
 #define TIMER_MODULATOR 0xFF06
 #define TIMER_CONTROLLER 0xFF07
@@ -16,6 +32,11 @@ using std::string;
 #define FLAG_N 6;
 #define FLAG_H 5;
 #define FLAG_C 4;
+//the same flags as masks on the low byte of AF
+#define FLAG_MASK_Z 0x80
+#define FLAG_MASK_N 0x40
+#define FLAG_MASK_H 0x20
+#define FLAG_MASK_C 0x10
 
 //Timer controller has 4 frequencies to set
 //the timer to count up at
@@ -23,8 +44,26 @@ using std::string;
 //CPU clock speed runs at 4194304 Hz
 
 #define CLOCKSPEED 4194304 ;
+//Cycles in a frame, what update() runs each call
+#define CYCLES_PER_FRAME 69905
+//How many update() calls make a second of real time, 60.0 Hz. The LCD's
+//own frames are 70224 cycles (59.73 Hz) but one update() is the unit
+//everything counts frames in
+#define GB_FRAME_RATE (4194304.0 / CYCLES_PER_FRAME)
 enum color_t {WHITE=0, LIGHT_GRAY=1, DARK_GRAY=2, BLACK=3};
 
+//Cartridge controllers, the values match what set_MBCs() is handed
+//(cartridge header byte 0x147) for the first type of each family
+enum mbc_type {MBC_NONE=0, MBC_1=1, MBC_2=2, MBC_3=3, MBC_5=5};
+
+//Joypad keys, also the bit numbers used by set_joypad()
+enum joypad_key {KEY_RIGHT=0, KEY_LEFT=1, KEY_UP=2, KEY_DOWN=3,
+                 KEY_A=4, KEY_B=5, KEY_SELECT=6, KEY_START=7};
+
+//What the last flag setting instruction was, for working its flags out
+//later. FLAGS_KNOWN means they're already in the low byte of AF.
+enum lazy_flags {FLAGS_KNOWN=0, FLAGS_ADD=1, FLAGS_SUB=2, FLAGS_AND=3, FLAGS_LOGIC=4};
+
 typedef unsigned char BYTE;
 typedef char SIGNED_BYTE;
 typedef unsigned short WORD;
@@ -40,14 +79,101 @@ union Register
     };
 };
 
+// Memory is kept in 256 byte pages so snapshots only have to copy what
+// actually changed, and clones can share whatever they haven't written.
+// Pages 0x00-0xFF mirror the address space, pages 0x100-0x17F are the
+// cartridge RAM banks. Pages below 0x80 are cartridge ROM, which lives
+// in the shared cartridge image instead.
+#define MEM_PAGE_SIZE 0x100
+#define MEM_PAGE_SHIFT 8
+#define FIRST_RAM_PAGE 0x80
+#define CART_RAM_PAGE_BASE 0x100
+#define MEM_PAGE_COUNT 0x180
+#define IO_PAGE 0xFF
+
+// A page of RAM, reference counted so cloned instances can share it
+// until one of them writes to it
+struct MemoryPage
+{
+    BYTE data[MEM_PAGE_SIZE];
+    std::atomic<int> ref_count;
+};
+
+// The rendered frame, shared between clones until one of them draws
+struct ScreenBuffer
+{
+    BYTE pixels[160][144][3];
+};
+
+// Cart RAM is 4 banks of 8KB (pages 0x100-0x17F). Bigger MBC5 RAM
+// sizes wrap around.
+#define CART_RAM_BANKS 4
+
+// MBC3 real time clock. Registers are seconds, minutes, hours, day low
+// and day high (bit 0 day bit 8, bit 6 halt, bit 7 day carry). It runs
+// on emulated time so it stays deterministic, and is only brought up to
+// date when the game latches or writes it.
+#define RTC_CYCLES_PER_SECOND 4194304
+struct RTCState
+{
+    BYTE regs[5];
+    BYTE latched[5];
+    BYTE last_latch_write;
+    uint64_t last_cycle;
+};
+
+// Everything outside of the memory pages that makes up the machine state
+// (CPU registers, banking, timers). Plain struct so it copies in one go.
+struct GBState
+{
+    Register regAF;
+    Register regBC;
+    Register regDE;
+    Register regHL;
+    WORD program_counter;
+    Register stack_pointer;
+
+    WORD current_ROM_bank;
+    BYTE current_RAM_bank;
+    int current_frequency;
+    int timer_counter;
+    int divider_counter;
+    int divider_register;
+    int m_scanline_counter;
+
+    bool enable_ram;
+    bool rom_banking;
+    bool master_interrupt;
+    bool ime_pending;
+    bool halted;
+    BYTE rtc_register;
+    RTCState rtc;
+
+    BYTE joypad_state;
+    uint64_t cycle_count;
+    uint64_t serial_end_cycle;
+    APUState apu;
+};
+
 
 class GB
 {
 public:
-    //Constructor
+    //Constructor, loads SuperMarioLand.gb
     GB();
+    //Constructor, with the cartridge image in memory
+    explicit GB(const std::vector<BYTE>& rom);
+    ~GB();
+    GB* clone();
+    size_t instance_memory() const;
     void update();
+    //update() with profiling hooks, see Profiler.h. False if the policy
+    //stopped the frame early; the next call carries on with it.
+    template <class Policy> bool run_frame(Policy& policy);
+    CpuSnapshot cpu_snapshot() const;
     int get_opcode();
+    //ROM bank the code at pc is running from, PROFILE_RAM_BANK for RAM
+    WORD code_bank(WORD pc) const;
     void update_timers(int cycles);
     void update_graphics(int cycles);
     void check_interrupts();
@@ -59,6 +185,7 @@ public:
     void enable_ram_bank(WORD address, BYTE data);
     void change_low_rom_bank(BYTE data);
     void change_high_rom_bank(BYTE data);
+    void set_rom_bank(WORD bank);
     void change_ram_bank(BYTE data);
     void change_rom_ram_mode(BYTE data);
     bool test_bit(WORD address, int bit) const;
@@ -71,6 +198,7 @@ public:
     BYTE set_bit(BYTE addr, int position);
     void service_interrupt(int interrupt);
     void push_word_on_stack(WORD word);
+    WORD pop_word_off_stack();
     BYTE reset_bit(BYTE addr, int position);
     void set_LCD_status();
     bool is_LCD_enabled() const;
@@ -81,13 +209,91 @@ public:
     BYTE get_lcd_control_register();
     color_t get_color(BYTE color_num, WORD address) const;
 
+    //Joypad
+    void key_pressed(int key);
+    void key_released(int key);
+    void set_joypad(BYTE buttons);
+    BYTE get_joypad() const;
+    BYTE get_joypad_state() const;
+
+    //Skip draw_scanline for headless runs. Emulation is unaffected,
+    //only screen_data stops being updated.
+    void set_rendering(bool enabled);
+    const ScreenBuffer& get_screen() const;
+    uint64_t screen_hash() const;
+
+    //Sound output, interleaved stereo 16-bit at APU_SAMPLE_RATE
+    size_t read_audio(int16_t* out, size_t max_frames);
+    void set_audio_enabled(bool enabled);
+    void set_audio_latency(int latency_ms);
+    void set_audio_sample_rate(int rate);
+    int get_audio_sample_rate() const;
+    void set_audio_rate_adjust(double adjust);
+
+    //Serial link to another instance on another thread, see LinkCable.
+    //Disconnected, a transfer with the internal clock reads all ones.
+    void connect_link(LinkCable* cable, int side);
+    void disconnect_link();
+
+    //Runtime counters, added to once a frame. NULL turns them off.
+    void set_counters(InstanceCounters* counters);
+
+    //Execution trace. While attached, update() records every instruction
+    //and memory write into it. NULL detaches.
+    void attach_trace(TraceRecorder* trace);
+
+    //Debugger, attached by its constructor. While attached, update()
+    //stops at breakpoints and watchpoints.
+    void attach_debugger(Debugger* debugger);
+    //Memory pages whose writes the debugger wants to see
+    void set_watched_pages(const uint64_t* pages);
+
+    //Statically recompiled code for this cartridge, see Recompiler.h.
+    //update() runs ROM code the module covers natively, the rest is
+    //interpreted. False if the module can't be loaded or was built from
+    //a different ROM.
+    bool load_recompiled(const string& path);
+    //the cartridge as loaded, padded to a power of two banks
+    const std::vector<BYTE>& cartridge_image() const;
+    //share of instructions run by recompiled code since power on
+    double recompiled_coverage() const;
+
+    //Battery backed cart RAM, kept in a memory mapped .sav file
+    bool has_battery() const;
+    //cart RAM size from the header, 0 for none
+    size_t cart_ram_bytes() const;
+    bool open_save_file(const string& path);
+
+    //Full save states
+    void save_state(std::vector<BYTE>& out) const;
+    bool load_state(const std::vector<BYTE>& in);
+
+    //Snapshot support, used by Rewind
+    void save_cpu_state(GBState& state) const;
+    void load_cpu_state(const GBState& state);
+    const BYTE* page_data(int page) const;
+    void load_page(int page, const BYTE* data);
+    void take_dirty_pages(uint64_t* out);
+
+    //Whole machine state hashing
+    uint64_t state_hash();
+    uint64_t full_state_hash() const;
+    void print_hash_stats() const;
 
 private:
-    BYTE cartridge_memory[0x200000];
-    BYTE screen_data[160][144][3];
-    BYTE current_ROM_bank;
+    friend struct Recompiled;
+    friend class LockstepBatch;
+
+    // only clone() copies, and it fixes up the page reference counts
+    GB(const GB& other) = default;
+    GB& operator=(const GB& other) = delete;
+
+    std::shared_ptr<const std::vector<BYTE> > cartridge;
+    const BYTE* cartridge_memory;
+    std::shared_ptr<ScreenBuffer> screen;
+    BYTE (*screen_data)[144][3];
+    WORD current_ROM_bank;
     BYTE current_RAM_bank;
-    BYTE ram_banks[0x8000];
     int current_frequency;// = 4096;
     //timer_counter = CLOCK_SPEED / current_frequency
     int timer_counter;// = 1024;
@@ -95,19 +301,179 @@ private:
     int divider_register;
     int m_scanline_counter;
 
-    bool MBC1;
-    bool MBC2;
+    //cartridge controller, picked by set_MBCs() when the game loads
+    mbc_type mbc;
+    void (GB::*mbc_write)(WORD address, BYTE data);
+    template <int MBC> void write_mbc(WORD address, BYTE data);
+    //ROM size in 16KB banks minus one, banks past the end wrap around
+    WORD rom_bank_mask;
+    //header bytes 0x147 and 0x149 decoded
+    BYTE cartridge_type;
+    size_t cart_ram_size;
+    SaveFile* save_file;
+    void sync_save_file();
+    InstanceCounters* counters;
+    TraceRecorder* trace;
+    Debugger* debugger;
+    //cycles into the current frame, only nonzero between calls when the
+    //debugger stopped one part way
+    int frame_cycles;
+    std::shared_ptr<RecompiledCode> recompiled;
+    uint64_t recompiled_instructions;
+    uint64_t interpreted_instructions;
+    //everything run_frame does between instructions, for recompiled code
+    void run_hardware(int cycles);
+    //and once the frame's cycles have run
+    void finish_frame();
+
     bool enable_ram;
     bool rom_banking;
     bool master_interrupt;
+    //EI enables interrupts one instruction late
+    bool ime_pending;
+    bool halted;
+    bool render_enabled;
+
+    //MBC3: 0 when 0xA000-0xBFFF is RAM, 0x08-0x0C for an RTC register
+    BYTE rtc_register;
+    RTCState rtc;
+    void advance_rtc();
+    void latch_rtc(BYTE data);
+    void write_rtc(BYTE data);
+
+    //one bit per key as in joypad_key, 0 = pressed like the hardware
+    BYTE joypad_state;
+
+    //cycles emulated since power on
+    uint64_t cycle_count;
+    //CPU, in Opcodes.cpp
+    int execute_opcode(BYTE opcode);
+    int execute_extended_opcode(BYTE opcode);
+    BYTE fetch_byte();
+    WORD fetch_word();
+    BYTE get_register(int reg) const;
+    void set_register(int reg, BYTE value);
+    WORD& get_register_pair(int pair);
+    bool test_condition(int condition) const;
+    void set_flags(bool zero, bool subtract, bool half_carry, bool carry);
+    void defer_flags(int op, BYTE a, BYTE b, WORD result);
+    BYTE get_flags() const;
+    void resolve_flags();
+    int carry_flag() const;
+    bool zero_flag() const;
+    void alu_operation(int operation, BYTE value);
+    BYTE alu_increment(BYTE value);
+    BYTE alu_decrement(BYTE value);
+    void alu_add_hl(WORD value);
+    WORD alu_add_sp(BYTE offset);
+    void alu_daa();
+    BYTE alu_shift(int operation, BYTE value);
+    void call(WORD address);
+
+    //internal clock transfer in flight completes at this cycle, 0 if none
+    uint64_t serial_end_cycle;
+    //update() calls update_serial() once cycle_count gets here, so the
+    //instruction loop only pays for a compare
+    uint64_t serial_check_cycle;
+    LinkCable* link;
+    int link_side;
+    //first transfer from the other side not delivered yet
+    LinkMessage link_next;
+    bool link_has_next;
+    void update_serial();
+    void schedule_serial(uint64_t partner_progress);
+    void start_serial_transfer();
+    void finish_serial_transfer(BYTE received);
+    void deliver_serial_byte(const LinkMessage& message);
+    void publish_serial_latch();
+
+    //NR52 reads catch the APU up, which read_memory has to be able to do
+    mutable APU apu;
 
     Register regAF;
     Register regBC;
     Register regDE;
     Register regHL;
 
+    //Flags are only worked out when something reads them, from the last
+    //flag setting instruction's operands and result (see defer_flags in
+    //Opcodes.cpp). regAF.low is stale unless flag_op is FLAGS_KNOWN.
+    BYTE flag_op;
+    BYTE flag_a;
+    BYTE flag_b;
+    WORD flag_result;
 
     WORD program_counter;
     Register stack_pointer;
-    BYTE rom_mem[0x10000];
+
+    //RAM, one entry per page. NULL for the ROM pages, and for cart RAM
+    //pages that live in the .sav mapping instead.
+    MemoryPage* pages[MEM_PAGE_COUNT];
+    //where each page's bytes are, pages[page]->data or the .sav mapping.
+    //Every read and write goes through this.
+    BYTE* page_memory[MEM_PAGE_COUNT];
+    //one bit per page this instance may write in place. Never set while
+    //a trace is attached, or for watched pages, so those writes go by
+    //the slow path.
+    uint64_t page_private[MEM_PAGE_COUNT / 64];
+    //pages with a write watchpoint on them
+    uint64_t page_watched[MEM_PAGE_COUNT / 64];
+    //one bit per memory page written, folded into the sets below
+    //by collect_dirty_pages()
+    uint64_t dirty_pages[MEM_PAGE_COUNT / 64];
+    //written since the last take_dirty_pages()
+    uint64_t untaken_pages[MEM_PAGE_COUNT / 64];
+    //written since the last state_hash()
+    uint64_t unhashed_pages[MEM_PAGE_COUNT / 64];
+    //written since the last sync_save_file()
+    uint64_t unsaved_pages[MEM_PAGE_COUNT / 64];
+    void mark_page_dirty(int page);
+    void collect_dirty_pages();
+    void make_page_private(int page);
+    static void release_page(MemoryPage* page);
+    void store_page_byte(int page, int offset, BYTE data);
+    void write_slow_path(int page, int offset, BYTE data);
+    void store_byte(WORD address, BYTE data);
+    void make_screen_private();
+
+    //per-page hashes, xored together into memory_hash
+    uint64_t page_hash[MEM_PAGE_COUNT];
+    uint64_t memory_hash;
+    uint64_t cpu_state_hash() const;
+    long hash_calls;
+    long hash_pages;
 };
+
+// Small enough to want inlining everywhere, recompiled code included.
+// Records a flag setting op. Z is set when the low byte of result is 0
+// and C is bit 8 of it, so for a subtraction result is the borrow
+// extended 16-bit difference. For FLAGS_ADD and FLAGS_SUB, H is the carry
+// into bit 4, a ^ b ^ result. FLAGS_AND always sets H and FLAGS_LOGIC
+// never does.
+inline void GB::defer_flags(int op, BYTE a, BYTE b, WORD result)
+{
+    flag_op = op;
+    flag_a = a;
+    flag_b = b;
+    flag_result = result;
+#ifdef EAGER_FLAGS
+    resolve_flags();
+#endif
+}
+
+// 0 or 1, for the ops that carry in
+inline int GB::carry_flag() const
+{
+    if (flag_op == FLAGS_KNOWN)
+        return (regAF.low >> 4) & 1;
+    return (flag_result >> 8) & 1;
+}
+
+inline bool GB::zero_flag() const
+{
+    if (flag_op == FLAGS_KNOWN)
+        return (regAF.low & FLAG_MASK_Z) != 0;
+    return (flag_result & 0xFF) == 0;
+}
+
+#endif
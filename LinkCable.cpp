@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include "LinkCable.h"
+
+// a side only ever has one transfer in flight, these never fill up
+#define LINK_RING_SIZE 8
+
+LinkCable::Side::Side()
+    : inbox(LINK_RING_SIZE), replies(LINK_RING_SIZE),
+      progress(LINK_DETACHED_PROGRESS), latch(0xFF), attached(false),
+      transfers(0), stalls(0), stall_seconds(0)
+{
+}
+
+LinkCable::LinkCable(bool deterministic)
+    : deterministic(deterministic)
+{
+}
+
+bool LinkCable::is_deterministic() const
+{
+    return deterministic;
+}
+
+uint64_t LinkCable::max_skew() const
+{
+    return deterministic ? LINK_DETERMINISTIC_SKEW : LINK_FREE_SKEW;
+}
+
+void LinkCable::attach(int side, uint64_t cycle)
+{
+    sides[side].progress.store(cycle, std::memory_order_release);
+    sides[side].attached.store(true, std::memory_order_release);
+}
+
+// Unplugging stops the other side from ever waiting on this one
+void LinkCable::detach(int side)
+{
+    sides[side].attached.store(false, std::memory_order_release);
+    sides[side].progress.store(LINK_DETACHED_PROGRESS, std::memory_order_release);
+}
+
+bool LinkCable::partner_attached(int side) const
+{
+    return sides[side ^ 1].attached.load(std::memory_order_acquire);
+}
+
+void LinkCable::send(int side, const LinkMessage& message)
+{
+    sides[side ^ 1].inbox.push(&message, 1);
+}
+
+bool LinkCable::receive(int side, LinkMessage& message)
+{
+    return sides[side].inbox.pop(&message, 1) == 1;
+}
+
+void LinkCable::reply(int side, BYTE data)
+{
+    sides[side ^ 1].replies.push(&data, 1);
+}
+
+bool LinkCable::take_reply(int side, BYTE& data)
+{
+    return sides[side].replies.pop(&data, 1) == 1;
+}
+
+// Release, so a side that sees this progress also sees every message
+// sent before it
+void LinkCable::publish_progress(int side, uint64_t cycle)
+{
+    sides[side].progress.store(cycle, std::memory_order_release);
+}
+
+uint64_t LinkCable::partner_progress(int side) const
+{
+    return sides[side ^ 1].progress.load(std::memory_order_acquire);
+}
+
+void LinkCable::publish_latch(int side, WORD latch)
+{
+    sides[side].latch.store(latch, std::memory_order_relaxed);
+}
+
+WORD LinkCable::partner_latch(int side) const
+{
+    return sides[side ^ 1].latch.load(std::memory_order_relaxed);
+}
+
+void LinkCable::count_stall(int side, double seconds)
+{
+    sides[side].stalls++;
+    sides[side].stall_seconds += seconds;
+}
+
+void LinkCable::count_transfer(int side)
+{
+    sides[side].transfers++;
+}
+
+// Only meaningful once both threads have stopped
+void LinkCable::print_stats() const
+{
+    printf("Link cable (%s, max skew %llu cycles)\n",
+           deterministic ? "deterministic" : "free running",
+           (unsigned long long)max_skew());
+    for (int side = 0; side < 2; side++)
+    {
+        printf("  side %d: %ld transfers sent, %ld stalls, %.3f ms stalled\n",
+               side, sides[side].transfers, sides[side].stalls,
+               sides[side].stall_seconds * 1000.0);
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef LINKCABLE_H
+#define LINKCABLE_H
+
+#include <stdint.h>
+#include <atomic>
+#include "SpscRing.h"
+
+typedef unsigned char BYTE;
+typedef unsigned short WORD;
+
+// One byte takes 8 bits at 8192Hz with the internal clock
+#define SERIAL_TRANSFER_CYCLES 4096
+
+// How far one side may get ahead of the other, in cycles. Deterministic
+// mode can't allow more than a transfer's length (see LinkCable); free
+// running mode allows a frame.
+#define LINK_DETERMINISTIC_SKEW SERIAL_TRANSFER_CYCLES
+#define LINK_FREE_SKEW 70224
+
+// Each side tells the other how far it has got at least this often
+#define LINK_PUBLISH_INTERVAL 1024
+
+// Progress of a side that isn't plugged in, nobody waits for it
+#define LINK_DETACHED_PROGRESS (UINT64_MAX / 2)
+
+// A transfer started by the side with the internal clock, completing at
+// `cycle` on the sender's clock
+struct LinkMessage
+{
+    uint64_t cycle;
+    BYTE data;
+};
+
+// Serial link between two GB instances (0xFF01 SB / 0xFF02 SC), each
+// running on its own thread. Connect them with GB::connect_link(&cable, 0)
+// and GB::connect_link(&cable, 1) before starting either thread.
+//
+// The two sides never lock step. Each publishes its cycle count every
+// LINK_PUBLISH_INTERVAL cycles and only stops when it gets more than
+// the allowed skew ahead of the other one. The side that starts a
+// transfer posts its byte with the cycle the transfer completes at into
+// the other side's inbox, and all exchanges go through SPSC rings.
+//
+// Deterministic mode: a transfer posted at cycle S completes at
+// S + SERIAL_TRANSFER_CYCLES, so while a side stays less than that
+// ahead of the other, it has already seen every transfer that completes
+// before it gets there. Each byte is then delivered at the first
+// instruction boundary past its completion cycle, and the sender waits
+// for the receiver's reply (its SB at that point). Results are the same
+// however the threads get scheduled.
+//
+// Free running mode allows a frame of skew. Bytes are delivered when
+// they're seen, and the sender takes the receiver's most recently
+// published SB instead of waiting for the reply. Much less waiting, but
+// the result depends on thread timing.
+class LinkCable
+{
+public:
+    explicit LinkCable(bool deterministic = false);
+
+    bool is_deterministic() const;
+    uint64_t max_skew() const;
+
+    // All of these are called by the GB on `side`
+    void attach(int side, uint64_t cycle);
+    void detach(int side);
+    bool partner_attached(int side) const;
+
+    void send(int side, const LinkMessage& message);
+    bool receive(int side, LinkMessage& message);
+    void reply(int side, BYTE data);
+    bool take_reply(int side, BYTE& data);
+
+    void publish_progress(int side, uint64_t cycle);
+    uint64_t partner_progress(int side) const;
+
+    // free running mode: SB, plus 0x100 while waiting for the other
+    // side's clock
+    void publish_latch(int side, WORD latch);
+    WORD partner_latch(int side) const;
+
+    void count_stall(int side, double seconds);
+    void count_transfer(int side);
+    void print_stats() const;
+
+private:
+    struct Side
+    {
+        Side();
+
+        SpscRing<LinkMessage> inbox;
+        SpscRing<BYTE> replies;
+        // own cache line each, these are the only things both threads
+        // touch all the time
+        alignas(64) std::atomic<uint64_t> progress;
+        std::atomic<WORD> latch;
+        std::atomic<bool> attached;
+
+        // only written by the side's own thread
+        alignas(64) long transfers;
+        long stalls;
+        double stall_seconds;
+    };
+
+    bool deterministic;
+    Side sides[2];
+};
+
+#endif
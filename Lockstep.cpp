@@ -0,0 +1,863 @@
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include "Lockstep.h"
+
+// A lane key's fields above the PC
+#define KEY_BANK_SHIFT 16
+#define KEY_CARTRIDGE_SHIFT 25
+#define KEY_IME_PENDING (1u << 30)
+#define KEY_HALTED (1u << 31)
+
+// One 16-bit value per lane, 8-bit registers zero extended. Conditions
+// are all ones in the lanes where they hold.
+#if defined(__AVX2__)
+typedef __m256i LaneVector;
+
+static inline LaneVector lanes_load(const WORD* p) { return _mm256_load_si256((const __m256i*)p); }
+static inline void lanes_store(WORD* p, LaneVector v) { _mm256_store_si256((__m256i*)p, v); }
+static inline LaneVector lanes_set(int value) { return _mm256_set1_epi16((short)value); }
+static inline LaneVector lanes_add(LaneVector a, LaneVector b) { return _mm256_add_epi16(a, b); }
+static inline LaneVector lanes_sub(LaneVector a, LaneVector b) { return _mm256_sub_epi16(a, b); }
+static inline LaneVector lanes_and(LaneVector a, LaneVector b) { return _mm256_and_si256(a, b); }
+static inline LaneVector lanes_or(LaneVector a, LaneVector b) { return _mm256_or_si256(a, b); }
+static inline LaneVector lanes_xor(LaneVector a, LaneVector b) { return _mm256_xor_si256(a, b); }
+static inline LaneVector lanes_shl(LaneVector a, int bits) { return _mm256_sll_epi16(a, _mm_cvtsi32_si128(bits)); }
+static inline LaneVector lanes_shr(LaneVector a, int bits) { return _mm256_srl_epi16(a, _mm_cvtsi32_si128(bits)); }
+static inline LaneVector lanes_equal(LaneVector a, LaneVector b) { return _mm256_cmpeq_epi16(a, b); }
+static inline LaneVector lanes_select(LaneVector condition, LaneVector yes, LaneVector no)
+{
+    return _mm256_blendv_epi8(no, yes, condition);
+}
+
+// one bit per lane where the condition holds
+static inline unsigned lanes_mask(LaneVector condition)
+{
+#if defined(__AVX512BW__) && defined(__AVX512VL__)
+    return _mm256_movepi16_mask(condition);
+#else
+    __m128i packed = _mm_packs_epi16(_mm256_castsi256_si128(condition), _mm256_extracti128_si256(condition, 1));
+    return _mm_movemask_epi8(packed);
+#endif
+}
+
+// only the lanes in mask are written
+static inline void lanes_store_masked(WORD* p, unsigned mask, LaneVector v)
+{
+#if defined(__AVX512BW__) && defined(__AVX512VL__)
+    _mm256_mask_storeu_epi16(p, (__mmask16)mask, v);
+#else
+    const LaneVector bits = _mm256_setr_epi16(0x1, 0x2, 0x4, 0x8, 0x10, 0x20, 0x40, 0x80, 0x100, 0x200,
+                                              0x400, 0x800, 0x1000, 0x2000, 0x4000, (short)0x8000);
+    LaneVector selected = lanes_equal(lanes_and(lanes_set(mask), bits), bits);
+    lanes_store(p, lanes_select(selected, v, lanes_load(p)));
+#endif
+}
+#else
+// Without AVX2, plain loops over the lanes, which the compiler can
+// vectorize for whatever it's targeting
+struct LaneVector
+{
+    WORD v[LOCKSTEP_LANES];
+};
+
+#define LANES_APPLY(expression) \
+    LaneVector out; \
+    for (int i = 0; i < LOCKSTEP_LANES; i++) \
+        out.v[i] = (expression); \
+    return out;
+
+static inline LaneVector lanes_load(const WORD* p) { LANES_APPLY(p[i]) }
+static inline void lanes_store(WORD* p, LaneVector v) { memcpy(p, v.v, sizeof(v.v)); }
+static inline LaneVector lanes_set(int value) { LANES_APPLY((WORD)value) }
+static inline LaneVector lanes_add(LaneVector a, LaneVector b) { LANES_APPLY(a.v[i] + b.v[i]) }
+static inline LaneVector lanes_sub(LaneVector a, LaneVector b) { LANES_APPLY(a.v[i] - b.v[i]) }
+static inline LaneVector lanes_and(LaneVector a, LaneVector b) { LANES_APPLY(a.v[i] & b.v[i]) }
+static inline LaneVector lanes_or(LaneVector a, LaneVector b) { LANES_APPLY(a.v[i] | b.v[i]) }
+static inline LaneVector lanes_xor(LaneVector a, LaneVector b) { LANES_APPLY(a.v[i] ^ b.v[i]) }
+static inline LaneVector lanes_shl(LaneVector a, int bits) { LANES_APPLY(a.v[i] << bits) }
+static inline LaneVector lanes_shr(LaneVector a, int bits) { LANES_APPLY(a.v[i] >> bits) }
+static inline LaneVector lanes_equal(LaneVector a, LaneVector b) { LANES_APPLY((a.v[i] == b.v[i]) ? 0xFFFF : 0) }
+static inline LaneVector lanes_select(LaneVector condition, LaneVector yes, LaneVector no)
+{
+    LANES_APPLY((yes.v[i] & condition.v[i]) | (no.v[i] & ~condition.v[i]))
+}
+
+static inline unsigned lanes_mask(LaneVector condition)
+{
+    unsigned mask = 0;
+    for (int i = 0; i < LOCKSTEP_LANES; i++)
+        mask |= (condition.v[i] & 1) << i;
+    return mask;
+}
+
+static inline void lanes_store_masked(WORD* p, unsigned mask, LaneVector v)
+{
+    for (int i = 0; i < LOCKSTEP_LANES; i++)
+    {
+        if (mask & (1 << i))
+            p[i] = v.v[i];
+    }
+}
+#endif
+
+static inline LaneVector lanes_byte(LaneVector v)
+{
+    return lanes_and(v, lanes_set(0xFF));
+}
+
+// FLAG_MASK_Z where the low byte is 0
+static inline LaneVector zero_flag(LaneVector result)
+{
+    return lanes_and(lanes_equal(lanes_byte(result), lanes_set(0)), lanes_set(FLAG_MASK_Z));
+}
+
+// Flags of an 8-bit add or subtract, with the carry or borrow in bit 8
+// of result, as GB::get_flags works them out
+static inline LaneVector add_flags(LaneVector a, LaneVector b, LaneVector result)
+{
+    LaneVector half_carry = lanes_and(lanes_shl(lanes_xor(lanes_xor(a, b), result), 1), lanes_set(FLAG_MASK_H));
+    LaneVector carry = lanes_and(lanes_shr(result, 4), lanes_set(FLAG_MASK_C));
+    return lanes_or(lanes_or(zero_flag(result), half_carry), carry);
+}
+
+static inline LaneVector sub_flags(LaneVector a, LaneVector b, LaneVector result)
+{
+    return lanes_or(add_flags(a, b, result), lanes_set(FLAG_MASK_N));
+}
+
+// One step's view of the batch: the group's lanes and the registers
+// every lane's instruction works on
+struct LaneStep
+{
+    WORD (*registers)[LOCKSTEP_LANES];
+    GB* const* instances;
+    unsigned mask;
+
+    LaneVector get(int reg) const { return lanes_load(registers[reg]); }
+    void set(int reg, LaneVector value) { lanes_store_masked(registers[reg], mask, value); }
+    void set(int reg, LaneVector value, unsigned lanes) { lanes_store_masked(registers[reg], lanes, value); }
+
+    // BC, DE, HL, SP as the 16-bit ops encode them
+    LaneVector get_pair(int pair) const
+    {
+        if (pair == 3)
+            return get(LANE_SP);
+        return lanes_or(lanes_shl(get(pair * 2), 8), get(pair * 2 + 1));
+    }
+    void set_pair(int pair, LaneVector value)
+    {
+        if (pair == 3)
+        {
+            set(LANE_SP, value);
+            return;
+        }
+        set(pair * 2, lanes_shr(value, 8));
+        set(pair * 2 + 1, lanes_byte(value));
+    }
+
+    // every lane reads or writes its own instance's memory
+    LaneVector read(LaneVector address, unsigned lanes) const
+    {
+        alignas(32) WORD addresses[LOCKSTEP_LANES];
+        alignas(32) WORD values[LOCKSTEP_LANES] = {0};
+        lanes_store(addresses, address);
+        for (unsigned m = lanes; m; m &= m - 1)
+        {
+            int lane = __builtin_ctz(m);
+            values[lane] = instances[lane]->read_memory(addresses[lane]);
+        }
+        return lanes_load(values);
+    }
+    LaneVector read(LaneVector address) const { return read(address, mask); }
+    void write(LaneVector address, LaneVector data, unsigned lanes)
+    {
+        alignas(32) WORD addresses[LOCKSTEP_LANES];
+        alignas(32) WORD values[LOCKSTEP_LANES];
+        lanes_store(addresses, address);
+        lanes_store(values, data);
+        for (unsigned m = lanes; m; m &= m - 1)
+        {
+            int lane = __builtin_ctz(m);
+            instances[lane]->write_address(addresses[lane], (BYTE)values[lane]);
+        }
+    }
+    void write(LaneVector address, LaneVector data) { write(address, data, mask); }
+
+    // r in opcode order, 6 being (HL)
+    LaneVector get_operand(int reg) const
+    {
+        if (reg == LANE_F)
+            return read(get_pair(2));
+        return get(reg);
+    }
+    void set_operand(int reg, LaneVector value)
+    {
+        if (reg == LANE_F)
+            write(get_pair(2), value);
+        else
+            set(reg, lanes_byte(value));
+    }
+
+    // same order as GB::push_word_on_stack and pop_word_off_stack
+    void push(LaneVector word, unsigned lanes)
+    {
+        LaneVector sp = lanes_sub(get(LANE_SP), lanes_set(2));
+        set(LANE_SP, sp, lanes);
+        write(lanes_add(sp, lanes_set(1)), lanes_shr(word, 8), lanes);
+        write(sp, lanes_byte(word), lanes);
+    }
+    LaneVector pop(unsigned lanes)
+    {
+        LaneVector sp = get(LANE_SP);
+        LaneVector low = read(sp, lanes);
+        LaneVector high = read(lanes_add(sp, lanes_set(1)), lanes);
+        set(LANE_SP, lanes_add(sp, lanes_set(2)), lanes);
+        return lanes_or(lanes_shl(high, 8), low);
+    }
+
+    // NZ, Z, NC, C
+    LaneVector condition(int condition) const
+    {
+        int flag = (condition & 2) ? FLAG_MASK_C : FLAG_MASK_Z;
+        LaneVector bit = lanes_and(get(LANE_F), lanes_set(flag));
+        return lanes_equal(bit, lanes_set((condition & 1) ? flag : 0));
+    }
+
+    // ADD, ADC, SUB, SBC, AND, XOR, OR, CP, as GB::alu_operation
+    void alu(int operation, LaneVector value)
+    {
+        LaneVector a = get(LANE_A);
+        LaneVector carry = lanes_set(0);
+        if ((operation == 1) || (operation == 3))
+            carry = lanes_and(lanes_shr(get(LANE_F), 4), lanes_set(1));
+        LaneVector result;
+        LaneVector flags;
+        switch (operation)
+        {
+            case 0: case 1:
+                result = lanes_add(lanes_add(a, value), carry);
+                flags = add_flags(a, value, result);
+                break;
+            case 2: case 3: case 7:
+                result = lanes_sub(lanes_sub(a, value), carry);
+                flags = sub_flags(a, value, result);
+                break;
+            case 4:
+                result = lanes_and(a, value);
+                flags = lanes_or(zero_flag(result), lanes_set(FLAG_MASK_H));
+                break;
+            case 5:
+                result = lanes_xor(a, value);
+                flags = zero_flag(result);
+                break;
+            default:
+                result = lanes_or(a, value);
+                flags = zero_flag(result);
+                break;
+        }
+        if (operation != 7)
+            set(LANE_A, lanes_byte(result));
+        set(LANE_F, flags);
+    }
+
+    // INC and DEC r leave C alone
+    LaneVector increment(LaneVector value, int delta)
+    {
+        LaneVector one = lanes_set(1);
+        LaneVector result = (delta > 0) ? lanes_add(value, one) : lanes_sub(value, one);
+        LaneVector flags = (delta > 0) ? add_flags(value, one, lanes_byte(result)) : sub_flags(value, one, lanes_byte(result));
+        set(LANE_F, lanes_or(flags, lanes_and(get(LANE_F), lanes_set(FLAG_MASK_C))));
+        return lanes_byte(result);
+    }
+
+    // RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL, as GB::alu_shift. carry
+    // comes back as FLAG_MASK_C or 0.
+    LaneVector shift(int operation, LaneVector value, LaneVector& carry) const
+    {
+        LaneVector carry_in = lanes_and(lanes_shr(get(LANE_F), 4), lanes_set(1));
+        LaneVector top = lanes_shr(value, 7);
+        LaneVector bottom = lanes_and(value, lanes_set(1));
+        LaneVector result;
+        switch (operation)
+        {
+            case 0: carry = top; result = lanes_or(lanes_shl(value, 1), top); break;
+            case 1: carry = bottom; result = lanes_or(lanes_shr(value, 1), lanes_shl(bottom, 7)); break;
+            case 2: carry = top; result = lanes_or(lanes_shl(value, 1), carry_in); break;
+            case 3: carry = bottom; result = lanes_or(lanes_shr(value, 1), lanes_shl(carry_in, 7)); break;
+            case 4: carry = top; result = lanes_shl(value, 1); break;
+            case 5: carry = bottom; result = lanes_or(lanes_shr(value, 1), lanes_and(value, lanes_set(0x80))); break;
+            case 6: carry = lanes_set(0); result = lanes_or(lanes_shl(value, 4), lanes_shr(value, 4)); break;
+            default: carry = bottom; result = lanes_shr(value, 1); break;
+        }
+        carry = lanes_shl(carry, 4);
+        return lanes_byte(result);
+    }
+
+    // ADD HL,rr keeps Z, and carries out of bits 11 and 15
+    void add_hl(LaneVector value)
+    {
+        LaneVector hl = get_pair(2);
+        LaneVector low_bits = lanes_set(0xFFF);
+        LaneVector half = lanes_add(lanes_and(hl, low_bits), lanes_and(value, low_bits));
+        LaneVector half_carry = lanes_shr(lanes_and(half, lanes_set(0x1000)), 7);
+        LaneVector both_odd = lanes_and(lanes_and(hl, value), lanes_set(1));
+        LaneVector carry = lanes_shr(lanes_add(lanes_add(lanes_shr(hl, 1), lanes_shr(value, 1)), both_odd), 15);
+        LaneVector zero = lanes_and(get(LANE_F), lanes_set(FLAG_MASK_Z));
+        set(LANE_F, lanes_or(lanes_or(zero, half_carry), lanes_shl(carry, 4)));
+        set_pair(2, lanes_add(hl, value));
+    }
+};
+
+LockstepBatch::LockstepBatch(const std::vector<GB*>& lanes)
+    : instances(lanes)
+{
+    if (instances.size() > LOCKSTEP_LANES)
+        instances.resize(LOCKSTEP_LANES);
+    all_lanes = (1u << instances.size()) - 1;
+    for (size_t lane = 0; lane < instances.size(); lane++)
+    {
+        cartridge_id[lane] = lane;
+        for (size_t other = 0; other < lane; other++)
+        {
+            if (instances[other]->cartridge_image() == instances[lane]->cartridge_image())
+            {
+                cartridge_id[lane] = cartridge_id[other];
+                break;
+            }
+        }
+    }
+    memset(registers, 0, sizeof(registers));
+    memset(keys, 0xFF, sizeof(keys));
+    reset_stats();
+}
+
+const char* LockstepBatch::vector_isa()
+{
+#if defined(__AVX2__) && defined(__AVX512BW__) && defined(__AVX512VL__)
+    return "avx512";
+#elif defined(__AVX2__)
+    return "avx2";
+#else
+    return "portable";
+#endif
+}
+
+const LockstepStats& LockstepBatch::stats() const
+{
+    return counts;
+}
+
+void LockstepBatch::reset_stats()
+{
+    memset(&counts, 0, sizeof(counts));
+    counts.lanes = instances.size();
+}
+
+double LockstepStats::utilization() const
+{
+    return (steps && lanes) ? (double)lane_steps / ((double)steps * lanes) : 0.0;
+}
+
+double LockstepStats::vector_share() const
+{
+    uint64_t total = vector_instructions + scalar_instructions;
+    return total ? (double)vector_instructions / total : 0.0;
+}
+
+void LockstepBatch::load_lane(int lane)
+{
+    const GB& gb = *instances[lane];
+    registers[LANE_A][lane] = gb.regAF.high;
+    registers[LANE_F][lane] = gb.get_flags();
+    registers[LANE_B][lane] = gb.regBC.high;
+    registers[LANE_C][lane] = gb.regBC.low;
+    registers[LANE_D][lane] = gb.regDE.high;
+    registers[LANE_E][lane] = gb.regDE.low;
+    registers[LANE_H][lane] = gb.regHL.high;
+    registers[LANE_L][lane] = gb.regHL.low;
+    registers[LANE_SP][lane] = gb.stack_pointer.reg;
+    registers[LANE_PC][lane] = gb.program_counter;
+}
+
+void LockstepBatch::store_lane(int lane)
+{
+    GB& gb = *instances[lane];
+    gb.regAF.high = registers[LANE_A][lane];
+    gb.regAF.low = registers[LANE_F][lane];
+    gb.flag_op = FLAGS_KNOWN;
+    gb.regBC.high = registers[LANE_B][lane];
+    gb.regBC.low = registers[LANE_C][lane];
+    gb.regDE.high = registers[LANE_D][lane];
+    gb.regDE.low = registers[LANE_E][lane];
+    gb.regHL.high = registers[LANE_H][lane];
+    gb.regHL.low = registers[LANE_L][lane];
+    gb.stack_pointer.reg = registers[LANE_SP][lane];
+    gb.program_counter = registers[LANE_PC][lane];
+}
+
+// Halted lanes all match each other, whatever their PC
+uint32_t LockstepBatch::lane_key(int lane) const
+{
+    const GB& gb = *instances[lane];
+    uint32_t key = (uint32_t)cartridge_id[lane] << KEY_CARTRIDGE_SHIFT;
+    if (gb.halted)
+        return key | KEY_HALTED;
+    WORD pc = registers[LANE_PC][lane];
+    key |= pc;
+    if ((pc >= 0x4000) && (pc < 0x8000))
+        key |= (uint32_t)(gb.current_ROM_bank & gb.rom_bank_mask) << KEY_BANK_SHIFT;
+    if (gb.ime_pending)
+        key |= KEY_IME_PENDING;
+    return key;
+}
+
+// Lanes whose key is key, unused lanes included (their keys never match)
+unsigned LockstepBatch::matching(uint32_t key) const
+{
+#if defined(__AVX512F__)
+    return _mm512_cmpeq_epi32_mask(_mm512_load_si512(keys), _mm512_set1_epi32(key));
+#elif defined(__AVX2__)
+    __m256i wanted = _mm256_set1_epi32(key);
+    __m256i low = _mm256_cmpeq_epi32(_mm256_load_si256((const __m256i*)keys), wanted);
+    __m256i high = _mm256_cmpeq_epi32(_mm256_load_si256((const __m256i*)(keys + 8)), wanted);
+    return _mm256_movemask_ps(_mm256_castsi256_ps(low)) | (_mm256_movemask_ps(_mm256_castsi256_ps(high)) << 8);
+#else
+    unsigned mask = 0;
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        if (keys[lane] == key)
+            mask |= 1u << lane;
+    }
+    return mask;
+#endif
+}
+
+// The running lane at the lowest PC, preferring lanes that aren't
+// halted, unless one has fallen too far behind
+int LockstepBatch::pick_leader(unsigned running, const int* frame) const
+{
+    int behind = -1;
+    int ahead = -1;
+    int lowest = -1;
+    for (unsigned m = running; m; m &= m - 1)
+    {
+        int lane = __builtin_ctz(m);
+        if ((behind < 0) || (frame[lane] < frame[behind]))
+            behind = lane;
+        if ((ahead < 0) || (frame[lane] > frame[ahead]))
+            ahead = lane;
+        if (!(keys[lane] & KEY_HALTED) &&
+            ((lowest < 0) || (registers[LANE_PC][lane] < registers[LANE_PC][lowest])))
+            lowest = lane;
+    }
+    if ((lowest < 0) || (frame[ahead] - frame[behind] > LOCKSTEP_MAX_SKEW))
+        return behind;
+    return lowest;
+}
+
+void LockstepBatch::update()
+{
+    const int MAX_CYCLES = CYCLES_PER_FRAME;
+    int frame[LOCKSTEP_LANES];
+    int instructions[LOCKSTEP_LANES];
+    int halted_cycles[LOCKSTEP_LANES];
+    alignas(32) WORD cycles[LOCKSTEP_LANES];
+    for (size_t lane = 0; lane < instances.size(); lane++)
+    {
+        load_lane(lane);
+        keys[lane] = lane_key(lane);
+        frame[lane] = instances[lane]->frame_cycles;
+        instructions[lane] = 0;
+        halted_cycles[lane] = 0;
+    }
+
+    unsigned running = all_lanes;
+    while (running)
+    {
+        int leader = pick_leader(running, frame);
+        unsigned group = matching(keys[leader]) & running;
+        int lanes = __builtin_popcount(group);
+        bool halted = (keys[leader] & KEY_HALTED) != 0;
+        counts.steps++;
+        counts.lane_steps += lanes;
+
+        if (halted)
+            counts.halted_steps += lanes;
+        else if (execute(leader, group, cycles))
+        {
+            counts.vector_steps++;
+            counts.vector_instructions += lanes;
+        }
+        else
+        {
+            for (unsigned m = group; m; m &= m - 1)
+            {
+                int lane = __builtin_ctz(m);
+                store_lane(lane);
+                cycles[lane] = instances[lane]->get_opcode();
+                load_lane(lane);
+            }
+            counts.scalar_instructions += lanes;
+        }
+
+        // the rest of the machine, as run_frame does after an instruction
+        for (unsigned m = group; m; m &= m - 1)
+        {
+            int lane = __builtin_ctz(m);
+            GB& gb = *instances[lane];
+            gb.program_counter = registers[LANE_PC][lane];
+            gb.stack_pointer.reg = registers[LANE_SP][lane];
+            if (halted)
+            {
+                // a halted lane idles on by itself until it wakes, as far
+                // as the skew allows, which is all grouping would do
+                int idle = 0;
+                do
+                {
+                    gb.run_hardware(4);
+                    idle += 4;
+                } while (gb.halted && (frame[lane] + idle < MAX_CYCLES) && (idle < LOCKSTEP_MAX_SKEW));
+                halted_cycles[lane] += idle;
+                frame[lane] += idle;
+            }
+            else
+            {
+                instructions[lane]++;
+                gb.run_hardware(cycles[lane]);
+                frame[lane] += cycles[lane];
+            }
+            registers[LANE_PC][lane] = gb.program_counter;
+            registers[LANE_SP][lane] = gb.stack_pointer.reg;
+            keys[lane] = lane_key(lane);
+            if (frame[lane] >= MAX_CYCLES)
+            {
+                finish_lane(lane, frame[lane], instructions[lane], halted_cycles[lane]);
+                running &= ~(1u << lane);
+            }
+        }
+    }
+    memset(keys, 0xFF, sizeof(keys));
+}
+
+// The end of run_frame, for a lane that has run its frame
+void LockstepBatch::finish_lane(int lane, int cycles, int instructions, int halted_cycles)
+{
+    GB& gb = *instances[lane];
+    store_lane(lane);
+    gb.interpreted_instructions += instructions;
+    if (gb.counters)
+    {
+        gb.counters->instructions.fetch_add(instructions, std::memory_order_relaxed);
+        gb.counters->cycles.fetch_add(cycles - gb.frame_cycles, std::memory_order_relaxed);
+        gb.counters->halted_cycles.fetch_add(halted_cycles, std::memory_order_relaxed);
+    }
+    gb.frame_cycles = 0;
+    gb.finish_frame();
+}
+
+// Runs the instruction at the leader's PC on every lane in mask, storing
+// each lane's cycles. False, with nothing changed, if it has to be left
+// to the scalar path.
+bool LockstepBatch::execute(int leader, unsigned mask, WORD* cycles)
+{
+    WORD pc = registers[LANE_PC][leader];
+    // the opcode and its operands have to be in ROM, which every lane in
+    // the group sees the same bank of
+    if ((pc >= 0x7FFE) || (keys[leader] & KEY_IME_PENDING))
+        return false;
+    const GB& gb = *instances[leader];
+    BYTE opcode = gb.read_memory(pc);
+    BYTE operand = gb.read_memory(pc + 1);
+    WORD immediate = operand | (gb.read_memory(pc + 2) << 8);
+
+    LaneStep step = {registers, &instances[0], mask};
+    int reg = (opcode >> 3) & 7;
+    int pair = (opcode >> 4) & 3;
+    int length = 1;
+    int taken = 0;
+    int not_taken = 0;
+    // where the lanes go, for opcodes that jump
+    LaneVector target = lanes_set(0);
+    LaneVector condition = lanes_set(0xFFFF);
+    bool jumps = false;
+
+    if ((opcode >= 0x40) && (opcode < 0x80))
+    {
+        if (opcode == 0x76)
+            return false;
+        int source = opcode & 7;
+        step.set_operand(reg, step.get_operand(source));
+        taken = ((reg == LANE_F) || (source == LANE_F)) ? 8 : 4;
+    }
+    else if ((opcode >= 0x80) && (opcode < 0xC0))
+    {
+        int source = opcode & 7;
+        step.alu(reg, step.get_operand(source));
+        taken = (source == LANE_F) ? 8 : 4;
+    }
+    else
+    {
+        switch (opcode)
+        {
+            case 0x00: taken = 4; break;
+
+            case 0x01: case 0x11: case 0x21: case 0x31:
+                step.set_pair(pair, lanes_set(immediate));
+                length = 3;
+                taken = 12;
+                break;
+
+            case 0x02: case 0x12:
+                step.write(step.get_pair(pair), step.get(LANE_A));
+                taken = 8;
+                break;
+            case 0x22: case 0x32:
+            {
+                LaneVector hl = step.get_pair(2);
+                step.write(hl, step.get(LANE_A));
+                step.set_pair(2, (opcode == 0x22) ? lanes_add(hl, lanes_set(1)) : lanes_sub(hl, lanes_set(1)));
+                taken = 8;
+                break;
+            }
+            case 0x0A: case 0x1A:
+                step.set(LANE_A, step.read(step.get_pair(pair)));
+                taken = 8;
+                break;
+            case 0x2A: case 0x3A:
+            {
+                LaneVector hl = step.get_pair(2);
+                step.set(LANE_A, step.read(hl));
+                step.set_pair(2, (opcode == 0x2A) ? lanes_add(hl, lanes_set(1)) : lanes_sub(hl, lanes_set(1)));
+                taken = 8;
+                break;
+            }
+
+            case 0x03: case 0x13: case 0x23: case 0x33:
+                step.set_pair(pair, lanes_add(step.get_pair(pair), lanes_set(1)));
+                taken = 8;
+                break;
+            case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+                step.set_pair(pair, lanes_sub(step.get_pair(pair), lanes_set(1)));
+                taken = 8;
+                break;
+
+            case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x34: case 0x3C:
+            case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x35: case 0x3D:
+                step.set_operand(reg, step.increment(step.get_operand(reg), (opcode & 1) ? -1 : 1));
+                taken = (reg == LANE_F) ? 12 : 4;
+                break;
+            case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x36: case 0x3E:
+                step.set_operand(reg, lanes_set(operand));
+                length = 2;
+                taken = (reg == LANE_F) ? 12 : 8;
+                break;
+
+            // RLCA, RRCA, RLA, RRA clear Z
+            case 0x07: case 0x0F: case 0x17: case 0x1F:
+            {
+                LaneVector carry;
+                step.set(LANE_A, step.shift(reg, step.get(LANE_A), carry));
+                step.set(LANE_F, carry);
+                taken = 4;
+                break;
+            }
+
+            case 0x09: case 0x19: case 0x29: case 0x39:
+                step.add_hl(step.get_pair(pair));
+                taken = 8;
+                break;
+
+            case 0x2F:
+                step.set(LANE_A, lanes_xor(step.get(LANE_A), lanes_set(0xFF)));
+                step.set(LANE_F, lanes_or(step.get(LANE_F), lanes_set(FLAG_MASK_N | FLAG_MASK_H)));
+                taken = 4;
+                break;
+            case 0x37: case 0x3F:
+            {
+                LaneVector flags = step.get(LANE_F);
+                LaneVector carry = (opcode == 0x37) ? lanes_set(FLAG_MASK_C)
+                                                    : lanes_xor(lanes_and(flags, lanes_set(FLAG_MASK_C)), lanes_set(FLAG_MASK_C));
+                step.set(LANE_F, lanes_or(lanes_and(flags, lanes_set(FLAG_MASK_Z)), carry));
+                taken = 4;
+                break;
+            }
+
+            case 0x18:
+                jumps = true;
+                target = lanes_set((WORD)(pc + 2 + (SIGNED_BYTE)operand));
+                length = 2;
+                taken = 12;
+                break;
+            case 0x20: case 0x28: case 0x30: case 0x38:
+                jumps = true;
+                condition = step.condition(reg & 3);
+                target = lanes_set((WORD)(pc + 2 + (SIGNED_BYTE)operand));
+                length = 2;
+                taken = 12;
+                not_taken = 8;
+                break;
+            case 0xC3:
+                jumps = true;
+                target = lanes_set(immediate);
+                length = 3;
+                taken = 16;
+                break;
+            case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+                jumps = true;
+                condition = step.condition(reg & 3);
+                target = lanes_set(immediate);
+                length = 3;
+                taken = 16;
+                not_taken = 12;
+                break;
+            case 0xE9:
+                jumps = true;
+                target = step.get_pair(2);
+                taken = 4;
+                break;
+
+            case 0xCD: case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+            case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+            {
+                jumps = true;
+                bool restart = (opcode & 7) == 7;
+                if ((opcode & 0xC7) == 0xC4)
+                    condition = step.condition(reg & 3);
+                length = restart ? 1 : 3;
+                target = lanes_set(restart ? (opcode & 0x38) : immediate);
+                taken = restart ? 16 : 24;
+                not_taken = 12;
+                step.push(lanes_set((WORD)(pc + length)), mask & lanes_mask(condition));
+                break;
+            }
+            case 0xC9:
+                jumps = true;
+                target = step.pop(mask);
+                taken = 16;
+                break;
+            case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+                jumps = true;
+                condition = step.condition(reg & 3);
+                target = step.pop(mask & lanes_mask(condition));
+                taken = 20;
+                not_taken = 8;
+                break;
+
+            case 0xC1: case 0xD1: case 0xE1:
+                step.set_pair(pair, step.pop(mask));
+                taken = 12;
+                break;
+            case 0xF1:
+            {
+                LaneVector word = step.pop(mask);
+                step.set(LANE_A, lanes_shr(word, 8));
+                step.set(LANE_F, lanes_and(word, lanes_set(0xF0)));
+                taken = 12;
+                break;
+            }
+            case 0xC5: case 0xD5: case 0xE5:
+                step.push(step.get_pair(pair), mask);
+                taken = 16;
+                break;
+            case 0xF5:
+                step.push(lanes_or(lanes_shl(step.get(LANE_A), 8), step.get(LANE_F)), mask);
+                taken = 16;
+                break;
+
+            case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+                step.alu(reg, lanes_set(operand));
+                length = 2;
+                taken = 8;
+                break;
+
+            case 0xE0:
+                step.write(lanes_set(0xFF00 | operand), step.get(LANE_A));
+                length = 2;
+                taken = 12;
+                break;
+            case 0xF0:
+                step.set(LANE_A, step.read(lanes_set(0xFF00 | operand)));
+                length = 2;
+                taken = 12;
+                break;
+            case 0xE2:
+                step.write(lanes_or(step.get(LANE_C), lanes_set(0xFF00)), step.get(LANE_A));
+                taken = 8;
+                break;
+            case 0xF2:
+                step.set(LANE_A, step.read(lanes_or(step.get(LANE_C), lanes_set(0xFF00))));
+                taken = 8;
+                break;
+            case 0xEA:
+                step.write(lanes_set(immediate), step.get(LANE_A));
+                length = 3;
+                taken = 16;
+                break;
+            case 0xFA:
+                step.set(LANE_A, step.read(lanes_set(immediate)));
+                length = 3;
+                taken = 16;
+                break;
+            case 0xF9:
+                step.set(LANE_SP, step.get_pair(2));
+                taken = 8;
+                break;
+
+            case 0xCB:
+            {
+                int target_reg = operand & 7;
+                int bit = (operand >> 3) & 7;
+                bool indirect = (target_reg == LANE_F);
+                LaneVector value = step.get_operand(target_reg);
+                length = 2;
+                taken = indirect ? 16 : 8;
+                switch (operand >> 6)
+                {
+                    case 0:
+                    {
+                        LaneVector carry;
+                        LaneVector result = step.shift(bit, value, carry);
+                        step.set(LANE_F, lanes_or(zero_flag(result), carry));
+                        step.set_operand(target_reg, result);
+                        break;
+                    }
+                    case 1:
+                    {
+                        LaneVector tested = lanes_and(value, lanes_set(1 << bit));
+                        LaneVector carry = lanes_and(step.get(LANE_F), lanes_set(FLAG_MASK_C));
+                        step.set(LANE_F, lanes_or(lanes_or(zero_flag(tested), lanes_set(FLAG_MASK_H)), carry));
+                        taken = indirect ? 12 : 8;
+                        break;
+                    }
+                    case 2:
+                        step.set_operand(target_reg, lanes_and(value, lanes_set(~(1 << bit) & 0xFF)));
+                        break;
+                    default:
+                        step.set_operand(target_reg, lanes_or(value, lanes_set(1 << bit)));
+                        break;
+                }
+                break;
+            }
+
+            // DAA, LD (a16),SP, STOP, ADD SP / LD HL,SP+r8, DI, EI, RETI
+            // and the opcodes that don't exist
+            default:
+                return false;
+        }
+    }
+
+    LaneVector next = lanes_set((WORD)(pc + length));
+    if (jumps)
+    {
+        step.set(LANE_PC, lanes_select(condition, target, next));
+        lanes_store(cycles, lanes_select(condition, lanes_set(taken), lanes_set(not_taken)));
+    }
+    else
+    {
+        step.set(LANE_PC, next);
+        lanes_store(cycles, lanes_set(taken));
+    }
+    return true;
+}
@@ -0,0 +1,98 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdint.h>
+#include <vector>
+#include "GB.h"
+
+// Most lanes a batch holds: 16-bit registers for every lane fill one
+// 256-bit vector
+#define LOCKSTEP_LANES 16
+// A lane this many cycles behind the one furthest into the frame runs
+// next, whatever PC it's at, so lanes can't drift apart by more than a
+// few scanlines and their vblanks keep landing together
+#define LOCKSTEP_MAX_SKEW 1024
+
+// Registers in the order the opcodes encode them, with F where (HL)
+// would be, then SP and PC
+enum lockstep_register {LANE_B=0, LANE_C=1, LANE_D=2, LANE_E=3, LANE_H=4, LANE_L=5,
+                        LANE_F=6, LANE_A=7, LANE_SP=8, LANE_PC=9, LANE_REGISTERS=10};
+
+// What a batch has run since it was made (or reset_stats). A step is
+// one instruction, or 4 halted cycles, for every lane of the group it
+// picked.
+struct LockstepStats
+{
+    int lanes;
+    uint64_t steps;
+    // lanes run, summed over the steps
+    uint64_t lane_steps;
+    // steps the vector path ran, and the lane instructions in them
+    uint64_t vector_steps;
+    uint64_t vector_instructions;
+    // lane instructions run one lane at a time
+    uint64_t scalar_instructions;
+    uint64_t halted_steps;
+
+    // average share of the lanes each step ran
+    double utilization() const;
+    // share of the instructions the vector path ran
+    double vector_share() const;
+};
+
+// Experimental lockstep interpreter for batches of instances running the
+// same cartridge, as RL workloads do. The CPU registers of every lane
+// live here as arrays (structure of arrays) while a frame runs. Each
+// step picks a group of lanes at the same instruction: the lane at the
+// lowest PC leads, so lanes that branched apart meet again where the
+// paths join, unless one has fallen LOCKSTEP_MAX_SKEW cycles behind. The
+// group runs the instruction on all its lanes at once, with AVX2 (masked
+// stores and compares with AVX-512) or plain loops over the lanes when
+// built without them; lanes outside the group are masked out. Memory
+// operands are gathered and scattered lane by lane through each
+// instance's read_memory and write_address. Opcodes without a vector
+// version (HALT, EI, DI, RETI, DAA and a few rare ones), lanes running
+// code from RAM and lanes with an EI pending run one at a time through
+// GB::get_opcode. Timers, PPU and interrupts are caught up per lane after
+// every step, so each lane ends up exactly where update() would have
+// taken it.
+//
+// The instances are borrowed. Between update() calls they're ordinary
+// GBs; they shouldn't have a trace or debugger attached, and a loaded
+// recompiled module is ignored.
+class LockstepBatch
+{
+public:
+    explicit LockstepBatch(const std::vector<GB*>& instances);
+
+    // a frame on every lane, the same as update() on each of them
+    void update();
+    const LockstepStats& stats() const;
+    void reset_stats();
+    // "avx512", "avx2" or "portable", whichever this was built for
+    static const char* vector_isa();
+
+private:
+    void load_lane(int lane);
+    void store_lane(int lane);
+    uint32_t lane_key(int lane) const;
+    unsigned matching(uint32_t key) const;
+    int pick_leader(unsigned running, const int* frame) const;
+    void finish_lane(int lane, int cycles, int instructions, int halted_cycles);
+    bool execute(int leader, unsigned mask, WORD* cycles);
+
+    std::vector<GB*> instances;
+    unsigned all_lanes;
+    // lanes with the same cartridge image share a number, only they
+    // can be grouped
+    int cartridge_id[LOCKSTEP_LANES];
+
+    alignas(64) WORD registers[LANE_REGISTERS][LOCKSTEP_LANES];
+    // what a lane has to match to join a group: PC, its ROM bank and
+    // the state bits that keep it out of the vector path
+    alignas(64) uint32_t keys[LOCKSTEP_LANES];
+
+    LockstepStats counts;
+};
+
+#endif
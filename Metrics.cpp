@@ -0,0 +1,211 @@
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "Metrics.h"
+
+// emulated cycles per second of a real Game Boy
+#define METRICS_CLOCKSPEED 4194304.0
+
+InstanceCounters::InstanceCounters(const std::string& name)
+    : name(name), frames(0), instructions(0), cycles(0), halted_cycles(0),
+      dropped_frames(0), audio_underruns(0), audio_overruns(0)
+{
+}
+
+Metrics::Totals Metrics::read_totals(const InstanceCounters& counters)
+{
+    Totals totals;
+    totals.value[FRAMES] = counters.frames.load(std::memory_order_relaxed);
+    totals.value[INSTRUCTIONS] = counters.instructions.load(std::memory_order_relaxed);
+    totals.value[CYCLES] = counters.cycles.load(std::memory_order_relaxed);
+    totals.value[HALTED_CYCLES] = counters.halted_cycles.load(std::memory_order_relaxed);
+    totals.value[DROPPED_FRAMES] = counters.dropped_frames.load(std::memory_order_relaxed);
+    totals.value[AUDIO_UNDERRUNS] = counters.audio_underruns.load(std::memory_order_relaxed);
+    totals.value[AUDIO_OVERRUNS] = counters.audio_overruns.load(std::memory_order_relaxed);
+    return totals;
+}
+
+Metrics::Metrics()
+    : previous_time(std::chrono::steady_clock::now()), format(METRICS_JSON),
+      interval_ms(1000), running(false)
+{
+}
+
+Metrics::~Metrics()
+{
+    stop();
+}
+
+InstanceCounters* Metrics::add_instance(const std::string& name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    entries.emplace_back(name);
+    return &entries.back().counters;
+}
+
+// The instance must not touch the counters after this
+void Metrics::remove_instance(InstanceCounters* counters)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (std::list<Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        if (&it->counters == counters)
+        {
+            entries.erase(it);
+            return;
+        }
+    }
+}
+
+void Metrics::start(const std::string& output_path, metrics_format output_format, int interval)
+{
+    stop();
+    path = output_path;
+    format = output_format;
+    interval_ms = interval;
+    running = true;
+    exporter = std::thread(&Metrics::export_loop, this);
+}
+
+void Metrics::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!running)
+            return;
+        running = false;
+    }
+    wakeup.notify_one();
+    exporter.join();
+}
+
+void Metrics::export_loop()
+{
+    // nice 19 for just this thread, it must never take time from emulation
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    std::string temporary = path + ".tmp";
+    std::unique_lock<std::mutex> guard(lock);
+    while (running)
+    {
+        wakeup.wait_for(guard, std::chrono::milliseconds(interval_ms));
+        if (!running)
+            break;
+        guard.unlock();
+        FILE* out = fopen(temporary.c_str(), "w");
+        if (out)
+        {
+            write(out, format);
+            fclose(out);
+            rename(temporary.c_str(), path.c_str());
+        }
+        guard.lock();
+    }
+}
+
+void Metrics::write(FILE* out, metrics_format output_format)
+{
+    std::vector<Row> rows;
+    double seconds;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        seconds = std::chrono::duration<double>(now - previous_time).count();
+        previous_time = now;
+
+        // the total only covers instances that are still registered, so
+        // removing one never makes a rate go negative
+        Row total;
+        total.name = "total";
+        total.now = Totals();
+        total.before = Totals();
+        rows.push_back(total);
+        for (std::list<Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+        {
+            Row row;
+            row.name = it->counters.name;
+            row.now = read_totals(it->counters);
+            row.before = it->previous;
+            it->previous = row.now;
+            for (int i = 0; i < COUNTERS; i++)
+            {
+                rows[0].now.value[i] += row.now.value[i];
+                rows[0].before.value[i] += row.before.value[i];
+            }
+            rows.push_back(row);
+        }
+    }
+    if (seconds <= 0)
+        seconds = 1e-9;
+
+    if (output_format == METRICS_PROMETHEUS)
+        write_prometheus(out, rows, seconds);
+    else
+        write_json(out, rows, seconds);
+}
+
+void Metrics::write_json(FILE* out, const std::vector<Row>& rows, double seconds)
+{
+    fprintf(out, "{\"interval_seconds\": %.3f, \"instances\": [\n", seconds);
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+        const uint64_t* now = rows[i].now.value;
+        const uint64_t* before = rows[i].before.value;
+        fprintf(out, "  {\"name\": \"%s\", \"frames\": %llu, \"instructions\": %llu, "
+                "\"cycles\": %llu, \"halted_cycles\": %llu, \"dropped_frames\": %llu, "
+                "\"audio_underruns\": %llu, \"audio_overruns\": %llu, \"frames_per_second\": %.2f, "
+                "\"instructions_per_second\": %.0f, \"speed\": %.3f}%s\n",
+                rows[i].name.c_str(), (unsigned long long)now[FRAMES],
+                (unsigned long long)now[INSTRUCTIONS], (unsigned long long)now[CYCLES],
+                (unsigned long long)now[HALTED_CYCLES], (unsigned long long)now[DROPPED_FRAMES],
+                (unsigned long long)now[AUDIO_UNDERRUNS], (unsigned long long)now[AUDIO_OVERRUNS],
+                (now[FRAMES] - before[FRAMES]) / seconds,
+                (now[INSTRUCTIONS] - before[INSTRUCTIONS]) / seconds,
+                (now[CYCLES] - before[CYCLES]) / seconds / METRICS_CLOCKSPEED,
+                (i + 1 < rows.size()) ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+void Metrics::write_prometheus(FILE* out, const std::vector<Row>& rows, double seconds)
+{
+    static const char* counters[COUNTERS][2] = {
+        {"gb_frames_total", "Emulated frames"},
+        {"gb_instructions_total", "Instructions executed"},
+        {"gb_cycles_total", "Emulated clock cycles"},
+        {"gb_halted_cycles_total", "Cycles spent in HALT"},
+        {"gb_dropped_frames_total", "Frames the frontend didn't present"},
+        {"gb_audio_underruns_total", "Audio periods padded with silence"},
+        {"gb_audio_overruns_total", "Audio frames dropped with the output queue full"},
+    };
+    for (int metric = 0; metric < COUNTERS; metric++)
+    {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", counters[metric][0], counters[metric][1], counters[metric][0]);
+        for (size_t i = 0; i < rows.size(); i++)
+            fprintf(out, "%s{instance=\"%s\"} %llu\n", counters[metric][0], rows[i].name.c_str(),
+                    (unsigned long long)rows[i].now.value[metric]);
+    }
+
+    static const char* gauges[3][2] = {
+        {"gb_frames_per_second", "Emulated frames per second"},
+        {"gb_instructions_per_second", "Instructions per second"},
+        {"gb_speed_ratio", "Emulation speed relative to a real Game Boy"},
+    };
+    for (int metric = 0; metric < 3; metric++)
+    {
+        fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n", gauges[metric][0], gauges[metric][1], gauges[metric][0]);
+        for (size_t i = 0; i < rows.size(); i++)
+        {
+            const uint64_t* now = rows[i].now.value;
+            const uint64_t* before = rows[i].before.value;
+            double value;
+            if (metric == 0)
+                value = (now[FRAMES] - before[FRAMES]) / seconds;
+            else if (metric == 1)
+                value = (now[INSTRUCTIONS] - before[INSTRUCTIONS]) / seconds;
+            else
+                value = (now[CYCLES] - before[CYCLES]) / seconds / METRICS_CLOCKSPEED;
+            fprintf(out, "%s{instance=\"%s\"} %.3f\n", gauges[metric][0], rows[i].name.c_str(), value);
+        }
+    }
+}
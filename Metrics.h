@@ -0,0 +1,95 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+// Counters for one instance. The emulation thread adds to them once a
+// frame (GB::set_counters), AudioOutput and frontends add underruns,
+// overruns and dropped frames from their own threads; all with relaxed
+// atomics since
+// the exporter only needs each value to be eventually right.
+struct InstanceCounters
+{
+    InstanceCounters(const std::string& name);
+
+    std::string name;
+    alignas(64) std::atomic<uint64_t> frames;
+    std::atomic<uint64_t> instructions;
+    std::atomic<uint64_t> cycles;
+    std::atomic<uint64_t> halted_cycles;
+    // frames the frontend didn't get to present
+    std::atomic<uint64_t> dropped_frames;
+    std::atomic<uint64_t> audio_underruns;
+    // frames of sound that arrived with the output queue full
+    std::atomic<uint64_t> audio_overruns;
+};
+
+enum metrics_format {METRICS_JSON=0, METRICS_PROMETHEUS=1};
+
+// Registry of InstanceCounters plus a low priority thread that writes
+// them out every interval, as JSON or Prometheus text. Rates (frames
+// and instructions per second, speed against a real Game Boy) come from
+// the difference to the previous dump. The file is written to a
+// temporary name and renamed, so readers never see half of it.
+class Metrics
+{
+public:
+    Metrics();
+    ~Metrics();
+
+    InstanceCounters* add_instance(const std::string& name);
+    void remove_instance(InstanceCounters* counters);
+
+    void start(const std::string& path, metrics_format format, int interval_ms = 1000);
+    void stop();
+    // one dump now, rates against the previous one
+    void write(FILE* out, metrics_format format);
+
+private:
+    // the InstanceCounters fields in declaration order
+    enum { FRAMES, INSTRUCTIONS, CYCLES, HALTED_CYCLES, DROPPED_FRAMES, AUDIO_UNDERRUNS, AUDIO_OVERRUNS, COUNTERS };
+    struct Totals
+    {
+        uint64_t value[COUNTERS];
+    };
+    struct Entry
+    {
+        Entry(const std::string& name) : counters(name), previous() {}
+        InstanceCounters counters;
+        Totals previous;
+    };
+    // one instance (or the total) in a dump
+    struct Row
+    {
+        std::string name;
+        Totals now;
+        Totals before;
+    };
+
+    void export_loop();
+    static Totals read_totals(const InstanceCounters& counters);
+    static void write_json(FILE* out, const std::vector<Row>& rows, double seconds);
+    static void write_prometheus(FILE* out, const std::vector<Row>& rows, double seconds);
+
+    std::mutex lock;
+    std::list<Entry> entries;
+    std::chrono::steady_clock::time_point previous_time;
+
+    std::string path;
+    metrics_format format;
+    int interval_ms;
+    std::thread exporter;
+    std::condition_variable wakeup;
+    bool running;
+};
+
+#endif
@@ -0,0 +1,159 @@
+#include <chrono>
+#include "Movie.h"
+
+#define MOVIE_VERSION 1
+
+Movie::Movie() : checkpoint_interval(60), start_hash(0)
+{
+}
+
+static void write_u32(FILE* file, uint32_t value)
+{
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+static bool read_u32(FILE* file, uint32_t& value)
+{
+    return fread(&value, sizeof(value), 1, file) == 1;
+}
+
+bool Movie::save(const std::string& path) const
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+
+    fwrite("GBMV", 1, 4, file);
+    write_u32(file, MOVIE_VERSION);
+    write_u32(file, inputs.size());
+    write_u32(file, checkpoint_interval);
+    fwrite(&start_hash, sizeof(start_hash), 1, file);
+    write_u32(file, savestate.size());
+    if (!savestate.empty())
+        fwrite(&savestate[0], 1, savestate.size(), file);
+    if (!inputs.empty())
+        fwrite(&inputs[0], 1, inputs.size(), file);
+    if (!checkpoints.empty())
+        fwrite(&checkpoints[0], sizeof(uint64_t), checkpoints.size(), file);
+
+    bool ok = (ferror(file) == 0);
+    fclose(file);
+    return ok;
+}
+
+bool Movie::load(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+
+    char magic[4];
+    uint32_t version = 0, frames = 0, interval = 0, savestate_size = 0;
+    bool ok = (fread(magic, 1, 4, file) == 4) && (memcmp(magic, "GBMV", 4) == 0)
+        && read_u32(file, version) && (version == MOVIE_VERSION)
+        && read_u32(file, frames) && read_u32(file, interval) && (interval > 0)
+        && (fread(&start_hash, sizeof(start_hash), 1, file) == 1)
+        && read_u32(file, savestate_size);
+
+    if (ok)
+    {
+        checkpoint_interval = interval;
+        savestate.resize(savestate_size);
+        inputs.resize(frames);
+        checkpoints.resize(frames / interval);
+        if (savestate_size)
+            ok = ok && (fread(&savestate[0], 1, savestate_size, file) == savestate_size);
+        if (frames)
+            ok = ok && (fread(&inputs[0], 1, frames, file) == frames);
+        if (!checkpoints.empty())
+            ok = ok && (fread(&checkpoints[0], sizeof(uint64_t), checkpoints.size(), file) == checkpoints.size());
+    }
+    fclose(file);
+    return ok;
+}
+
+// Recording starts from wherever the GB is now. From power-on only the
+// hash is kept; otherwise the full state goes into the movie.
+MovieRecorder::MovieRecorder(GB& gb, int checkpoint_interval, bool from_savestate) : gb(gb)
+{
+    movie.checkpoint_interval = checkpoint_interval;
+    if (from_savestate)
+        gb.save_state(movie.savestate);
+    movie.start_hash = gb.state_hash();
+}
+
+void MovieRecorder::run_frame(BYTE buttons)
+{
+    gb.set_joypad(buttons);
+    gb.update();
+    movie.inputs.push_back(buttons);
+    if ((movie.inputs.size() % movie.checkpoint_interval) == 0)
+        movie.checkpoints.push_back(gb.state_hash());
+}
+
+const Movie& MovieRecorder::get_movie() const
+{
+    return movie;
+}
+
+// The GB passed in should be freshly powered on with the same ROM when
+// the movie has no save state.
+ReplayResult replay_movie(GB& gb, const Movie& movie)
+{
+    ReplayResult result;
+    result.frames = 0;
+    result.first_divergent_frame = -1;
+    result.bad_savestate = false;
+    result.seconds = 0;
+    result.frames_per_second = 0;
+
+    if (!movie.savestate.empty() && !gb.load_state(movie.savestate))
+    {
+        result.bad_savestate = true;
+        return result;
+    }
+    if (gb.state_hash() != movie.start_hash)
+        result.first_divergent_frame = 0;
+
+    // nobody sees or hears a replay, the channels still run either way
+    gb.set_rendering(false);
+    gb.set_audio_enabled(false);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    int interval = movie.checkpoint_interval;
+    for (size_t frame = 0; (frame < movie.inputs.size()) && (result.first_divergent_frame < 0); frame++)
+    {
+        gb.set_joypad(movie.inputs[frame]);
+        gb.update();
+        result.frames++;
+
+        if ((result.frames % interval) == 0)
+        {
+            if (gb.state_hash() != movie.checkpoints[result.frames / interval - 1])
+                result.first_divergent_frame = result.frames;
+        }
+    }
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.frames_per_second = (result.seconds > 0) ? result.frames / result.seconds : 0;
+    gb.set_rendering(true);
+    gb.set_audio_enabled(true);
+    return result;
+}
+
+// A divergence is only caught at a checkpoint, so the first bad frame
+// lies somewhere in the interval before the one reported
+void print_replay_result(const ReplayResult& result)
+{
+    if (result.bad_savestate)
+    {
+        std::cout << "Movie's save state doesn't load (truncated or from another version)\n";
+        return;
+    }
+    std::cout << "Replayed " << result.frames << " frames in " << result.seconds << " s ("
+              << result.frames_per_second << " frames/sec)\n";
+    if (result.first_divergent_frame < 0)
+        std::cout << "All checkpoints matched\n";
+    else
+        std::cout << "Diverged at checkpoint frame " << result.first_divergent_frame << "\n";
+}
@@ -0,0 +1,62 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <string>
+#include <vector>
+#include "GB.h"
+
+// Input movie: one joypad byte per frame (see joypad_key), recorded from
+// either power-on or an embedded save state. Every checkpoint_interval
+// frames the state hash is stored, so a replay can tell exactly which
+// frame first went off the rails.
+//
+// File layout, native byte order:
+//   "GBMV", version, frame count, checkpoint interval,
+//   start hash (u64), save state size, save state bytes,
+//   one input byte per frame, one u64 hash per checkpoint
+class Movie
+{
+public:
+    Movie();
+
+    bool save(const std::string& path) const;
+    bool load(const std::string& path);
+
+    int checkpoint_interval;
+    uint64_t start_hash;
+    std::vector<BYTE> savestate;    // empty = starts at power-on
+    std::vector<BYTE> inputs;
+    std::vector<uint64_t> checkpoints;
+};
+
+// Runs frames on a GB and records the input as it goes
+class MovieRecorder
+{
+public:
+    MovieRecorder(GB& gb, int checkpoint_interval = 60, bool from_savestate = false);
+
+    void run_frame(BYTE buttons);
+    const Movie& get_movie() const;
+
+private:
+    GB& gb;
+    Movie movie;
+};
+
+struct ReplayResult
+{
+    int frames;
+    int first_divergent_frame;  // -1 if every checkpoint matched
+    bool bad_savestate;         // the embedded save state didn't load, nothing replayed
+    double seconds;
+    double frames_per_second;
+};
+
+// Plays a movie back headless (rendering and sound off) as fast as possible,
+// checking the state hash at every checkpoint. Frame 0 is the start
+// state; frame n is the state after n frames of input. A save state
+// that's truncated or from another version stops it before frame 0.
+ReplayResult replay_movie(GB& gb, const Movie& movie);
+void print_replay_result(const ReplayResult& result);
+
+#endif
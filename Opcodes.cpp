@@ -0,0 +1,512 @@
+#include "GB.h"
+
+// The SM83 instruction set. get_opcode() fetches and executes one
+// instruction and returns how many clock cycles it took (4 per machine
+// cycle). Flags live in the low byte of AF (FLAG_MASK_* in GB.h):
+// Bit 7 - Z, Bit 6 - N (last op was a subtraction), Bit 5 - H (carry
+// out of bit 3), Bit 4 - C. The low 4 bits always read 0.
+//
+// Most flag results are overwritten before anything looks at them, so
+// the ALU ops only record what they did (defer_flags) and the flags are
+// worked out when read: conditional jumps test Z and C straight from the
+// record, PUSH AF, DAA and the other ops that need all four resolve it
+// into regAF.low. Build with -DEAGER_FLAGS to resolve every time instead,
+// for comparing the two.
+
+// Registers in the order the opcodes encode them. 6 is (HL).
+#define REG_B 0
+#define REG_C 1
+#define REG_D 2
+#define REG_E 3
+#define REG_H 4
+#define REG_L 5
+#define REG_HL_INDIRECT 6
+#define REG_A 7
+
+int GB::get_opcode()
+{
+    // HALT idles until an interrupt is pending, check_interrupts wakes us
+    if (halted)
+        return 4;
+
+    // EI takes effect after the instruction following it
+    bool enable_interrupts = ime_pending;
+    BYTE opcode = read_memory(program_counter++);
+    int cycles = execute_opcode(opcode);
+    if (enable_interrupts && ime_pending)
+    {
+        master_interrupt = true;
+        ime_pending = false;
+    }
+    return cycles;
+}
+
+BYTE GB::fetch_byte()
+{
+    return read_memory(program_counter++);
+}
+
+WORD GB::fetch_word()
+{
+    WORD low = read_memory(program_counter++);
+    WORD high = read_memory(program_counter++);
+    return (high << 8) | low;
+}
+
+BYTE GB::get_register(int reg) const
+{
+    switch (reg)
+    {
+        case REG_B: return regBC.high;
+        case REG_C: return regBC.low;
+        case REG_D: return regDE.high;
+        case REG_E: return regDE.low;
+        case REG_H: return regHL.high;
+        case REG_L: return regHL.low;
+        case REG_HL_INDIRECT: return read_memory(regHL.reg);
+        default: return regAF.high;
+    }
+}
+
+void GB::set_register(int reg, BYTE value)
+{
+    switch (reg)
+    {
+        case REG_B: regBC.high = value; break;
+        case REG_C: regBC.low = value; break;
+        case REG_D: regDE.high = value; break;
+        case REG_E: regDE.low = value; break;
+        case REG_H: regHL.high = value; break;
+        case REG_L: regHL.low = value; break;
+        case REG_HL_INDIRECT: write_address(regHL.reg, value); break;
+        default: regAF.high = value; break;
+    }
+}
+
+// BC, DE, HL, SP as encoded in bits 4-5 of the 16 bit load/inc/dec/add
+WORD& GB::get_register_pair(int pair)
+{
+    switch (pair)
+    {
+        case 0: return regBC.reg;
+        case 1: return regDE.reg;
+        case 2: return regHL.reg;
+        default: return stack_pointer.reg;
+    }
+}
+
+// Jump conditions NZ, Z, NC, C from bits 3-4
+bool GB::test_condition(int condition) const
+{
+    switch (condition)
+    {
+        case 0: return !zero_flag();
+        case 1: return zero_flag();
+        case 2: return !carry_flag();
+        default: return carry_flag() != 0;
+    }
+}
+
+void GB::set_flags(bool zero, bool subtract, bool half_carry, bool carry)
+{
+    regAF.low = (zero ? FLAG_MASK_Z : 0) | (subtract ? FLAG_MASK_N : 0) |
+                (half_carry ? FLAG_MASK_H : 0) | (carry ? FLAG_MASK_C : 0);
+    flag_op = FLAGS_KNOWN;
+}
+
+BYTE GB::get_flags() const
+{
+    if (flag_op == FLAGS_KNOWN)
+        return regAF.low;
+    BYTE flags = ((flag_result & 0xFF) ? 0 : FLAG_MASK_Z) | ((flag_result >> 4) & FLAG_MASK_C);
+    switch (flag_op)
+    {
+        case FLAGS_ADD: return flags | (((flag_a ^ flag_b ^ flag_result) << 1) & FLAG_MASK_H);
+        case FLAGS_SUB: return flags | FLAG_MASK_N | (((flag_a ^ flag_b ^ flag_result) << 1) & FLAG_MASK_H);
+        case FLAGS_AND: return flags | FLAG_MASK_H;
+        default: return flags;
+    }
+}
+
+void GB::resolve_flags()
+{
+    regAF.low = get_flags();
+    flag_op = FLAGS_KNOWN;
+}
+
+// ALU operations on A, in opcode order (bits 3-5 of 0x80-0xBF / 0xC6-0xFE):
+// ADD, ADC, SUB, SBC, AND, XOR, OR, CP
+void GB::alu_operation(int operation, BYTE value)
+{
+    BYTE a = regAF.high;
+    int carry = 0;
+    int result;
+    switch (operation)
+    {
+        case 1: carry = carry_flag(); // fall through
+        case 0:
+            result = a + value + carry;
+            defer_flags(FLAGS_ADD, a, value, result);
+            regAF.high = result;
+            break;
+        case 3: carry = carry_flag(); // fall through
+        case 2:
+            result = a - value - carry;
+            defer_flags(FLAGS_SUB, a, value, result);
+            regAF.high = result;
+            break;
+        case 4:
+            regAF.high = a & value;
+            defer_flags(FLAGS_AND, 0, 0, regAF.high);
+            break;
+        case 5:
+            regAF.high = a ^ value;
+            defer_flags(FLAGS_LOGIC, 0, 0, regAF.high);
+            break;
+        case 6:
+            regAF.high = a | value;
+            defer_flags(FLAGS_LOGIC, 0, 0, regAF.high);
+            break;
+        default:
+            defer_flags(FLAGS_SUB, a, value, a - value);
+            break;
+    }
+}
+
+// INC and DEC leave C alone, so it goes in bit 8 of the recorded result
+BYTE GB::alu_increment(BYTE value)
+{
+    BYTE result = value + 1;
+    defer_flags(FLAGS_ADD, value, 1, result | (carry_flag() << 8));
+    return result;
+}
+
+BYTE GB::alu_decrement(BYTE value)
+{
+    BYTE result = value - 1;
+    defer_flags(FLAGS_SUB, value, 1, result | (carry_flag() << 8));
+    return result;
+}
+
+void GB::alu_add_hl(WORD value)
+{
+    WORD hl = regHL.reg;
+    int result = hl + value;
+    set_flags(zero_flag(), false, ((hl & 0xFFF) + (value & 0xFFF)) > 0xFFF, result > 0xFFFF);
+    regHL.reg = result;
+}
+
+// SP plus a signed byte, shared by ADD SP,r8 and LD HL,SP+r8. The flags
+// come from the unsigned add of the low byte.
+WORD GB::alu_add_sp(BYTE offset)
+{
+    WORD sp = stack_pointer.reg;
+    set_flags(false, false, ((sp & 0xF) + (offset & 0xF)) > 0xF, ((sp & 0xFF) + offset) > 0xFF);
+    return sp + (SIGNED_BYTE)offset;
+}
+
+// Decimal adjust after a BCD add or subtract, using N and H from the
+// previous operation
+void GB::alu_daa()
+{
+    resolve_flags();
+    int a = regAF.high;
+    bool carry = (regAF.low & FLAG_MASK_C) != 0;
+    bool subtract = (regAF.low & FLAG_MASK_N) != 0;
+    bool half_carry = (regAF.low & FLAG_MASK_H) != 0;
+    if (!subtract)
+    {
+        if (carry || (a > 0x99))
+        {
+            a += 0x60;
+            carry = true;
+        }
+        if (half_carry || ((a & 0x0F) > 0x09))
+            a += 0x06;
+    }
+    else
+    {
+        if (carry)
+            a -= 0x60;
+        if (half_carry)
+            a -= 0x06;
+    }
+    regAF.high = a;
+    set_flags(regAF.high == 0, subtract, false, carry);
+}
+
+// Shifts and rotates in CB opcode order (bits 3-5 of 0x00-0x3F):
+// RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL
+BYTE GB::alu_shift(int operation, BYTE value)
+{
+    int carry_in = carry_flag();
+    bool carry;
+    BYTE result;
+    switch (operation)
+    {
+        case 0: carry = value & 0x80; result = (value << 1) | (value >> 7); break;
+        case 1: carry = value & 0x01; result = (value >> 1) | (value << 7); break;
+        case 2: carry = value & 0x80; result = (value << 1) | carry_in; break;
+        case 3: carry = value & 0x01; result = (value >> 1) | (carry_in << 7); break;
+        case 4: carry = value & 0x80; result = value << 1; break;
+        case 5: carry = value & 0x01; result = (value >> 1) | (value & 0x80); break;
+        case 6: carry = false; result = (value << 4) | (value >> 4); break;
+        default: carry = value & 0x01; result = value >> 1; break;
+    }
+    defer_flags(FLAGS_LOGIC, 0, 0, result | (carry ? 0x100 : 0));
+    return result;
+}
+
+void GB::call(WORD address)
+{
+    push_word_on_stack(program_counter);
+    program_counter = address;
+}
+
+int GB::execute_opcode(BYTE opcode)
+{
+    // LD r,r' block, 0x76 in the middle of it is HALT
+    if ((opcode >= 0x40) && (opcode < 0x80))
+    {
+        if (opcode == 0x76)
+        {
+            // with interrupts off and one already pending HALT falls
+            // straight through
+            if (master_interrupt || !(read_memory(0xFFFF) & read_memory(0xFF0F) & 0x1F))
+                halted = true;
+            return 4;
+        }
+        int destination = (opcode >> 3) & 7;
+        int source = opcode & 7;
+        set_register(destination, get_register(source));
+        return ((destination == REG_HL_INDIRECT) || (source == REG_HL_INDIRECT)) ? 8 : 4;
+    }
+    // ALU A,r block
+    if ((opcode >= 0x80) && (opcode < 0xC0))
+    {
+        int source = opcode & 7;
+        alu_operation((opcode >> 3) & 7, get_register(source));
+        return (source == REG_HL_INDIRECT) ? 8 : 4;
+    }
+
+    int reg = (opcode >> 3) & 7;
+    int pair = (opcode >> 4) & 3;
+    switch (opcode)
+    {
+        case 0x00: return 4; // NOP
+
+        // LD rr,d16
+        case 0x01: case 0x11: case 0x21: case 0x31:
+            get_register_pair(pair) = fetch_word();
+            return 12;
+
+        // LD (rr),A and LD A,(rr), HL+ and HL- for the HL forms
+        case 0x02: write_address(regBC.reg, regAF.high); return 8;
+        case 0x12: write_address(regDE.reg, regAF.high); return 8;
+        case 0x22: write_address(regHL.reg++, regAF.high); return 8;
+        case 0x32: write_address(regHL.reg--, regAF.high); return 8;
+        case 0x0A: regAF.high = read_memory(regBC.reg); return 8;
+        case 0x1A: regAF.high = read_memory(regDE.reg); return 8;
+        case 0x2A: regAF.high = read_memory(regHL.reg++); return 8;
+        case 0x3A: regAF.high = read_memory(regHL.reg--); return 8;
+
+        // INC rr / DEC rr, no flags
+        case 0x03: case 0x13: case 0x23: case 0x33:
+            get_register_pair(pair)++;
+            return 8;
+        case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+            get_register_pair(pair)--;
+            return 8;
+
+        // INC r / DEC r / LD r,d8
+        case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x34: case 0x3C:
+            set_register(reg, alu_increment(get_register(reg)));
+            return (reg == REG_HL_INDIRECT) ? 12 : 4;
+        case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x35: case 0x3D:
+            set_register(reg, alu_decrement(get_register(reg)));
+            return (reg == REG_HL_INDIRECT) ? 12 : 4;
+        case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x36: case 0x3E:
+            set_register(reg, fetch_byte());
+            return (reg == REG_HL_INDIRECT) ? 12 : 8;
+
+        // rotates on A always clear Z, unlike the CB versions
+        case 0x07: case 0x0F: case 0x17: case 0x1F:
+            regAF.high = alu_shift(reg, regAF.high);
+            set_flags(false, false, false, carry_flag());
+            return 4;
+
+        case 0x08:
+        {
+            WORD address = fetch_word();
+            write_address(address, stack_pointer.low);
+            write_address(address + 1, stack_pointer.high);
+            return 20;
+        }
+
+        case 0x09: case 0x19: case 0x29: case 0x39:
+            alu_add_hl(get_register_pair(pair));
+            return 8;
+
+        case 0x10: // STOP, treated as a 2 byte NOP
+            program_counter++;
+            return 4;
+
+        // JR r8 / JR cc,r8
+        case 0x18:
+        {
+            SIGNED_BYTE offset = fetch_byte();
+            program_counter += offset;
+            return 12;
+        }
+        case 0x20: case 0x28: case 0x30: case 0x38:
+        {
+            SIGNED_BYTE offset = fetch_byte();
+            if (!test_condition(reg & 3))
+                return 8;
+            program_counter += offset;
+            return 12;
+        }
+
+        case 0x27: alu_daa(); return 4;
+        case 0x2F: // CPL
+            regAF.high = ~regAF.high;
+            resolve_flags();
+            regAF.low |= FLAG_MASK_N | FLAG_MASK_H;
+            return 4;
+        case 0x37: // SCF
+            set_flags(zero_flag(), false, false, true);
+            return 4;
+        case 0x3F: // CCF
+            set_flags(zero_flag(), false, false, !carry_flag());
+            return 4;
+
+        // RET cc / RET / RETI
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+            if (!test_condition(reg & 3))
+                return 8;
+            program_counter = pop_word_off_stack();
+            return 20;
+        case 0xC9:
+            program_counter = pop_word_off_stack();
+            return 16;
+        case 0xD9:
+            program_counter = pop_word_off_stack();
+            master_interrupt = true;
+            return 16;
+
+        // POP / PUSH, pair 3 is AF here instead of SP
+        case 0xC1: case 0xD1: case 0xE1:
+            get_register_pair(pair) = pop_word_off_stack();
+            return 12;
+        case 0xF1:
+            regAF.reg = pop_word_off_stack() & 0xFFF0;
+            flag_op = FLAGS_KNOWN;
+            return 12;
+        case 0xC5: case 0xD5: case 0xE5:
+            push_word_on_stack(get_register_pair(pair));
+            return 16;
+        case 0xF5:
+            resolve_flags();
+            push_word_on_stack(regAF.reg);
+            return 16;
+
+        // JP cc / JP / JP (HL)
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+        {
+            WORD address = fetch_word();
+            if (!test_condition(reg & 3))
+                return 12;
+            program_counter = address;
+            return 16;
+        }
+        case 0xC3:
+            program_counter = fetch_word();
+            return 16;
+        case 0xE9:
+            program_counter = regHL.reg;
+            return 4;
+
+        // CALL cc / CALL
+        case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+        {
+            WORD address = fetch_word();
+            if (!test_condition(reg & 3))
+                return 12;
+            call(address);
+            return 24;
+        }
+        case 0xCD:
+            call(fetch_word());
+            return 24;
+
+        // ALU A,d8
+        case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+            alu_operation(reg, fetch_byte());
+            return 8;
+
+        // RST
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+            call(opcode & 0x38);
+            return 16;
+
+        case 0xCB:
+            return execute_extended_opcode(fetch_byte());
+
+        // high page loads
+        case 0xE0: write_address(0xFF00 + fetch_byte(), regAF.high); return 12;
+        case 0xF0: regAF.high = read_memory(0xFF00 + fetch_byte()); return 12;
+        case 0xE2: write_address(0xFF00 + regBC.low, regAF.high); return 8;
+        case 0xF2: regAF.high = read_memory(0xFF00 + regBC.low); return 8;
+        case 0xEA: write_address(fetch_word(), regAF.high); return 16;
+        case 0xFA: regAF.high = read_memory(fetch_word()); return 16;
+
+        case 0xE8:
+            stack_pointer.reg = alu_add_sp(fetch_byte());
+            return 16;
+        case 0xF8:
+            regHL.reg = alu_add_sp(fetch_byte());
+            return 12;
+        case 0xF9:
+            stack_pointer.reg = regHL.reg;
+            return 8;
+
+        case 0xF3: // DI
+            master_interrupt = false;
+            ime_pending = false;
+            return 4;
+        case 0xFB: // EI
+            ime_pending = true;
+            return 4;
+
+        // the remaining opcodes don't exist, real hardware locks up
+        default:
+            return 4;
+    }
+}
+
+// 0xCB prefixed: shifts/rotates, BIT, RES, SET. The register is always
+// bits 0-2 and the bit number bits 3-5.
+int GB::execute_extended_opcode(BYTE opcode)
+{
+    int reg = opcode & 7;
+    int bit = (opcode >> 3) & 7;
+    bool indirect = (reg == REG_HL_INDIRECT);
+    BYTE value = get_register(reg);
+
+    switch (opcode >> 6)
+    {
+        case 0:
+            set_register(reg, alu_shift(bit, value));
+            break;
+        case 1: // BIT leaves C alone and doesn't write back
+            defer_flags(FLAGS_AND, 0, 0, (value & (1 << bit)) | (carry_flag() << 8));
+            return indirect ? 12 : 8;
+        case 2:
+            set_register(reg, value & ~(1 << bit));
+            break;
+        default:
+            set_register(reg, value | (1 << bit));
+            break;
+    }
+    return indirect ? 16 : 8;
+}
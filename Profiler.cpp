@@ -0,0 +1,114 @@
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "Profiler.h"
+
+static const char* subsystem_names[PROFILE_SUBSYSTEMS] = {
+    "cpu", "timers", "ppu", "interrupts", "other"
+};
+
+Profiler::Profiler()
+{
+    reset();
+}
+
+void Profiler::reset()
+{
+    memset(opcode_counts, 0, sizeof(opcode_counts));
+    memset(opcode_cycles, 0, sizeof(opcode_cycles));
+    total_cycles = 0;
+    halted_cycles = 0;
+    frames = 0;
+    pc_samples.clear();
+    sample_count = 0;
+    sample_countdown = PROFILE_SAMPLE_CYCLES;
+    memset(subsystem_ticks, 0, sizeof(subsystem_ticks));
+    last_timestamp = timestamp();
+    current_subsystem = PROFILE_OTHER;
+}
+
+static void print_opcode(FILE* out, int index)
+{
+    if (index & 0x100)
+        fprintf(out, "CB %02X", index & 0xFF);
+    else
+        fprintf(out, "%02X   ", index);
+}
+
+static void print_location(FILE* out, uint32_t key)
+{
+    WORD bank = key >> 16;
+    if (bank == PROFILE_RAM_BANK)
+        fprintf(out, "ram:%04X", key & 0xFFFF);
+    else
+        fprintf(out, "%03X:%04X", bank, key & 0xFFFF);
+}
+
+void Profiler::print_report(FILE* out, int top) const
+{
+    uint64_t instructions = 0;
+    for (int i = 0; i < 0x200; i++)
+        instructions += opcode_counts[i];
+
+    fprintf(out, "Profile: %ld frames, %llu instructions, %llu cycles (%.1f%% halted)\n",
+            frames, (unsigned long long)instructions, (unsigned long long)total_cycles,
+            total_cycles ? 100.0 * halted_cycles / total_cycles : 0.0);
+
+    uint64_t ticks = 0;
+    for (int i = 0; i < PROFILE_SUBSYSTEMS; i++)
+        ticks += subsystem_ticks[i];
+    fprintf(out, "\nTime by subsystem\n");
+    for (int i = 0; i < PROFILE_SUBSYSTEMS; i++)
+        fprintf(out, "  %-12s %5.1f%%\n", subsystem_names[i], ticks ? 100.0 * subsystem_ticks[i] / ticks : 0.0);
+
+    std::vector<int> order;
+    for (int i = 0; i < 0x200; i++)
+    {
+        if (opcode_counts[i])
+            order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [this](int a, int b)
+    {
+        return opcode_cycles[a] > opcode_cycles[b];
+    });
+    fprintf(out, "\nTop opcodes by cycles\n  opcode        count        cycles   share\n");
+    for (int i = 0; (i < (int)order.size()) && (i < top); i++)
+    {
+        fprintf(out, "  ");
+        print_opcode(out, order[i]);
+        fprintf(out, " %12llu  %12llu  %5.1f%%\n", (unsigned long long)opcode_counts[order[i]],
+                (unsigned long long)opcode_cycles[order[i]],
+                total_cycles ? 100.0 * opcode_cycles[order[i]] / total_cycles : 0.0);
+    }
+
+    std::vector<std::pair<uint32_t, uint64_t> > locations(pc_samples.begin(), pc_samples.end());
+    std::sort(locations.begin(), locations.end(),
+              [](const std::pair<uint32_t, uint64_t>& a, const std::pair<uint32_t, uint64_t>& b)
+    {
+        return a.second > b.second;
+    });
+    fprintf(out, "\nHot spots (bank:PC, one sample per %d cycles)\n", PROFILE_SAMPLE_CYCLES);
+    for (int i = 0; (i < (int)locations.size()) && (i < top); i++)
+    {
+        fprintf(out, "  ");
+        print_location(out, locations[i].first);
+        fprintf(out, " %10llu  %5.1f%%\n", (unsigned long long)locations[i].second,
+                sample_count ? 100.0 * locations[i].second / sample_count : 0.0);
+    }
+}
+
+// Stacks are cpu;bank;PC, so flamegraphs group by bank first. Each
+// sample stands for PROFILE_SAMPLE_CYCLES emulated cycles.
+void Profiler::write_folded(FILE* out) const
+{
+    for (std::unordered_map<uint32_t, uint64_t>::const_iterator it = pc_samples.begin();
+         it != pc_samples.end(); ++it)
+    {
+        WORD bank = it->first >> 16;
+        if (bank == PROFILE_RAM_BANK)
+            fprintf(out, "cpu;ram;%04X %llu\n", it->first & 0xFFFF, (unsigned long long)it->second);
+        else
+            fprintf(out, "cpu;bank_%03X;%04X %llu\n", bank, it->first & 0xFFFF,
+                    (unsigned long long)it->second);
+    }
+}
@@ -0,0 +1,140 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+#include <unordered_map>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+typedef unsigned char BYTE;
+typedef unsigned short WORD;
+
+// Where GB::run_frame spends its time
+enum profile_subsystem {PROFILE_CPU=0, PROFILE_TIMERS=1, PROFILE_PPU=2,
+                        PROFILE_INTERRUPTS=3, PROFILE_OTHER=4, PROFILE_SUBSYSTEMS=5};
+
+// Take a (bank, PC) sample every this many emulated cycles
+#define PROFILE_SAMPLE_CYCLES 256
+
+// Bank reported for code running from RAM
+#define PROFILE_RAM_BANK 0xFFFF
+
+// CPU state after an instruction, for the registers() hook. cycle is
+// when the instruction started, pc the next one.
+struct CpuSnapshot
+{
+    uint64_t cycle;
+    WORD af;
+    WORD bc;
+    WORD de;
+    WORD hl;
+    WORD sp;
+    WORD pc;
+};
+
+// Profiling policies for GB::run_frame<Policy>(). The emulator calls
+// the hooks below at fixed points in the instruction loop; with
+// NoProfiler they're all empty and `enabled` is a constant false, so
+// GB::update() compiles to the loop it would be without any of this.
+// stop_before() returning true ends run_frame early, before the
+// instruction at pc (see Debugger).
+struct NoProfiler
+{
+    enum { enabled = 0 };
+
+    void enter(int subsystem) {}
+    void instruction(WORD bank, WORD pc, BYTE opcode, BYTE extended, int cycles) {}
+    void registers(const CpuSnapshot& cpu) {}
+    void halted(int cycles) {}
+    void end_frame() {}
+    bool stop_before(WORD pc) { return false; }
+};
+
+// Counts every instruction, samples the PC and splits time between the
+// subsystems. Opcodes are indexed 0x000-0x0FF, and 0x100-0x1FF for the
+// 0xCB prefixed ones.
+class Profiler
+{
+public:
+    enum { enabled = 1 };
+
+    Profiler();
+    void reset();
+
+    // enter() charges the time since the last call to the subsystem
+    // that was running and switches to the new one
+    void enter(int subsystem)
+    {
+        uint64_t now = timestamp();
+        subsystem_ticks[current_subsystem] += now - last_timestamp;
+        last_timestamp = now;
+        current_subsystem = subsystem;
+    }
+
+    void instruction(WORD bank, WORD pc, BYTE opcode, BYTE extended, int cycles)
+    {
+        int index = (opcode == 0xCB) ? (0x100 | extended) : opcode;
+        opcode_counts[index]++;
+        opcode_cycles[index] += cycles;
+        total_cycles += cycles;
+        sample_countdown -= cycles;
+        if (sample_countdown <= 0)
+        {
+            sample_countdown += PROFILE_SAMPLE_CYCLES;
+            pc_samples[((uint32_t)bank << 16) | pc]++;
+            sample_count++;
+        }
+    }
+
+    void registers(const CpuSnapshot& cpu) {}
+
+    void halted(int cycles)
+    {
+        halted_cycles += cycles;
+        total_cycles += cycles;
+    }
+
+    void end_frame()
+    {
+        frames++;
+    }
+
+    bool stop_before(WORD pc)
+    {
+        return false;
+    }
+
+    void print_report(FILE* out, int top = 20) const;
+    // One line per sampled (bank, PC) in flamegraph.pl's folded format
+    void write_folded(FILE* out) const;
+
+private:
+    static uint64_t timestamp()
+    {
+#ifdef __x86_64__
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    uint64_t opcode_counts[0x200];
+    uint64_t opcode_cycles[0x200];
+    uint64_t total_cycles;
+    uint64_t halted_cycles;
+    long frames;
+
+    std::unordered_map<uint32_t, uint64_t> pc_samples;
+    uint64_t sample_count;
+    int sample_countdown;
+
+    uint64_t subsystem_ticks[PROFILE_SUBSYSTEMS];
+    uint64_t last_timestamp;
+    int current_subsystem;
+};
+
+#endif
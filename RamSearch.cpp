@@ -0,0 +1,314 @@
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "RamSearch.h"
+
+// Bitmap words are 64 offsets, and the snapshots have this much spare
+// after them so a block's 16-bit loads can read one byte past the end
+#define SEARCH_BLOCK 64
+#define SEARCH_PADDING 64
+
+// What a filter keeps, once changed/equal and the rest are folded
+// together: they only differ in what's compared against
+enum search_test {TEST_DIFFERENT=0, TEST_SAME=1, TEST_ABOVE=2, TEST_BELOW=3};
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#if defined(__AVX2__)
+typedef __m256i ScanVector;
+#define SCAN_BYTES 32
+static inline ScanVector scan_load(const BYTE* p) { return _mm256_loadu_si256((const __m256i*)p); }
+static inline ScanVector scan_set8(int value) { return _mm256_set1_epi8((char)value); }
+static inline ScanVector scan_set16(int value) { return _mm256_set1_epi16((short)value); }
+static inline ScanVector scan_and(ScanVector a, ScanVector b) { return _mm256_and_si256(a, b); }
+static inline ScanVector scan_or(ScanVector a, ScanVector b) { return _mm256_or_si256(a, b); }
+static inline ScanVector scan_xor(ScanVector a, ScanVector b) { return _mm256_xor_si256(a, b); }
+static inline ScanVector scan_equal8(ScanVector a, ScanVector b) { return _mm256_cmpeq_epi8(a, b); }
+static inline ScanVector scan_max8(ScanVector a, ScanVector b) { return _mm256_max_epu8(a, b); }
+static inline ScanVector scan_min8(ScanVector a, ScanVector b) { return _mm256_min_epu8(a, b); }
+static inline ScanVector scan_equal16(ScanVector a, ScanVector b) { return _mm256_cmpeq_epi16(a, b); }
+static inline ScanVector scan_signed_greater16(ScanVector a, ScanVector b) { return _mm256_cmpgt_epi16(a, b); }
+static inline uint64_t scan_bits(ScanVector v) { return (uint32_t)_mm256_movemask_epi8(v); }
+#else
+typedef __m128i ScanVector;
+#define SCAN_BYTES 16
+static inline ScanVector scan_load(const BYTE* p) { return _mm_loadu_si128((const __m128i*)p); }
+static inline ScanVector scan_set8(int value) { return _mm_set1_epi8((char)value); }
+static inline ScanVector scan_set16(int value) { return _mm_set1_epi16((short)value); }
+static inline ScanVector scan_and(ScanVector a, ScanVector b) { return _mm_and_si128(a, b); }
+static inline ScanVector scan_or(ScanVector a, ScanVector b) { return _mm_or_si128(a, b); }
+static inline ScanVector scan_xor(ScanVector a, ScanVector b) { return _mm_xor_si128(a, b); }
+static inline ScanVector scan_equal8(ScanVector a, ScanVector b) { return _mm_cmpeq_epi8(a, b); }
+static inline ScanVector scan_max8(ScanVector a, ScanVector b) { return _mm_max_epu8(a, b); }
+static inline ScanVector scan_min8(ScanVector a, ScanVector b) { return _mm_min_epu8(a, b); }
+static inline ScanVector scan_equal16(ScanVector a, ScanVector b) { return _mm_cmpeq_epi16(a, b); }
+static inline ScanVector scan_signed_greater16(ScanVector a, ScanVector b) { return _mm_cmpgt_epi16(a, b); }
+static inline uint64_t scan_bits(ScanVector v) { return (uint32_t)_mm_movemask_epi8(v); }
+#endif
+
+// All ones in each byte where the test holds. Unsigned order comes
+// from max/min: a > b when max(a, b) is a and they differ.
+template <int TEST>
+static inline ScanVector test8(ScanVector now, ScanVector reference)
+{
+    ScanVector same = scan_equal8(now, reference);
+    switch (TEST)
+    {
+        case TEST_DIFFERENT: return scan_xor(same, scan_set8(0xFF));
+        case TEST_SAME: return same;
+        case TEST_ABOVE: return scan_xor(scan_equal8(scan_max8(now, reference), now), same);
+        default: return scan_xor(scan_equal8(scan_min8(now, reference), now), same);
+    }
+}
+
+// The same on 16-bit words. There's no unsigned 16-bit compare before
+// AVX-512, so flip the sign bits and compare signed.
+template <int TEST>
+static inline ScanVector test16(ScanVector now, ScanVector reference)
+{
+    switch (TEST)
+    {
+        case TEST_DIFFERENT: return scan_xor(scan_equal16(now, reference), scan_set8(0xFF));
+        case TEST_SAME: return scan_equal16(now, reference);
+        case TEST_ABOVE:
+            return scan_signed_greater16(scan_xor(now, scan_set16(0x8000)), scan_xor(reference, scan_set16(0x8000)));
+        default:
+            return scan_signed_greater16(scan_xor(reference, scan_set16(0x8000)), scan_xor(now, scan_set16(0x8000)));
+    }
+}
+
+// A bit per offset of the block for which the test holds. before is
+// NULL when comparing with value. 16-bit values start at every offset:
+// the words loaded from the block are the even offsets' values and the
+// words loaded one byte in the odd ones', so taking the low byte of the
+// first result and the high byte of the second puts each offset's
+// answer in its own byte for movemask.
+template <int WIDTH, int TEST>
+static uint64_t test_block(const BYTE* now, const BYTE* before, int value)
+{
+    uint64_t bits = 0;
+    for (int offset = 0; offset < SEARCH_BLOCK; offset += SCAN_BYTES)
+    {
+        ScanVector result;
+        if (WIDTH == 1)
+        {
+            ScanVector reference = before ? scan_load(before + offset) : scan_set8(value);
+            result = test8<TEST>(scan_load(now + offset), reference);
+        }
+        else
+        {
+            ScanVector even_reference = before ? scan_load(before + offset) : scan_set16(value);
+            ScanVector odd_reference = before ? scan_load(before + offset + 1) : scan_set16(value);
+            ScanVector even = test16<TEST>(scan_load(now + offset), even_reference);
+            ScanVector odd = test16<TEST>(scan_load(now + offset + 1), odd_reference);
+            result = scan_or(scan_and(even, scan_set16(0x00FF)), scan_and(odd, scan_set16(0xFF00)));
+        }
+        bits |= scan_bits(result) << offset;
+    }
+    return bits;
+}
+#else
+template <int WIDTH, int TEST>
+static uint64_t test_block(const BYTE* now, const BYTE* before, int value)
+{
+    uint64_t bits = 0;
+    for (int offset = 0; offset < SEARCH_BLOCK; offset++)
+    {
+        int current = now[offset];
+        int reference = before ? before[offset] : value;
+        if (WIDTH == 2)
+        {
+            current |= now[offset + 1] << 8;
+            if (before)
+                reference |= before[offset + 1] << 8;
+        }
+        bool pass;
+        switch (TEST)
+        {
+            case TEST_DIFFERENT: pass = current != reference; break;
+            case TEST_SAME: pass = current == reference; break;
+            case TEST_ABOVE: pass = current > reference; break;
+            default: pass = current < reference; break;
+        }
+        bits |= (uint64_t)pass << offset;
+    }
+    return bits;
+}
+#endif
+
+// Clears the candidates in each block that fail, skipping empty blocks
+template <int WIDTH, int TEST>
+static size_t filter_blocks(uint64_t* candidates, size_t blocks, const BYTE* now, const BYTE* before, int value)
+{
+    size_t count = 0;
+    for (size_t block = 0; block < blocks; block++)
+    {
+        if (!candidates[block])
+            continue;
+        size_t offset = block * SEARCH_BLOCK;
+        candidates[block] &= test_block<WIDTH, TEST>(now + offset, before ? before + offset : NULL, value);
+        count += __builtin_popcountll(candidates[block]);
+    }
+    return count;
+}
+
+template <int WIDTH>
+static size_t filter_width(int test, uint64_t* candidates, size_t blocks, const BYTE* now, const BYTE* before, int value)
+{
+    switch (test)
+    {
+        case TEST_DIFFERENT: return filter_blocks<WIDTH, TEST_DIFFERENT>(candidates, blocks, now, before, value);
+        case TEST_SAME: return filter_blocks<WIDTH, TEST_SAME>(candidates, blocks, now, before, value);
+        case TEST_ABOVE: return filter_blocks<WIDTH, TEST_ABOVE>(candidates, blocks, now, before, value);
+        default: return filter_blocks<WIDTH, TEST_BELOW>(candidates, blocks, now, before, value);
+    }
+}
+
+RamSearch::RamSearch(const std::vector<GB*>& batch, ram_region search_region, int value_width, int thread_count)
+    : instances(batch), region(search_region), width((value_width == 2) ? 2 : 1),
+      threads(std::max(1, thread_count)), size(RAM_SEARCH_WRAM_BYTES)
+{
+    if (region == RAM_CART)
+    {
+        size = RAM_SEARCH_CART_BYTES;
+        for (size_t i = 0; i < instances.size(); i++)
+            size = std::min(size, instances[i]->cart_ram_bytes());
+    }
+    size_t blocks = (size + SEARCH_BLOCK - 1) / SEARCH_BLOCK;
+    lanes.resize(instances.size());
+    for (size_t i = 0; i < lanes.size(); i++)
+    {
+        lanes[i].previous.assign(blocks * SEARCH_BLOCK + SEARCH_PADDING, 0);
+        lanes[i].current.assign(blocks * SEARCH_BLOCK + SEARCH_PADDING, 0);
+        lanes[i].candidates.assign(blocks, 0);
+    }
+    reset();
+}
+
+void RamSearch::reset()
+{
+    // the last 16-bit value would need a byte from past the end
+    size_t usable = (width == 2) ? std::max((size_t)1, size) - 1 : size;
+    for (size_t i = 0; i < lanes.size(); i++)
+    {
+        Lane& lane = lanes[i];
+        for (size_t block = 0; block < lane.candidates.size(); block++)
+        {
+            size_t start = block * SEARCH_BLOCK;
+            if (start + SEARCH_BLOCK <= usable)
+                lane.candidates[block] = ~(uint64_t)0;
+            else if (start < usable)
+                lane.candidates[block] = ((uint64_t)1 << (usable - start)) - 1;
+            else
+                lane.candidates[block] = 0;
+        }
+        lane.count = usable;
+        snapshot(i, lane.previous);
+    }
+}
+
+// The region as the instance has it now, page by page
+void RamSearch::snapshot(size_t instance, std::vector<BYTE>& out) const
+{
+    const GB& gb = *instances[instance];
+    int first_page = (region == RAM_WRAM) ? (0xC000 >> MEM_PAGE_SHIFT) : CART_RAM_PAGE_BASE;
+    for (size_t offset = 0; offset < size; offset += MEM_PAGE_SIZE)
+    {
+        size_t bytes = std::min((size_t)MEM_PAGE_SIZE, size - offset);
+        memcpy(&out[offset], gb.page_data(first_page + offset / MEM_PAGE_SIZE), bytes);
+    }
+}
+
+void RamSearch::filter(ram_compare compare, int value)
+{
+    int workers = (int)std::min((size_t)threads, instances.size());
+    if (workers <= 1)
+    {
+        filter_lanes(0, lanes.size(), compare, value);
+        return;
+    }
+    // this thread takes the first share
+    std::vector<std::thread> pool;
+    size_t share = (lanes.size() + workers - 1) / workers;
+    for (size_t first = share; first < lanes.size(); first += share)
+        pool.push_back(std::thread(&RamSearch::filter_lanes, this, first, std::min(lanes.size(), first + share), compare, value));
+    filter_lanes(0, std::min(lanes.size(), share), compare, value);
+    for (size_t i = 0; i < pool.size(); i++)
+        pool[i].join();
+}
+
+void RamSearch::filter_lanes(size_t first, size_t end, ram_compare compare, int value)
+{
+    for (size_t i = first; i < end; i++)
+    {
+        snapshot(i, lanes[i].current);
+        filter_lane(lanes[i], compare, value);
+    }
+}
+
+void RamSearch::filter_lane(Lane& lane, ram_compare compare, int value)
+{
+    static const int tests[] = {TEST_DIFFERENT, TEST_SAME, TEST_ABOVE, TEST_BELOW,
+                                TEST_SAME, TEST_DIFFERENT, TEST_ABOVE, TEST_BELOW};
+    bool constant = compare >= RAM_EQUAL;
+    const BYTE* before = constant ? NULL : &lane.previous[0];
+    size_t blocks = lane.candidates.size();
+    if (width == 2)
+        lane.count = filter_width<2>(tests[compare], lane.candidates.data(), blocks, &lane.current[0], before, value & 0xFFFF);
+    else
+        lane.count = filter_width<1>(tests[compare], lane.candidates.data(), blocks, &lane.current[0], before, value & 0xFF);
+    lane.previous.swap(lane.current);
+}
+
+size_t RamSearch::instance_count() const
+{
+    return lanes.size();
+}
+
+size_t RamSearch::count(size_t instance) const
+{
+    return lanes[instance].count;
+}
+
+static void list_bits(const std::vector<uint64_t>& bits, size_t max, std::vector<uint32_t>& out)
+{
+    for (size_t block = 0; (block < bits.size()) && (out.size() < max); block++)
+    {
+        for (uint64_t word = bits[block]; word && (out.size() < max); word &= word - 1)
+            out.push_back(block * SEARCH_BLOCK + __builtin_ctzll(word));
+    }
+}
+
+std::vector<uint32_t> RamSearch::candidates(size_t instance, size_t max) const
+{
+    std::vector<uint32_t> out;
+    list_bits(lanes[instance].candidates, max, out);
+    return out;
+}
+
+std::vector<uint32_t> RamSearch::common_candidates(size_t max) const
+{
+    std::vector<uint32_t> out;
+    if (lanes.empty())
+        return out;
+    std::vector<uint64_t> common = lanes[0].candidates;
+    for (size_t i = 1; i < lanes.size(); i++)
+    {
+        for (size_t block = 0; block < common.size(); block++)
+            common[block] &= lanes[i].candidates[block];
+    }
+    list_bits(common, max, out);
+    return out;
+}
+
+int RamSearch::value(size_t instance, uint32_t offset) const
+{
+    const std::vector<BYTE>& memory = lanes[instance].previous;
+    if (width == 2)
+        return memory[offset] | (memory[offset + 1] << 8);
+    return memory[offset];
+}
@@ -0,0 +1,73 @@
+#ifndef RAMSEARCH_H
+#define RAMSEARCH_H
+
+#include <stdint.h>
+#include <vector>
+#include "GB.h"
+
+// What a search looks through. Offsets are from the start of the
+// region: WRAM offset o is address 0xC000 + o, cart RAM offset o is
+// 0xA000 + o % 0x2000 in bank o / 0x2000.
+enum ram_region {RAM_WRAM=0, RAM_CART=1};
+#define RAM_SEARCH_WRAM_BYTES 0x2000
+#define RAM_SEARCH_CART_BYTES (CART_RAM_BANKS * 0x2000)
+
+// Filters. The first four compare each value with what it was at the
+// last filter (or reset), the rest with a constant. Comparisons are
+// unsigned.
+enum ram_compare {RAM_CHANGED=0, RAM_UNCHANGED=1, RAM_INCREASED=2, RAM_DECREASED=3,
+                  RAM_EQUAL=4, RAM_NOT_EQUAL=5, RAM_GREATER=6, RAM_LESS=7};
+
+// RAM search over a batch of instances, for finding where a game keeps
+// a variable (score, lives, a position) by watching how it moves. Each
+// instance has its own candidate set, a bitmap with a bit per offset,
+// and its own snapshot of the region from the last filter. A filter
+// copies the region out of each instance, compares it 16 or 32 bytes at
+// a time with SSE2 or AVX2 (64 offsets per bitmap word, skipping words
+// with no candidates left), and clears the bits that fail. Values are 8
+// bits, or 16 bits little endian at every offset; the last offset has no
+// 16-bit value and is never a candidate. With threads above 1 the
+// instances are split between that many threads for each filter, which
+// only pays off for large batches.
+class RamSearch
+{
+public:
+    RamSearch(const std::vector<GB*>& instances, ram_region region, int width, int threads = 1);
+
+    // every offset a candidate again and a fresh snapshot
+    void reset();
+    // value is only used by the constant comparisons
+    void filter(ram_compare compare, int value = 0);
+
+    size_t instance_count() const;
+    size_t count(size_t instance) const;
+    // candidate offsets, in order, at most max of them
+    std::vector<uint32_t> candidates(size_t instance, size_t max = 256) const;
+    // offsets still a candidate in every instance
+    std::vector<uint32_t> common_candidates(size_t max = 256) const;
+    // the value at offset as of the last filter
+    int value(size_t instance, uint32_t offset) const;
+
+private:
+    struct Lane
+    {
+        std::vector<BYTE> previous;
+        std::vector<BYTE> current;
+        std::vector<uint64_t> candidates;
+        size_t count;
+    };
+
+    void snapshot(size_t instance, std::vector<BYTE>& out) const;
+    void filter_lanes(size_t first, size_t end, ram_compare compare, int value);
+    void filter_lane(Lane& lane, ram_compare compare, int value);
+
+    std::vector<GB*> instances;
+    ram_region region;
+    int width;
+    int threads;
+    // bytes searched, the cartridge's RAM size for RAM_CART
+    size_t size;
+    std::vector<Lane> lanes;
+};
+
+#endif
@@ -0,0 +1,805 @@
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <string.h>
+#include <deque>
+#include "Recompiler.h"
+#include "Trace.h"
+
+// A run of this many 0x00 or 0xFF bytes is taken as padding, not code
+#define RECOMPILED_FILLER 16
+
+// Jumps from bank 0 into 0x4000-0x7FFF go to whichever bank is switched
+// in. When the walk can't tell, it tries every bank, on cartridges up to
+// this many banks; past that banked code needs a seed trace.
+#define RECOMPILED_GUESS_BANKS 16
+
+RecompiledCode::RecompiledCode()
+    : handle(NULL), low(0x4000, (RecompiledBlock)NULL), instructions(0)
+{
+}
+
+RecompiledCode::~RecompiledCode()
+{
+    if (handle)
+        dlclose(handle);
+}
+
+bool RecompiledCode::load(const string& path, const std::vector<BYTE>& rom, string& error)
+{
+    // dlopen only looks in the library path for bare file names
+    string file = (path.find('/') == string::npos) ? "./" + path : path;
+    handle = dlopen(file.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+    {
+        error = dlerror();
+        return false;
+    }
+    typedef const RecompiledModule* (*ModuleFunction)();
+    ModuleFunction get_module = (ModuleFunction)dlsym(handle, RECOMPILED_ENTRY_SYMBOL);
+    if (!get_module)
+    {
+        error = "no " RECOMPILED_ENTRY_SYMBOL "()";
+        return false;
+    }
+    const RecompiledModule* module = get_module();
+    if ((module->abi != RECOMPILED_ABI) || (module->gb_size != sizeof(GB)))
+    {
+        error = "built against a different GB.h";
+        return false;
+    }
+    if (module->rom_checksum != rom_checksum(rom))
+    {
+        error = "built from a different ROM";
+        return false;
+    }
+
+    banks.assign(rom.size() / 0x4000, std::vector<RecompiledBlock>());
+    for (size_t i = 0; i < module->entry_count; i++)
+    {
+        const RecompiledEntry& entry = module->entries[i];
+        if (entry.pc < 0x4000)
+            low[entry.pc] = entry.block;
+        else if ((entry.pc < 0x8000) && (entry.bank < banks.size()))
+        {
+            if (banks[entry.bank].empty())
+                banks[entry.bank].assign(0x4000, (RecompiledBlock)NULL);
+            banks[entry.bank][entry.pc - 0x4000] = entry.block;
+        }
+        else
+            continue;
+        instructions++;
+    }
+    return true;
+}
+
+size_t RecompiledCode::instruction_count() const
+{
+    return instructions;
+}
+
+uint64_t rom_checksum(const std::vector<BYTE>& rom)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < rom.size(); i++)
+    {
+        hash ^= rom[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// One instruction of a block, bytes past length are 0
+struct RomInstruction
+{
+    WORD pc;
+    int length;
+    BYTE bytes[3];
+};
+
+// Straight line code from one entry point. bank is 0 below 0x4000.
+struct RomBlock
+{
+    WORD bank;
+    std::vector<RomInstruction> code;
+};
+
+static int instruction_length(BYTE opcode)
+{
+    switch (opcode)
+    {
+        case 0x01: case 0x11: case 0x21: case 0x31: case 0x08: case 0xEA: case 0xFA:
+        case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA:
+        case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC:
+            return 3;
+        case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x36: case 0x3E:
+        case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+        case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+        case 0xE0: case 0xF0: case 0xE8: case 0xF8: case 0xCB:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+// HALT and EI are left to the interpreter, as are the opcodes that
+// don't exist
+static bool recompilable(BYTE opcode)
+{
+    switch (opcode)
+    {
+        case 0x76: case 0xFB:
+        case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4: case 0xEB: case 0xEC: case 0xED:
+        case 0xF4: case 0xFC: case 0xFD:
+            return false;
+        default:
+            return true;
+    }
+}
+
+// Instructions that can't change A, for following LD A,n / LD (2000),A
+// bank switches
+static bool keeps_a(BYTE opcode)
+{
+    if ((opcode >= 0x40) && (opcode < 0x78))
+        return true;
+    switch (opcode)
+    {
+        case 0x00: case 0x02: case 0x12: case 0x22: case 0x32: case 0xE0: case 0xE2: case 0xEA:
+        case 0x01: case 0x11: case 0x21: case 0x31: case 0x03: case 0x13: case 0x23: case 0x33:
+        case 0x0B: case 0x1B: case 0x2B: case 0x3B: case 0xC5: case 0xD5: case 0xE5: case 0xF5:
+        case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x36:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Finds the code reachable from the entry points. Every ROM address
+// belongs to at most one block, so nothing is translated twice: a block
+// stops where it runs into another one, and a jump into the middle of a
+// block enters it there.
+class RomWalker
+{
+public:
+    explicit RomWalker(const std::vector<BYTE>& image)
+        : rom(image), bank_count(image.size() / 0x4000), owner((bank_count + 1) * 0x4000, -1),
+          queued((bank_count + 1) * 0x4000, false)
+    {
+    }
+
+    void add_entry(WORD bank, WORD pc)
+    {
+        if (pc >= 0x8000)
+            return;
+        if (pc < 0x4000)
+            bank = 0;
+        if ((bank >= bank_count) || queued[key(bank, pc)])
+            return;
+        queued[key(bank, pc)] = true;
+        entries.push_back(std::make_pair(bank, pc));
+    }
+
+    void walk()
+    {
+        while (!entries.empty())
+        {
+            std::pair<WORD, WORD> entry = entries.front();
+            entries.pop_front();
+            walk_block(entry.first, entry.second);
+        }
+    }
+
+    std::vector<RomBlock> blocks;
+
+private:
+    size_t key(WORD bank, WORD pc) const
+    {
+        return (pc < 0x4000) ? pc : (size_t)(bank + 1) * 0x4000 + (pc - 0x4000);
+    }
+
+    size_t offset(WORD bank, WORD pc) const
+    {
+        return (pc < 0x4000) ? pc : (size_t)bank * 0x4000 + (pc - 0x4000);
+    }
+
+    bool filler(WORD bank, int pc, int region_end) const
+    {
+        BYTE value = rom[offset(bank, pc)];
+        if (((value != 0x00) && (value != 0xFF)) || (pc + RECOMPILED_FILLER > region_end))
+            return false;
+        for (int i = 1; i < RECOMPILED_FILLER; i++)
+        {
+            if (rom[offset(bank, pc + i)] != value)
+                return false;
+        }
+        return true;
+    }
+
+    // path_bank is the bank the code has switched to, -1 if unknown
+    void add_target(WORD bank, WORD target, int path_bank)
+    {
+        if ((target < 0x4000) || (target >= 0x8000))
+            add_entry(0, target);
+        else if (path_bank >= 0)
+            add_entry(path_bank, target);
+        else if (bank != 0)
+            add_entry(bank, target);
+        else if (bank_count <= RECOMPILED_GUESS_BANKS)
+        {
+            for (WORD guess = 1; guess < bank_count; guess++)
+                add_entry(guess, target);
+        }
+    }
+
+    void walk_block(WORD bank, WORD start)
+    {
+        if (owner[key(bank, start)] >= 0)
+            return;
+        RomBlock block;
+        block.bank = bank;
+        int index = blocks.size();
+        int region_end = (start < 0x4000) ? 0x4000 : 0x8000;
+        int known_a = -1;
+        int path_bank = -1;
+        int pc = start;
+        bool ends = false;
+        while (!ends && (block.code.size() < RECOMPILED_MAX_BLOCK) && (pc < region_end))
+        {
+            if ((owner[key(bank, pc)] >= 0) || filler(bank, pc, region_end))
+            {
+                ends = filler(bank, pc, region_end);
+                break;
+            }
+            BYTE opcode = rom[offset(bank, pc)];
+            int length = instruction_length(opcode);
+            if (pc + length > region_end)
+                break;
+            if (!recompilable(opcode))
+            {
+                // the interpreter runs it, and carries on from here
+                if ((opcode == 0x76) || (opcode == 0xFB))
+                    add_entry(bank, pc + 1);
+                break;
+            }
+            RomInstruction instruction = {(WORD)pc, length, {opcode, 0, 0}};
+            for (int i = 1; i < length; i++)
+                instruction.bytes[i] = rom[offset(bank, pc + i)];
+            owner[key(bank, pc)] = index;
+            block.code.push_back(instruction);
+
+            WORD next = pc + length;
+            WORD immediate = instruction.bytes[1] | (instruction.bytes[2] << 8);
+            WORD relative = next + (SIGNED_BYTE)instruction.bytes[1];
+            if ((opcode == 0xEA) && (immediate >= 0x2000) && (immediate < 0x4000) && (known_a >= 0))
+                path_bank = (known_a & (bank_count - 1)) ? (known_a & (bank_count - 1)) : 1;
+            if (opcode == 0x3E)
+                known_a = instruction.bytes[1];
+            else if (!keeps_a(opcode))
+                known_a = -1;
+
+            switch (opcode)
+            {
+                case 0x18: add_target(bank, relative, path_bank); ends = true; break;
+                case 0x20: case 0x28: case 0x30: case 0x38: add_target(bank, relative, path_bank); break;
+                case 0xC3: add_target(bank, immediate, path_bank); ends = true; break;
+                case 0xC2: case 0xCA: case 0xD2: case 0xDA: add_target(bank, immediate, path_bank); break;
+                case 0xC4: case 0xCC: case 0xD4: case 0xDC: add_target(bank, immediate, path_bank); break;
+                case 0xCD:
+                    add_target(bank, immediate, path_bank);
+                    add_entry(bank, next);
+                    ends = true;
+                    break;
+                case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+                    add_entry(0, opcode & 0x38);
+                    add_entry(bank, next);
+                    ends = true;
+                    break;
+                case 0xC9: case 0xD9: case 0xE9:
+                    ends = true;
+                    break;
+            }
+            pc = next;
+        }
+        if (block.code.empty())
+            return;
+        // fell off the end, what follows gets a block of its own
+        if (!ends && (pc < region_end))
+            add_entry(bank, pc);
+        blocks.push_back(block);
+    }
+
+    const std::vector<BYTE>& rom;
+    WORD bank_count;
+    std::vector<int> owner;
+    std::vector<bool> queued;
+    std::deque<std::pair<WORD, WORD> > entries;
+};
+
+static string format(const char* text, ...)
+{
+    char buffer[512];
+    va_list args;
+    va_start(args, text);
+    vsnprintf(buffer, sizeof(buffer), text, args);
+    va_end(args);
+    return buffer;
+}
+
+// Writes one block as a function. Every instruction gets a label, the
+// switch at the top enters at PC, and jumps that stay inside the block
+// are gotos, so loops don't go back through run_frame.
+class BlockWriter
+{
+public:
+    BlockWriter(const std::vector<BYTE>& image, const RomBlock& rom_block)
+        : rom(image), block(rom_block)
+    {
+        for (size_t i = 0; i < block.code.size(); i++)
+            labels.push_back(block.code[i].pc);
+    }
+
+    string name() const
+    {
+        return format("block_%03X_%04X", block.bank, block.code[0].pc);
+    }
+
+    void write(FILE* out)
+    {
+        body.clear();
+        for (size_t i = 0; i < block.code.size(); i++)
+        {
+            const RomInstruction& instruction = block.code[i];
+            body += format("l_%04X:\n", instruction.pc);
+            instruction_code(instruction);
+        }
+        // fell off the end of the block
+        if (body.compare(body.size() - 20, 20, "\n    return cycles;\n") != 0)
+            body += "    return cycles;\n";
+
+        fprintf(out, "static int %s(GB& gb, int budget, int& count)\n{\n", name().c_str());
+        const char* registers[5] = {"af", "bc", "de", "hl", "sp"};
+        for (int i = 0; i < 5; i++)
+        {
+            if (body.find(string(registers[i]) + ".") != string::npos)
+                fprintf(out, "    Register& %s = R::%s(gb);\n", registers[i], registers[i]);
+        }
+        fprintf(out, "    WORD& pc = R::pc(gb);\n    int cycles = 0;\n    switch (pc)\n    {\n");
+        for (size_t i = 0; i < labels.size(); i++)
+            fprintf(out, "        case 0x%04X: goto l_%04X;\n", labels[i], labels[i]);
+        fprintf(out, "    }\n    return 0;\n%s}\n\n", body.c_str());
+    }
+
+private:
+    static const char* reg8(int reg)
+    {
+        static const char* names[8] = {"bc.high", "bc.low", "de.high", "de.low", "hl.high", "hl.low", "", "af.high"};
+        return names[reg];
+    }
+
+    static const char* pair(int index)
+    {
+        static const char* names[4] = {"bc.reg", "de.reg", "hl.reg", "sp.reg"};
+        return names[index];
+    }
+
+    static string read_reg(int reg)
+    {
+        return (reg == 6) ? "R::read(gb, hl.reg)" : reg8(reg);
+    }
+
+    static string write_reg(int reg, const string& value)
+    {
+        if (reg == 6)
+            return "    R::write(gb, hl.reg, " + value + ");\n";
+        return format("    %s = ", reg8(reg)) + value + ";\n";
+    }
+
+    // A read from a fixed address. The ROM can't change under a module
+    // (it's checked against the checksum), so ROM reads become constants.
+    string read_constant(WORD address) const
+    {
+        if (address < 0x4000)
+            return format("0x%02X", rom[address]);
+        if (address < 0x8000)
+        {
+            size_t offset = (size_t)block.bank * 0x4000 + (address - 0x4000);
+            if ((block.bank != 0) && (offset < rom.size()))
+                return format("0x%02X", rom[offset]);
+            return format("R::read(gb, 0x%04X)", address);
+        }
+        if (((address >= 0xA000) && (address < 0xC000)) || (address == 0xFF00) || (address == 0xFF26))
+            return format("R::read(gb, 0x%04X)", address);
+        return format("R::read_page(gb, 0x%04X)", address);
+    }
+
+    static string alu(int operation, const string& value)
+    {
+        string code = "    {\n        BYTE v = " + value + ";\n";
+        switch (operation)
+        {
+            case 0:
+                code += "        int r = af.high + v;\n"
+                        "        R::defer_flags(gb, FLAGS_ADD, af.high, v, r);\n        af.high = r;\n";
+                break;
+            case 1:
+                code += "        int r = af.high + v + R::carry(gb);\n"
+                        "        R::defer_flags(gb, FLAGS_ADD, af.high, v, r);\n        af.high = r;\n";
+                break;
+            case 2:
+                code += "        int r = af.high - v;\n"
+                        "        R::defer_flags(gb, FLAGS_SUB, af.high, v, r);\n        af.high = r;\n";
+                break;
+            case 3:
+                code += "        int r = af.high - v - R::carry(gb);\n"
+                        "        R::defer_flags(gb, FLAGS_SUB, af.high, v, r);\n        af.high = r;\n";
+                break;
+            case 4:
+                code += "        af.high &= v;\n        R::defer_flags(gb, FLAGS_AND, 0, 0, af.high);\n";
+                break;
+            case 5:
+                code += "        af.high ^= v;\n        R::defer_flags(gb, FLAGS_LOGIC, 0, 0, af.high);\n";
+                break;
+            case 6:
+                code += "        af.high |= v;\n        R::defer_flags(gb, FLAGS_LOGIC, 0, 0, af.high);\n";
+                break;
+            default:
+                code += "        R::defer_flags(gb, FLAGS_SUB, af.high, v, af.high - v);\n";
+                break;
+        }
+        return code + "    }\n";
+    }
+
+    bool own_label(WORD address) const
+    {
+        for (size_t i = 0; i < labels.size(); i++)
+        {
+            if (labels[i] == address)
+                return true;
+        }
+        return false;
+    }
+
+    // The tail of every instruction: PC, then the rest of the machine.
+    // Leaves the block if the frame's done, an interrupt moved PC or (in
+    // banked code, after a write that could have been to the MBC) the
+    // bank has gone.
+    string finish(WORD target, int cycles, bool bank_check, bool jump) const
+    {
+        string code = format("    pc = 0x%04X;\n    if (R::tick(gb, %d, cycles, count, budget) || (pc != 0x%04X)",
+                             target, cycles, target);
+        if (bank_check)
+            code += format(" || (R::rom_bank(gb) != 0x%X)", block.bank);
+        code += ")\n        return cycles;\n";
+        if (jump)
+            code += own_label(target) ? format("    goto l_%04X;\n", target) : "    return cycles;\n";
+        return code;
+    }
+
+    // A conditional jump: taken leaves (or loops) from inside the if,
+    // not taken carries on
+    string branch(int condition, WORD target, int taken_cycles) const
+    {
+        string taken = finish(target, taken_cycles, false, true);
+        string indented;
+        for (size_t start = 0; start < taken.size();)
+        {
+            size_t end = taken.find('\n', start);
+            indented += "    " + taken.substr(start, end - start + 1);
+            start = end + 1;
+        }
+        return format("    if (R::condition(gb, %d))\n    {\n", condition) + indented + "    }\n";
+    }
+
+    void instruction_code(const RomInstruction& instruction)
+    {
+        BYTE opcode = instruction.bytes[0];
+        BYTE n = instruction.bytes[1];
+        WORD nn = instruction.bytes[1] | (instruction.bytes[2] << 8);
+        WORD next = instruction.pc + instruction.length;
+        WORD relative = next + (SIGNED_BYTE)n;
+        int reg = (opcode >> 3) & 7;
+        int index = (opcode >> 4) & 3;
+        // banked code has to notice a write switching its bank out
+        bool banked = block.bank != 0;
+        string& code = body;
+
+        if ((opcode >= 0x40) && (opcode < 0x80))
+        {
+            int source = opcode & 7;
+            code += write_reg(reg, read_reg(source));
+            code += finish(next, ((reg == 6) || (source == 6)) ? 8 : 4, banked && (reg == 6), false);
+            return;
+        }
+        if ((opcode >= 0x80) && (opcode < 0xC0))
+        {
+            int source = opcode & 7;
+            code += alu(reg, read_reg(source));
+            code += finish(next, (source == 6) ? 8 : 4, false, false);
+            return;
+        }
+
+        switch (opcode)
+        {
+            case 0x00: case 0x10:
+                code += finish(next, 4, false, false);
+                break;
+            case 0x01: case 0x11: case 0x21: case 0x31:
+                code += format("    %s = 0x%04X;\n", pair(index), nn);
+                code += finish(next, 12, false, false);
+                break;
+            case 0x02: case 0x12:
+                code += format("    R::write(gb, %s, af.high);\n", pair(index));
+                code += finish(next, 8, banked, false);
+                break;
+            case 0x22: code += "    R::write(gb, hl.reg++, af.high);\n"; code += finish(next, 8, banked, false); break;
+            case 0x32: code += "    R::write(gb, hl.reg--, af.high);\n"; code += finish(next, 8, banked, false); break;
+            case 0x0A: case 0x1A:
+                code += format("    af.high = R::read(gb, %s);\n", pair(index));
+                code += finish(next, 8, false, false);
+                break;
+            case 0x2A: code += "    af.high = R::read(gb, hl.reg++);\n"; code += finish(next, 8, false, false); break;
+            case 0x3A: code += "    af.high = R::read(gb, hl.reg--);\n"; code += finish(next, 8, false, false); break;
+            case 0x03: case 0x13: case 0x23: case 0x33:
+                code += format("    %s++;\n", pair(index));
+                code += finish(next, 8, false, false);
+                break;
+            case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+                code += format("    %s--;\n", pair(index));
+                code += finish(next, 8, false, false);
+                break;
+
+            // INC and DEC keep C in bit 8 of the recorded result
+            case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x34: case 0x3C:
+                code += "    {\n        BYTE v = " + read_reg(reg) + ";\n        BYTE r = v + 1;\n"
+                        "        R::defer_flags(gb, FLAGS_ADD, v, 1, r | (R::carry(gb) << 8));\n    "
+                        + write_reg(reg, "r") + "    }\n";
+                code += finish(next, (reg == 6) ? 12 : 4, banked && (reg == 6), false);
+                break;
+            case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x35: case 0x3D:
+                code += "    {\n        BYTE v = " + read_reg(reg) + ";\n        BYTE r = v - 1;\n"
+                        "        R::defer_flags(gb, FLAGS_SUB, v, 1, r | (R::carry(gb) << 8));\n    "
+                        + write_reg(reg, "r") + "    }\n";
+                code += finish(next, (reg == 6) ? 12 : 4, banked && (reg == 6), false);
+                break;
+            case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x36: case 0x3E:
+                code += write_reg(reg, format("0x%02X", n));
+                code += finish(next, (reg == 6) ? 12 : 8, banked && (reg == 6), false);
+                break;
+
+            case 0x07: case 0x0F: case 0x17: case 0x1F:
+                code += format("    af.high = R::shift(gb, %d, af.high);\n", reg);
+                code += "    R::set_flags(gb, false, false, false, R::carry(gb));\n";
+                code += finish(next, 4, false, false);
+                break;
+            case 0x08:
+                code += format("    R::write(gb, 0x%04X, sp.low);\n    R::write(gb, 0x%04X, sp.high);\n",
+                               nn, (WORD)(nn + 1));
+                code += finish(next, 20, banked && (nn < 0x8000), false);
+                break;
+            case 0x09: case 0x19: case 0x29: case 0x39:
+                code += format("    R::add_hl(gb, %s);\n", pair(index));
+                code += finish(next, 8, false, false);
+                break;
+
+            case 0x18:
+                code += finish(relative, 12, false, true);
+                break;
+            case 0x20: case 0x28: case 0x30: case 0x38:
+                code += branch(reg & 3, relative, 12);
+                code += finish(next, 8, false, false);
+                break;
+
+            case 0x27: code += "    R::daa(gb);\n"; code += finish(next, 4, false, false); break;
+            case 0x2F:
+                code += "    af.high = ~af.high;\n    R::resolve_flags(gb);\n    af.low |= FLAG_MASK_N | FLAG_MASK_H;\n";
+                code += finish(next, 4, false, false);
+                break;
+            case 0x37:
+                code += "    R::set_flags(gb, R::zero(gb), false, false, true);\n";
+                code += finish(next, 4, false, false);
+                break;
+            case 0x3F:
+                code += "    R::set_flags(gb, R::zero(gb), false, false, !R::carry(gb));\n";
+                code += finish(next, 4, false, false);
+                break;
+
+            case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+                code += format("    if (R::condition(gb, %d))\n    {\n        pc = R::pop(gb);\n"
+                               "        R::tick(gb, 20, cycles, count, budget);\n        return cycles;\n    }\n",
+                               reg & 3);
+                code += finish(next, 8, false, false);
+                break;
+            case 0xC9:
+                code += "    pc = R::pop(gb);\n    R::tick(gb, 16, cycles, count, budget);\n    return cycles;\n";
+                break;
+            case 0xD9:
+                code += "    pc = R::pop(gb);\n    R::set_interrupts(gb, true);\n"
+                        "    R::tick(gb, 16, cycles, count, budget);\n    return cycles;\n";
+                break;
+
+            case 0xC1: case 0xD1: case 0xE1:
+                code += format("    %s = R::pop(gb);\n", pair(index));
+                code += finish(next, 12, false, false);
+                break;
+            case 0xF1:
+                code += "    R::pop_af(gb);\n";
+                code += finish(next, 12, false, false);
+                break;
+            case 0xC5: case 0xD5: case 0xE5:
+                code += format("    R::push(gb, %s);\n", pair(index));
+                code += finish(next, 16, banked, false);
+                break;
+            case 0xF5:
+                code += "    R::resolve_flags(gb);\n    R::push(gb, af.reg);\n";
+                code += finish(next, 16, banked, false);
+                break;
+
+            case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+                code += branch(reg & 3, nn, 16);
+                code += finish(next, 12, false, false);
+                break;
+            case 0xC3:
+                code += finish(nn, 16, false, true);
+                break;
+            case 0xE9:
+                code += "    pc = hl.reg;\n    R::tick(gb, 4, cycles, count, budget);\n    return cycles;\n";
+                break;
+
+            // calls leave the block, the return address is an entry
+            case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+                code += format("    if (R::condition(gb, %d))\n    {\n        pc = 0x%04X;\n        R::push(gb, 0x%04X);\n"
+                               "        pc = 0x%04X;\n        R::tick(gb, 24, cycles, count, budget);\n        return cycles;\n    }\n",
+                               reg & 3, next, next, nn);
+                code += finish(next, 12, false, false);
+                break;
+            case 0xCD:
+                code += format("    pc = 0x%04X;\n    R::push(gb, 0x%04X);\n    pc = 0x%04X;\n"
+                               "    R::tick(gb, 24, cycles, count, budget);\n    return cycles;\n", next, next, nn);
+                break;
+            case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+                code += format("    pc = 0x%04X;\n    R::push(gb, 0x%04X);\n    pc = 0x%04X;\n"
+                               "    R::tick(gb, 16, cycles, count, budget);\n    return cycles;\n",
+                               next, next, opcode & 0x38);
+                break;
+
+            case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+                code += alu(reg, format("0x%02X", n));
+                code += finish(next, 8, false, false);
+                break;
+
+            case 0xCB:
+                extended_code(n, next);
+                break;
+
+            case 0xE0:
+                code += format("    R::write(gb, 0x%04X, af.high);\n", 0xFF00 + n);
+                code += finish(next, 12, false, false);
+                break;
+            case 0xF0:
+                code += "    af.high = " + read_constant(0xFF00 + n) + ";\n";
+                code += finish(next, 12, false, false);
+                break;
+            case 0xE2:
+                code += "    R::write(gb, 0xFF00 + bc.low, af.high);\n";
+                code += finish(next, 8, false, false);
+                break;
+            case 0xF2:
+                code += "    af.high = R::read(gb, 0xFF00 + bc.low);\n";
+                code += finish(next, 8, false, false);
+                break;
+            case 0xEA:
+                code += format("    R::write(gb, 0x%04X, af.high);\n", nn);
+                code += finish(next, 16, banked && (nn < 0x8000), false);
+                break;
+            case 0xFA:
+                code += "    af.high = " + read_constant(nn) + ";\n";
+                code += finish(next, 16, false, false);
+                break;
+
+            case 0xE8:
+                code += format("    sp.reg = R::add_sp(gb, 0x%02X);\n", n);
+                code += finish(next, 16, false, false);
+                break;
+            case 0xF8:
+                code += format("    hl.reg = R::add_sp(gb, 0x%02X);\n", n);
+                code += finish(next, 12, false, false);
+                break;
+            case 0xF9:
+                code += "    sp.reg = hl.reg;\n";
+                code += finish(next, 8, false, false);
+                break;
+            case 0xF3:
+                code += "    R::set_interrupts(gb, false);\n";
+                code += finish(next, 4, false, false);
+                break;
+        }
+    }
+
+    void extended_code(BYTE opcode, WORD next)
+    {
+        int reg = opcode & 7;
+        int bit = (opcode >> 3) & 7;
+        bool indirect = (reg == 6);
+        bool bank_check = indirect && (block.bank != 0);
+        string& code = body;
+        code += "    {\n        BYTE v = " + read_reg(reg) + ";\n";
+        switch (opcode >> 6)
+        {
+            case 0:
+                code += "    " + write_reg(reg, format("R::shift(gb, %d, v)", bit));
+                break;
+            case 1: // BIT keeps C in bit 8 of the recorded result
+                code += format("        R::defer_flags(gb, FLAGS_AND, 0, 0, (v & 0x%02X) | (R::carry(gb) << 8));\n",
+                               1 << bit);
+                code += "    }\n";
+                code += finish(next, indirect ? 12 : 8, false, false);
+                return;
+            case 2:
+                code += "    " + write_reg(reg, format("v & 0x%02X", (BYTE)~(1 << bit)));
+                break;
+            default:
+                code += "    " + write_reg(reg, format("v | 0x%02X", 1 << bit));
+                break;
+        }
+        code += "    }\n";
+        code += finish(next, indirect ? 16 : 8, bank_check, false);
+    }
+
+    const std::vector<BYTE>& rom;
+    const RomBlock& block;
+    std::vector<WORD> labels;
+    string body;
+};
+
+long recompile_rom(const std::vector<BYTE>& rom, const string& out_path, const string& seed_trace, FILE* log)
+{
+    RomWalker walker(rom);
+    walker.add_entry(0, 0x100);
+    for (WORD vector = 0; vector <= 0x60; vector += 8)
+        walker.add_entry(0, vector);
+
+    if (!seed_trace.empty())
+    {
+        TraceReader reader;
+        if (!reader.open(seed_trace))
+            fprintf(log, "Couldn't open %s, recompiling without it\n", seed_trace.c_str());
+        TraceEvent event;
+        while (reader.next(event))
+        {
+            if (!event.is_write)
+                walker.add_entry(event.fields[TRACE_BANK], event.pc);
+        }
+    }
+    walker.walk();
+
+    FILE* out = fopen(out_path.c_str(), "w");
+    if (!out)
+        return -1;
+    uint64_t checksum = rom_checksum(rom);
+    fprintf(out, "// Generated by gameboy --recompile from a %u KB cartridge, checksum %016llx.\n"
+                 "// Don't edit, regenerate it.\n#include \"Recompiler.h\"\n\ntypedef Recompiled R;\n\n",
+            (unsigned)(rom.size() / 1024), (unsigned long long)checksum);
+    long instructions = 0;
+    for (size_t i = 0; i < walker.blocks.size(); i++)
+    {
+        BlockWriter writer(rom, walker.blocks[i]);
+        writer.write(out);
+        instructions += walker.blocks[i].code.size();
+    }
+
+    fprintf(out, "static const RecompiledEntry entries[] =\n{\n");
+    for (size_t i = 0; i < walker.blocks.size(); i++)
+    {
+        const RomBlock& block = walker.blocks[i];
+        string name = BlockWriter(rom, block).name();
+        for (size_t j = 0; j < block.code.size(); j++)
+            fprintf(out, "    {0x%X, 0x%04X, %s},\n", block.bank, block.code[j].pc, name.c_str());
+    }
+    fprintf(out, "};\n\nstatic const RecompiledModule module =\n{\n"
+                 "    RECOMPILED_ABI, sizeof(GB), 0x%016llxULL, entries, sizeof(entries) / sizeof(entries[0])\n};\n\n"
+                 "extern \"C\" const RecompiledModule* " RECOMPILED_ENTRY_SYMBOL "()\n{\n    return &module;\n}\n",
+            (unsigned long long)checksum);
+    fclose(out);
+    fprintf(log, "Recompiled %zu blocks, %ld instructions\n", walker.blocks.size(), instructions);
+    return instructions;
+}
@@ -0,0 +1,154 @@
+#ifndef RECOMPILER_H
+#define RECOMPILER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "GB.h"
+
+// Bumped whenever generated code's view of GB changes. A module also
+// records sizeof(GB), so one built against a different GB.h won't load.
+#define RECOMPILED_ABI 1
+// Longest run of instructions in one block function
+#define RECOMPILED_MAX_BLOCK 256
+#define RECOMPILED_ENTRY_SYMBOL "gb_recompiled_module"
+
+// A recompiled block of ROM code. It's entered at any instruction it
+// covers (the one at PC) and runs them one at a time, catching the rest
+// of the machine up after each one just like run_frame does, until
+// control leaves the block, an interrupt is taken, the ROM bank it lives
+// in is switched out or budget cycles have gone by. Returns the cycles
+// run and adds the instructions to count.
+typedef int (*RecompiledBlock)(GB& gb, int budget, int& count);
+
+// One per instruction covered. bank is 0 below 0x4000.
+struct RecompiledEntry
+{
+    WORD bank;
+    WORD pc;
+    RecompiledBlock block;
+};
+
+// What a generated module's gb_recompiled_module() returns
+struct RecompiledModule
+{
+    int abi;
+    size_t gb_size;
+    uint64_t rom_checksum;
+    const RecompiledEntry* entries;
+    size_t entry_count;
+};
+
+// A loaded module, shared between clones. Looked up once per block by
+// run_frame; anything it doesn't cover (RAM code, code the walk didn't
+// find, HALT and EI) is left to the interpreter.
+class RecompiledCode
+{
+public:
+    RecompiledCode();
+    ~RecompiledCode();
+
+    // Fails unless the module was generated from this cartridge image
+    bool load(const string& path, const std::vector<BYTE>& rom, string& error);
+    size_t instruction_count() const;
+
+    RecompiledBlock find(WORD pc, WORD bank) const
+    {
+        if (pc < 0x4000)
+            return low[pc];
+        if ((pc < 0x8000) && (bank < banks.size()) && !banks[bank].empty())
+            return banks[bank][pc - 0x4000];
+        return NULL;
+    }
+
+private:
+    RecompiledCode(const RecompiledCode&) = delete;
+    RecompiledCode& operator=(const RecompiledCode&) = delete;
+
+    void* handle;
+    std::vector<RecompiledBlock> low;
+    std::vector<std::vector<RecompiledBlock> > banks;
+    size_t instructions;
+};
+
+// Generated code's way into GB, which has it as a friend. Everything
+// here inlines into the module; what it calls out of line (memory, the
+// less common ALU ops, run_hardware) the module gets from the executable,
+// which has to be linked with -rdynamic.
+struct Recompiled
+{
+    static Register& af(GB& gb) { return gb.regAF; }
+    static Register& bc(GB& gb) { return gb.regBC; }
+    static Register& de(GB& gb) { return gb.regDE; }
+    static Register& hl(GB& gb) { return gb.regHL; }
+    static Register& sp(GB& gb) { return gb.stack_pointer; }
+    static WORD& pc(GB& gb) { return gb.program_counter; }
+
+    static BYTE read(GB& gb, WORD address) { return gb.read_memory(address); }
+    // constant addresses that read_memory takes straight from the page
+    static BYTE read_page(GB& gb, WORD address) { return gb.page_memory[address >> MEM_PAGE_SHIFT][address & 0xFF]; }
+    static void write(GB& gb, WORD address, BYTE data) { gb.write_address(address, data); }
+    static void push(GB& gb, WORD word) { gb.push_word_on_stack(word); }
+    static WORD pop(GB& gb) { return gb.pop_word_off_stack(); }
+    static WORD rom_bank(const GB& gb) { return gb.current_ROM_bank & gb.rom_bank_mask; }
+
+    static void defer_flags(GB& gb, int op, BYTE a, BYTE b, WORD result) { gb.defer_flags(op, a, b, result); }
+    static int carry(const GB& gb) { return gb.carry_flag(); }
+    static bool zero(const GB& gb) { return gb.zero_flag(); }
+    static bool condition(const GB& gb, int condition)
+    {
+        switch (condition)
+        {
+            case 0: return !gb.zero_flag();
+            case 1: return gb.zero_flag();
+            case 2: return !gb.carry_flag();
+            default: return gb.carry_flag() != 0;
+        }
+    }
+    static void set_flags(GB& gb, bool zero, bool subtract, bool half_carry, bool carry)
+    {
+        gb.set_flags(zero, subtract, half_carry, carry);
+    }
+    static void resolve_flags(GB& gb) { gb.resolve_flags(); }
+    static void pop_af(GB& gb)
+    {
+        gb.regAF.reg = gb.pop_word_off_stack() & 0xFFF0;
+        gb.flag_op = FLAGS_KNOWN;
+    }
+    static void add_hl(GB& gb, WORD value) { gb.alu_add_hl(value); }
+    static WORD add_sp(GB& gb, BYTE offset) { return gb.alu_add_sp(offset); }
+    static void daa(GB& gb) { gb.alu_daa(); }
+    static BYTE shift(GB& gb, int operation, BYTE value) { return gb.alu_shift(operation, value); }
+
+    static void set_interrupts(GB& gb, bool enabled)
+    {
+        gb.master_interrupt = enabled;
+        if (!enabled)
+            gb.ime_pending = false;
+    }
+
+    // After every instruction. True when the block has to hand back to
+    // the frame loop because the frame's cycles are used up.
+    static bool tick(GB& gb, int instruction_cycles, int& cycles, int& count, int budget)
+    {
+        count++;
+        cycles += instruction_cycles;
+        gb.run_hardware(instruction_cycles);
+        return cycles >= budget;
+    }
+};
+
+// FNV-1a of the whole cartridge image, as GB holds it
+uint64_t rom_checksum(const std::vector<BYTE>& rom);
+
+// Static recompiler. Walks the cartridge from its entry points (0x100
+// and the RST and interrupt vectors, plus every ROM address in
+// seed_trace if one is given) following jumps and calls across banks,
+// and writes a C++ module with a function per basic block. Build it with
+//   g++ -O2 -std=c++11 -shared -fPIC -I<this directory> out.cpp -o out.so
+// and load it with GB::load_recompiled(). Returns the instructions
+// covered, or -1 if out_path can't be written.
+long recompile_rom(const std::vector<BYTE>& rom, const string& out_path, const string& seed_trace, FILE* log);
+
+#endif
@@ -0,0 +1,297 @@
+#include <chrono>
+#include "Rewind.h"
+
+static const int RAM_PAGES = MEM_PAGE_COUNT - FIRST_RAM_PAGE;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Take the starting point of the history: a full copy of memory and
+// CPU state, which also serves as the first keyframe
+Rewind::Rewind(GB& gb, size_t memory_budget, int keyframe_interval)
+    : gb(gb), memory_budget(memory_budget), keyframe_interval(keyframe_interval),
+      frame_count(0), bytes_used(0), shadow(RAM_PAGES * MEM_PAGE_SIZE),
+      capture_seconds(0), captures(0), rewind_seconds(0), rewind_steps(0)
+{
+    uint64_t dirty[MEM_PAGE_COUNT / 64];
+    gb.take_dirty_pages(dirty);
+
+    for (int page = FIRST_RAM_PAGE; page < MEM_PAGE_COUNT; page++)
+        memcpy(&shadow[(page - FIRST_RAM_PAGE) * MEM_PAGE_SIZE], gb.page_data(page), MEM_PAGE_SIZE);
+    gb.save_cpu_state(shadow_state);
+
+    Keyframe key;
+    key.frame = 0;
+    key.state = shadow_state;
+    key.pages = shadow;
+    bytes_used += key.pages.size();
+    keyframes.push_back(key);
+}
+
+// Record the frame that just ran. Only pages written since the last
+// capture are compared against the shadow copy, and only the ones that
+// really changed end up in the undo record. The I/O page holds LY, DIV
+// and friends that change behind write_address's back, so it's always
+// checked.
+void Rewind::capture()
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    uint64_t dirty[MEM_PAGE_COUNT / 64];
+    gb.take_dirty_pages(dirty);
+    dirty[IO_PAGE >> 6] |= (uint64_t)1 << (IO_PAGE & 63);
+
+    Frame record;
+    record.frame = ++frame_count;
+    record.state = shadow_state;
+
+    for (int word = 0; word < MEM_PAGE_COUNT / 64; word++)
+    {
+        uint64_t bits = dirty[word];
+        while (bits)
+        {
+            int page = (word << 6) + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (page < FIRST_RAM_PAGE)
+                continue;
+
+            BYTE* old_data = &shadow[(page - FIRST_RAM_PAGE) * MEM_PAGE_SIZE];
+            const BYTE* new_data = gb.page_data(page);
+            if (memcmp(old_data, new_data, MEM_PAGE_SIZE) == 0)
+                continue;
+
+            record.page_index.push_back(page);
+            record.page_data.insert(record.page_data.end(), old_data, old_data + MEM_PAGE_SIZE);
+            memcpy(old_data, new_data, MEM_PAGE_SIZE);
+        }
+    }
+    gb.save_cpu_state(shadow_state);
+
+    bytes_used += frame_size(record);
+    frames.push_back(record);
+
+    if (frame_count % keyframe_interval == 0)
+    {
+        Keyframe key;
+        key.frame = frame_count;
+        key.state = shadow_state;
+        key.pages = shadow;
+        bytes_used += key.pages.size();
+        keyframes.push_back(key);
+    }
+
+    evict();
+
+    capture_seconds += seconds_since(start);
+    captures++;
+}
+
+bool Rewind::step_back()
+{
+    return seek_back(1) == 1;
+}
+
+// Go back up to `count` frames, returns how many frames we actually went
+// back. Undo records are applied newest first; if there's a keyframe
+// between the target and now, whichever of the two paths copies fewer
+// pages is taken.
+int Rewind::seek_back(int count)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    discard_uncaptured();
+
+    int target = frame_count - count;
+    if (target < frame_count - frames_available())
+        target = frame_count - frames_available();
+    int stepped = frame_count - target;
+    if (stepped == 0)
+        return 0;
+
+    // Cost of each path in pages copied. Frames and keyframes are both
+    // oldest first, so one walk back from the newest frame sums the
+    // direct path, and a keyframe's path is a full restore plus the
+    // direct cost less the frames after it.
+    size_t direct_cost = 0;
+    for (size_t i = frames.size(); (i > 0) && (frames[i - 1].frame > target); i--)
+        direct_cost += frames[i - 1].page_index.size();
+
+    const Keyframe* best_key = NULL;
+    size_t best_cost = direct_cost;
+    size_t newer_pages = 0;
+    size_t next = frames.size();
+    for (size_t k = keyframes.size(); k > 0; k--)
+    {
+        const Keyframe& key = keyframes[k - 1];
+        if (key.frame < target)
+            break;
+        if (key.frame >= frame_count)
+            continue;
+        while ((next > 0) && (frames[next - 1].frame > key.frame))
+        {
+            next--;
+            newer_pages += frames[next].page_index.size();
+        }
+        size_t cost = RAM_PAGES + direct_cost - newer_pages;
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            best_key = &key;
+        }
+    }
+
+    if (best_key)
+    {
+        restore_keyframe(*best_key);
+        while (frames.back().frame > best_key->frame)
+        {
+            bytes_used -= frame_size(frames.back());
+            frames.pop_back();
+        }
+    }
+
+    while (frame_count > target)
+    {
+        undo(frames.back());
+        bytes_used -= frame_size(frames.back());
+        frames.pop_back();
+    }
+
+    // keyframes past the target describe a future we just threw away
+    while (!keyframes.empty() && (keyframes.back().frame > target))
+    {
+        bytes_used -= keyframes.back().pages.size();
+        keyframes.pop_back();
+    }
+
+    gb.load_cpu_state(shadow_state);
+
+    rewind_seconds += seconds_since(start);
+    rewind_steps += stepped;
+    return stepped;
+}
+
+// Anything written since the last capture gets put back from the shadow
+// copy, so undo records apply to exactly the state they were taken from
+void Rewind::discard_uncaptured()
+{
+    uint64_t dirty[MEM_PAGE_COUNT / 64];
+    gb.take_dirty_pages(dirty);
+    dirty[IO_PAGE >> 6] |= (uint64_t)1 << (IO_PAGE & 63);
+
+    for (int word = 0; word < MEM_PAGE_COUNT / 64; word++)
+    {
+        uint64_t bits = dirty[word];
+        while (bits)
+        {
+            int page = (word << 6) + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (page >= FIRST_RAM_PAGE)
+                gb.load_page(page, &shadow[(page - FIRST_RAM_PAGE) * MEM_PAGE_SIZE]);
+        }
+    }
+    gb.load_cpu_state(shadow_state);
+}
+
+void Rewind::undo(const Frame& record)
+{
+    for (size_t i = 0; i < record.page_index.size(); i++)
+    {
+        int page = record.page_index[i];
+        const BYTE* data = &record.page_data[i * MEM_PAGE_SIZE];
+        gb.load_page(page, data);
+        memcpy(&shadow[(page - FIRST_RAM_PAGE) * MEM_PAGE_SIZE], data, MEM_PAGE_SIZE);
+    }
+    shadow_state = record.state;
+    frame_count = record.frame - 1;
+}
+
+void Rewind::restore_keyframe(const Keyframe& key)
+{
+    shadow = key.pages;
+    for (int page = FIRST_RAM_PAGE; page < MEM_PAGE_COUNT; page++)
+        gb.load_page(page, &shadow[(page - FIRST_RAM_PAGE) * MEM_PAGE_SIZE]);
+    shadow_state = key.state;
+    frame_count = key.frame;
+}
+
+// Drop the oldest history until we're back under budget. Keyframes older
+// than the oldest reachable frame are useless, so they go too. The
+// newest keyframe is always kept as an anchor.
+void Rewind::evict()
+{
+    while ((bytes_used > memory_budget) && !frames.empty())
+    {
+        bytes_used -= frame_size(frames.front());
+        frames.pop_front();
+
+        int oldest = frame_count - frames_available();
+        while ((keyframes.size() > 1) && (keyframes.front().frame < oldest))
+        {
+            bytes_used -= keyframes.front().pages.size();
+            keyframes.pop_front();
+        }
+    }
+}
+
+size_t Rewind::frame_size(const Frame& record)
+{
+    return sizeof(Frame) + record.page_index.size() * sizeof(WORD) + record.page_data.size();
+}
+
+int Rewind::frames_available() const
+{
+    return (int)frames.size();
+}
+
+size_t Rewind::memory_used() const
+{
+    return bytes_used + shadow.size();
+}
+
+double Rewind::history_seconds() const
+{
+    return frames_available() / GB_FRAME_RATE;
+}
+
+double Rewind::bytes_per_second() const
+{
+    if (frames.empty())
+        return 0;
+    size_t delta_bytes = 0;
+    for (size_t i = 0; i < frames.size(); i++)
+        delta_bytes += frame_size(frames[i]);
+    return delta_bytes / history_seconds();
+}
+
+double Rewind::capture_time() const
+{
+    return captures ? capture_seconds / captures : 0;
+}
+
+double Rewind::step_time() const
+{
+    return rewind_steps ? rewind_seconds / rewind_steps : 0;
+}
+
+void Rewind::print_stats() const
+{
+    size_t pages = 0;
+    for (size_t i = 0; i < frames.size(); i++)
+        pages += frames[i].page_index.size();
+
+    std::cout << "Rewind: " << frames_available() << " frames ("
+              << history_seconds() << " s) in " << memory_used() / 1024 << " KB, "
+              << keyframes.size() << " keyframes\n";
+    if (!frames.empty())
+    {
+        std::cout << "  " << bytes_per_second() / 1024 << " KB per second of history, "
+                  << (double)pages / frames_available() << " pages per frame\n";
+    }
+    if (captures > 0)
+        std::cout << "  capture: " << capture_time() * 1e6 << " us per frame\n";
+    if (rewind_steps > 0)
+        std::cout << "  rewind: " << step_time() * 1e6 << " us per frame stepped back\n";
+}
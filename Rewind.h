@@ -0,0 +1,82 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <deque>
+#include <vector>
+#include "GB.h"
+
+// Per-frame rewind history kept within a fixed memory budget.
+//
+// Every capture() stores an undo record: the CPU/IO state and the old
+// contents of each 256 byte page written during the frame. Stepping back
+// applies those records newest first. A full keyframe is also kept every
+// keyframe_interval frames, so a long seek can jump to the keyframe just
+// after the target and only apply the deltas from there backwards.
+//
+// Usage: call capture() once after every GB::update(), and step_back()
+// instead of update() while the player is rewinding.
+class Rewind
+{
+public:
+    Rewind(GB& gb, size_t memory_budget = 32 << 20, int keyframe_interval = 600);
+
+    void capture();
+    bool step_back();
+    int seek_back(int frames);
+
+    int frames_available() const;
+    size_t memory_used() const;
+    // seconds of play the history covers, at GB_FRAME_RATE
+    double history_seconds() const;
+    // undo record bytes per second of history
+    double bytes_per_second() const;
+    // averages so far, in seconds
+    double capture_time() const;
+    double step_time() const;
+    void print_stats() const;
+
+private:
+    // Undoes frame `frame`, taking the machine back to frame - 1
+    struct Frame
+    {
+        int frame;
+        GBState state;
+        std::vector<WORD> page_index;
+        std::vector<BYTE> page_data;
+    };
+
+    // Full copy of every RAM page at frame `frame`
+    struct Keyframe
+    {
+        int frame;
+        GBState state;
+        std::vector<BYTE> pages;
+    };
+
+    void discard_uncaptured();
+    void undo(const Frame& record);
+    void restore_keyframe(const Keyframe& key);
+    void evict();
+    static size_t frame_size(const Frame& record);
+
+    GB& gb;
+    size_t memory_budget;
+    int keyframe_interval;
+
+    int frame_count;
+    std::deque<Frame> frames;
+    std::deque<Keyframe> keyframes;
+    size_t bytes_used;
+
+    // memory and CPU state as of the last capture
+    std::vector<BYTE> shadow;
+    GBState shadow_state;
+
+    // stats
+    double capture_seconds;
+    long captures;
+    double rewind_seconds;
+    long rewind_steps;
+};
+
+#endif
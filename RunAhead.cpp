@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <chrono>
+#include "RunAhead.h"
+
+// one update() of real time, what a presented frame has to fit in
+#define FRAME_BUDGET_SECONDS (1.0 / GB_FRAME_RATE)
+#define FRAME_PERIOD_MS (1000.0 / GB_FRAME_RATE)
+
+RunAhead::RunAhead(GB& gb, int frames)
+    : gb(gb), ahead(NULL), frames(frames), frames_over_budget(0),
+      last_buttons(0), last_screen_hash(0), presented(0), input_frame(-1),
+      responses(0), response_frames(0), frames_ahead_total(0)
+{
+}
+
+RunAhead::~RunAhead()
+{
+    delete ahead;
+}
+
+void RunAhead::set_frames(int count)
+{
+    frames = count;
+}
+
+// Returns the screen to present. It stays valid until the next call.
+const ScreenBuffer& RunAhead::run_frame(BYTE buttons)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    delete ahead;
+    ahead = NULL;
+
+    // An update() is a little short of an LCD frame, so it draws all but
+    // one line and that line is left from the update before. Rendering
+    // the last two updates of the chain (real machine, then clone) fills
+    // the buffer just as a plain run's would be.
+    gb.set_joypad(buttons);
+    gb.set_rendering(frames <= 1);
+    gb.update();
+    gb.set_rendering(true);
+
+    const GB* shown = &gb;
+    if (frames > 0)
+    {
+        ahead = gb.clone();
+        for (int i = 1; i <= frames; i++)
+        {
+            ahead->set_rendering(i >= frames - 1);
+            ahead->update();
+        }
+        shown = ahead;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    frame_seconds.push_back(seconds);
+    if (seconds > FRAME_BUDGET_SECONDS)
+        frames_over_budget++;
+    frames_ahead_total += frames;
+
+    // Track how long the game takes to react on screen. Any screen change
+    // after an input change counts, so animation makes this an upper
+    // bound rather than an exact figure.
+    if (buttons != last_buttons)
+    {
+        input_frame = presented;
+        last_buttons = buttons;
+    }
+    uint64_t hash = shown->screen_hash();
+    if ((input_frame >= 0) && (hash != last_screen_hash))
+    {
+        responses++;
+        response_frames += presented - input_frame;
+        input_frame = -1;
+    }
+    last_screen_hash = hash;
+    presented++;
+
+    return shown->get_screen();
+}
+
+void RunAhead::print_stats() const
+{
+    if (frame_seconds.empty())
+        return;
+
+    std::vector<double> sorted(frame_seconds);
+    std::sort(sorted.begin(), sorted.end());
+    double p50 = sorted[sorted.size() / 2] * 1000;
+    double p99 = sorted[(sorted.size() * 99) / 100] * 1000;
+    double worst = sorted.back() * 1000;
+    double average_ahead = (double)frames_ahead_total / presented;
+
+    std::cout << "Run-ahead " << frames << ": " << presented << " frames, cost p50 " << p50
+              << " ms, p99 " << p99 << " ms, max " << worst << " ms, "
+              << frames_over_budget << " over the " << FRAME_BUDGET_SECONDS * 1000 << " ms budget\n";
+    std::cout << "  latency saved: " << average_ahead << " frames = "
+              << average_ahead * FRAME_PERIOD_MS << " ms per input\n";
+    if (responses > 0)
+    {
+        double response = (double)response_frames / responses;
+        std::cout << "  measured input->screen response: " << response << " presented frames ("
+                  << response + average_ahead << " without run-ahead)\n";
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef RUNAHEAD_H
+#define RUNAHEAD_H
+
+#include <vector>
+#include "GB.h"
+
+// Run-ahead hides a game's built-in input lag. Each presented frame
+// runs the real machine one frame, then clones it, runs the clone
+// `frames` frames further with the same input, shows that and throws the
+// clone away. Only the last two frames of that chain are rendered. The clone
+// is copy-on-write, so the snapshot costs a page table copy and the
+// restore is free.
+class RunAhead
+{
+public:
+    RunAhead(GB& gb, int frames = 2);
+    ~RunAhead();
+
+    const ScreenBuffer& run_frame(BYTE buttons);
+    void set_frames(int frames);
+    void print_stats() const;
+
+private:
+    GB& gb;
+    GB* ahead;
+    int frames;
+
+    // per presented frame wall time, for the budget check
+    std::vector<double> frame_seconds;
+    long frames_over_budget;
+
+    // measured response: presented frames between an input change and
+    // the first change on screen
+    BYTE last_buttons;
+    uint64_t last_screen_hash;
+    long presented;
+    long input_frame;
+    long responses;
+    long response_frames;
+    long frames_ahead_total;
+};
+
+#endif
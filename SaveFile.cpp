@@ -0,0 +1,255 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "SaveFile.h"
+
+// The one background thread that writes back every open SaveFile
+class SaveFlusher
+{
+public:
+    SaveFlusher() : running(false), cursor(0), urgent_count(0) {}
+    ~SaveFlusher();
+
+    void add(SaveFile* file);
+    void remove(SaveFile* file);
+    void wake();
+
+private:
+    void run();
+    size_t flush_pass();
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::thread thread;
+    bool running;
+    std::vector<SaveFile*> files;
+    size_t cursor;
+    std::atomic<int> urgent_count;
+};
+
+static SaveFlusher flusher;
+
+SaveFlusher::~SaveFlusher()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!running)
+            return;
+        running = false;
+    }
+    wakeup.notify_one();
+    thread.join();
+}
+
+void SaveFlusher::add(SaveFile* file)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    files.push_back(file);
+    if (!running)
+    {
+        running = true;
+        thread = std::thread(&SaveFlusher::run, this);
+    }
+}
+
+// Holding the lock also means the thread isn't in the middle of this
+// file's msync when it goes away
+void SaveFlusher::remove(SaveFile* file)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    files.erase(std::remove(files.begin(), files.end(), file), files.end());
+    if (cursor > files.size())
+        cursor = 0;
+}
+
+// Doesn't take the lock, so an emulation thread never waits behind an
+// msync. A wakeup lost to the race just means waiting for the next tick.
+void SaveFlusher::wake()
+{
+    urgent_count.fetch_add(1, std::memory_order_relaxed);
+    wakeup.notify_one();
+}
+
+void SaveFlusher::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (running)
+    {
+        wakeup.wait_for(guard, std::chrono::milliseconds(SAVE_FLUSH_TICK_MS),
+                        [this] { return !running || (urgent_count.load(std::memory_order_relaxed) > 0); });
+        if (!running)
+            break;
+        urgent_count.store(0, std::memory_order_relaxed);
+        flush_pass();
+    }
+}
+
+// One tick: first every file that asked to be flushed, then the next
+// slice of the round robin, until the byte budget runs out
+size_t SaveFlusher::flush_pass()
+{
+    size_t written = 0;
+    for (size_t i = 0; (i < files.size()) && (written < SAVE_FLUSH_TICK_BYTES); i++)
+    {
+        if (files[i]->urgent.exchange(false, std::memory_order_relaxed))
+            written += files[i]->flush();
+    }
+
+    size_t slice = (files.size() * SAVE_FLUSH_TICK_MS + SAVE_FLUSH_INTERVAL_MS - 1) / SAVE_FLUSH_INTERVAL_MS;
+    for (size_t i = 0; (i < slice) && (written < SAVE_FLUSH_TICK_BYTES); i++)
+    {
+        if (cursor >= files.size())
+            cursor = 0;
+        written += files[cursor++]->flush();
+    }
+    return written;
+}
+
+SaveFile::SaveFile()
+    : fd(-1), mapping(NULL), length(0), was_existing(false), urgent(false)
+{
+    for (int word = 0; word < SAVE_FILE_MAX_PAGES / 64; word++)
+        dirty[word] = 0;
+}
+
+SaveFile::~SaveFile()
+{
+    close();
+}
+
+// Maps `size` bytes of `path`, creating or growing the file if needed
+bool SaveFile::open(const std::string& path, size_t size)
+{
+    close();
+    if ((size == 0) || (size > SAVE_FILE_MAX_PAGES * 256))
+        return false;
+
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close();
+        return false;
+    }
+    was_existing = (info.st_size > 0);
+    if (((size_t)info.st_size < size) && (ftruncate(fd, size) != 0))
+    {
+        close();
+        return false;
+    }
+
+    void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+    {
+        close();
+        return false;
+    }
+    mapping = (BYTE*)address;
+    length = size;
+    flusher.add(this);
+    return true;
+}
+
+void SaveFile::close()
+{
+    if (mapping)
+    {
+        flusher.remove(this);
+        flush();
+        munmap(mapping, length);
+        mapping = NULL;
+        length = 0;
+    }
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+BYTE* SaveFile::data() const
+{
+    return mapping;
+}
+
+size_t SaveFile::size() const
+{
+    return length;
+}
+
+bool SaveFile::existed() const
+{
+    return was_existing;
+}
+
+void SaveFile::mark_dirty(const uint64_t* pages)
+{
+    for (int word = 0; word < SAVE_FILE_MAX_PAGES / 64; word++)
+    {
+        if (pages[word])
+            dirty[word].fetch_or(pages[word], std::memory_order_relaxed);
+    }
+}
+
+void SaveFile::request_flush()
+{
+    urgent.store(true, std::memory_order_relaxed);
+    flusher.wake();
+}
+
+// msync wants whole OS pages, so runs of dirty 256 byte pages are
+// widened to those and neighbouring runs merged
+size_t SaveFile::flush()
+{
+    if (!mapping)
+        return 0;
+    uint64_t pages[SAVE_FILE_MAX_PAGES / 64];
+    bool any = false;
+    for (int word = 0; word < SAVE_FILE_MAX_PAGES / 64; word++)
+    {
+        pages[word] = dirty[word].exchange(0, std::memory_order_relaxed);
+        any |= (pages[word] != 0);
+    }
+    if (!any)
+        return 0;
+
+    size_t os_page = sysconf(_SC_PAGESIZE);
+    size_t written = 0;
+    size_t run_start = 0;
+    size_t run_end = 0;
+    for (int page = 0; page < SAVE_FILE_MAX_PAGES; page++)
+    {
+        if (!(pages[page >> 6] & ((uint64_t)1 << (page & 63))))
+            continue;
+        size_t start = ((size_t)page * 256) & ~(os_page - 1);
+        size_t end = std::min(length, ((size_t)page * 256 + 256 + os_page - 1) & ~(os_page - 1));
+        if ((run_end != 0) && (start <= run_end))
+        {
+            run_end = std::max(run_end, end);
+            continue;
+        }
+        if (run_end != 0)
+        {
+            msync(mapping + run_start, run_end - run_start, MS_SYNC);
+            written += run_end - run_start;
+        }
+        run_start = start;
+        run_end = end;
+    }
+    if (run_end != 0)
+    {
+        msync(mapping + run_start, run_end - run_start, MS_SYNC);
+        written += run_end - run_start;
+    }
+    return written;
+}
@@ -0,0 +1,68 @@
+#ifndef SAVEFILE_H
+#define SAVEFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+typedef unsigned char BYTE;
+
+// Cart RAM is at most 0x80 pages of 256 bytes (see GB.h)
+#define SAVE_FILE_MAX_PAGES 0x80
+
+// How often dirty save data gets written back, and how much of it the
+// background thread writes per tick at most, so thousands of instances
+// spread their writes out instead of all hitting the disk at once.
+#define SAVE_FLUSH_INTERVAL_MS 2000
+#define SAVE_FLUSH_TICK_MS 50
+#define SAVE_FLUSH_TICK_BYTES (1 << 20)
+
+// Battery backed cart RAM as a shared mapping of the .sav file. The GB
+// points its cart RAM pages straight into the mapping, so the game's
+// writes land in the page cache with no copying.
+//
+// Getting them to disk is left to one background thread shared by every
+// open SaveFile. Once a frame the GB passes on which 256 byte pages it
+// wrote (mark_dirty), and the thread msyncs just those ranges. Each file
+// is visited once per SAVE_FLUSH_INTERVAL_MS, a slice of the files per
+// tick, and a tick writes at most SAVE_FLUSH_TICK_BYTES; anything left
+// over waits for the next tick. request_flush() (the game disabling RAM
+// after saving) moves a file to the front of the queue.
+class SaveFile
+{
+public:
+    SaveFile();
+    ~SaveFile();
+
+    bool open(const std::string& path, size_t size);
+    void close();
+
+    BYTE* data() const;
+    size_t size() const;
+    // true if the file existed and its contents were loaded
+    bool existed() const;
+
+    // Emulation thread side. One bit per 256 byte page of the file.
+    void mark_dirty(const uint64_t* pages);
+    void request_flush();
+
+    // msync everything dirty right now, returns bytes written
+    size_t flush();
+
+private:
+    friend class SaveFlusher;
+
+    SaveFile(const SaveFile&);
+    SaveFile& operator=(const SaveFile&);
+
+    int fd;
+    BYTE* mapping;
+    size_t length;
+    bool was_existing;
+
+    std::atomic<uint64_t> dirty[SAVE_FILE_MAX_PAGES / 64];
+    std::atomic<bool> urgent;
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+// Lock-free single producer / single consumer ring. The producer only
+// ever writes head and the consumer only ever writes tail, so each side
+// needs one acquire load of the other's index and one release store of
+// its own per call. Capacity is rounded up to a power of two.
+template <typename T>
+class SpscRing
+{
+public:
+    explicit SpscRing(size_t capacity)
+        : head(0), tail(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        buffer.resize(size);
+        mask = size - 1;
+    }
+
+    // producer side, returns how many items fit
+    size_t push(const T* items, size_t count)
+    {
+        size_t write = head.load(std::memory_order_relaxed);
+        size_t read = tail.load(std::memory_order_acquire);
+        size_t space = buffer.size() - (write - read);
+        if (count > space)
+            count = space;
+        for (size_t i = 0; i < count; i++)
+            buffer[(write + i) & mask] = items[i];
+        head.store(write + count, std::memory_order_release);
+        return count;
+    }
+
+    // consumer side, returns how many items were read
+    size_t pop(T* items, size_t count)
+    {
+        size_t read = tail.load(std::memory_order_relaxed);
+        size_t write = head.load(std::memory_order_acquire);
+        size_t available = write - read;
+        if (count > available)
+            count = available;
+        for (size_t i = 0; i < count; i++)
+            items[i] = buffer[(read + i) & mask];
+        tail.store(read + count, std::memory_order_release);
+        return count;
+    }
+
+    // either side; only exact from the side that's not currently moving
+    size_t size() const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const
+    {
+        return buffer.size();
+    }
+
+private:
+    std::vector<T> buffer;
+    size_t mask;
+    // on separate cache lines so the two threads don't fight over them
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+};
+
+#endif
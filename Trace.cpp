@@ -0,0 +1,340 @@
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include "Trace.h"
+
+// Context printed before the first difference
+#define TRACE_DIFF_HISTORY 16
+
+TraceRecorder::TraceRecorder()
+    : file(NULL), free_chunks(TRACE_CHUNKS), full_chunks(TRACE_CHUNKS),
+      chunk(NULL), cursor(NULL), limit(NULL),
+      pending_bank(0), pending_pc(0), pending_opcode(0), pending_extended(0),
+      records(0), bytes(0), stalls(0), running(false)
+{
+    reset_deltas();
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    close();
+}
+
+bool TraceRecorder::open(const std::string& path)
+{
+    close();
+    file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    fwrite(TRACE_MAGIC, 1, 8, file);
+
+    for (int i = 0; i < TRACE_CHUNKS; i++)
+    {
+        buffers.push_back(new BYTE[TRACE_CHUNK_BYTES]);
+        free_chunks.push(&buffers.back(), 1);
+    }
+    records = 0;
+    bytes = 0;
+    stalls = 0;
+    running = true;
+    writer = std::thread(&TraceRecorder::writer_loop, this);
+    next_chunk();
+    return true;
+}
+
+void TraceRecorder::close()
+{
+    if (!file)
+        return;
+    if (cursor > chunk)
+    {
+        Chunk last = {chunk, (uint32_t)(cursor - chunk)};
+        full_chunks.push(&last, 1);
+        bytes += last.size;
+    }
+    chunk = cursor = limit = NULL;
+    running = false;
+    wakeup.notify_one();
+    writer.join();
+    fclose(file);
+    file = NULL;
+
+    BYTE* unused;
+    while (free_chunks.pop(&unused, 1))
+        ;
+    for (size_t i = 0; i < buffers.size(); i++)
+        delete[] buffers[i];
+    buffers.clear();
+}
+
+void TraceRecorder::print_stats() const
+{
+    printf("Trace: %llu records, %llu bytes (%.2f bytes/record), %llu stalls on the writer\n",
+           (unsigned long long)records, (unsigned long long)bytes,
+           records ? (double)bytes / records : 0.0, (unsigned long long)stalls);
+}
+
+void TraceRecorder::reset_deltas()
+{
+    last_pc = 0;
+    last_cycle = 0;
+    memset(last_fields, 0, sizeof(last_fields));
+    last_location = 0;
+}
+
+// Hands the current chunk to the writer and starts the next one. If the
+// writer is a whole ring behind, we wait for it rather than drop records.
+void TraceRecorder::next_chunk()
+{
+    if (!file)
+    {
+        // not open: nothing is kept, but the hooks still need somewhere
+        // to write
+        static BYTE discard[TRACE_CHUNK_BYTES];
+        cursor = chunk = discard;
+        limit = discard + TRACE_CHUNK_BYTES;
+        return;
+    }
+    if (chunk)
+    {
+        Chunk full = {chunk, (uint32_t)(cursor - chunk)};
+        full_chunks.push(&full, 1);
+        bytes += full.size;
+        wakeup.notify_one();
+    }
+    BYTE* fresh;
+    while (!free_chunks.pop(&fresh, 1))
+    {
+        stalls++;
+        wakeup.notify_one();
+        std::this_thread::yield();
+    }
+    chunk = cursor = fresh;
+    limit = fresh + TRACE_CHUNK_BYTES;
+    reset_deltas();
+}
+
+// Chunks on disk are a little endian 32-bit size and the records. The
+// emulation thread never takes the lock, so a missed wakeup just means
+// the chunk is written on the next tick.
+void TraceRecorder::writer_loop()
+{
+    bool stopping = false;
+    while (true)
+    {
+        Chunk full;
+        if (full_chunks.pop(&full, 1))
+        {
+            BYTE size[4] = {(BYTE)full.size, (BYTE)(full.size >> 8), (BYTE)(full.size >> 16), (BYTE)(full.size >> 24)};
+            fwrite(size, 1, 4, file);
+            fwrite(full.data, 1, full.size, file);
+            free_chunks.push(&full.data, 1);
+            continue;
+        }
+        // close() queues the last chunk before clearing running, so one
+        // more empty pop after seeing that means everything is written
+        if (stopping)
+            break;
+        if (!running.load())
+        {
+            stopping = true;
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        wakeup.wait_for(guard, std::chrono::milliseconds(5));
+    }
+}
+
+TraceReader::TraceReader()
+    : file(NULL), position(0)
+{
+}
+
+TraceReader::~TraceReader()
+{
+    if (file)
+        fclose(file);
+}
+
+bool TraceReader::open(const std::string& path)
+{
+    file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+    char magic[8];
+    if ((fread(magic, 1, 8, file) != 8) || (memcmp(magic, TRACE_MAGIC, 8) != 0))
+    {
+        fclose(file);
+        file = NULL;
+        return false;
+    }
+    chunk.clear();
+    position = 0;
+    return true;
+}
+
+bool TraceReader::read_chunk()
+{
+    BYTE size[4];
+    if (fread(size, 1, 4, file) != 4)
+        return false;
+    chunk.resize(size[0] | (size[1] << 8) | (size[2] << 16) | ((uint32_t)size[3] << 24));
+    if (chunk.empty() || (fread(&chunk[0], 1, chunk.size(), file) != chunk.size()))
+        return false;
+    position = 0;
+    last_pc = 0;
+    last_cycle = 0;
+    memset(last_fields, 0, sizeof(last_fields));
+    last_location = 0;
+    return true;
+}
+
+bool TraceReader::get_varint(uint64_t& value)
+{
+    value = 0;
+    for (int shift = 0; (shift < 64) && (position < chunk.size()); shift += 7)
+    {
+        BYTE byte = chunk[position++];
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+bool TraceReader::next(TraceEvent& event)
+{
+    if (!file)
+        return false;
+    if ((position >= chunk.size()) && !read_chunk())
+        return false;
+
+    memset(&event, 0, sizeof(event));
+    BYTE header = chunk[position++];
+    uint64_t value;
+    if (header == TRACE_WRITE)
+    {
+        if (!get_varint(value) || (position >= chunk.size()))
+            return false;
+        last_location += (uint32_t)unzigzag(value);
+        event.is_write = true;
+        event.location = last_location;
+        event.data = chunk[position++];
+        event.cycle = last_cycle;
+        return true;
+    }
+
+    if (!get_varint(value) || (position >= chunk.size()))
+        return false;
+    last_pc += (WORD)unzigzag(value);
+    event.pc = last_pc;
+    event.opcode = chunk[position++];
+    if (event.opcode == 0xCB)
+    {
+        if (position >= chunk.size())
+            return false;
+        event.extended = chunk[position++];
+    }
+    if (!get_varint(value))
+        return false;
+    last_cycle += value;
+    event.cycle = last_cycle;
+    for (int i = 0; i < TRACE_FIELDS; i++)
+    {
+        if (header & (1 << i))
+        {
+            if (position + 2 > chunk.size())
+                return false;
+            last_fields[i] = chunk[position] | (chunk[position + 1] << 8);
+            position += 2;
+        }
+        event.fields[i] = last_fields[i];
+    }
+    return true;
+}
+
+static bool same_event(const TraceEvent& a, const TraceEvent& b)
+{
+    if (a.is_write != b.is_write)
+        return false;
+    if (a.is_write)
+        return (a.location == b.location) && (a.data == b.data);
+    return (a.cycle == b.cycle) && (a.pc == b.pc) && (a.opcode == b.opcode) &&
+           (a.extended == b.extended) && (memcmp(a.fields, b.fields, sizeof(a.fields)) == 0);
+}
+
+static void print_event(FILE* out, const char* prefix, const TraceEvent& event)
+{
+    if (event.is_write)
+    {
+        fprintf(out, "%s    write %s%04X = %02X\n", prefix, (event.location >= 0x10000) ? "cart:" : "",
+                event.location & 0xFFFF, event.data);
+        return;
+    }
+    fprintf(out, "%s%12llu  %03X:%04X  %02X", prefix, (unsigned long long)event.cycle,
+            event.fields[TRACE_BANK], event.pc, event.opcode);
+    if (event.opcode == 0xCB)
+        fprintf(out, " %02X", event.extended);
+    else
+        fprintf(out, "   ");
+    fprintf(out, "  AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X\n", event.fields[TRACE_AF],
+            event.fields[TRACE_BC], event.fields[TRACE_DE], event.fields[TRACE_HL], event.fields[TRACE_SP]);
+}
+
+long trace_diff(const std::string& path_a, const std::string& path_b, FILE* out)
+{
+    TraceReader a;
+    TraceReader b;
+    if (!a.open(path_a))
+    {
+        fprintf(out, "Couldn't open %s\n", path_a.c_str());
+        return -2;
+    }
+    if (!b.open(path_b))
+    {
+        fprintf(out, "Couldn't open %s\n", path_b.c_str());
+        return -2;
+    }
+
+    TraceEvent history[TRACE_DIFF_HISTORY];
+    long record = 0;
+    long instructions = 0;
+    while (true)
+    {
+        TraceEvent event_a;
+        TraceEvent event_b;
+        bool has_a = a.next(event_a);
+        bool has_b = b.next(event_b);
+        if (!has_a && !has_b)
+        {
+            fprintf(out, "Traces are identical: %ld records, %ld instructions\n", record, instructions);
+            return -1;
+        }
+        if (has_a && has_b && same_event(event_a, event_b))
+        {
+            history[record % TRACE_DIFF_HISTORY] = event_a;
+            record++;
+            if (!event_a.is_write)
+                instructions++;
+            continue;
+        }
+
+        fprintf(out, "Traces differ at record %ld (after %ld instructions)\n", record, instructions);
+        for (long i = std::max(0L, record - TRACE_DIFF_HISTORY); i < record; i++)
+            print_event(out, "     ", history[i % TRACE_DIFF_HISTORY]);
+        if (has_a)
+            print_event(out, "  a: ", event_a);
+        else
+            fprintf(out, "  a: (end of trace)\n");
+        if (has_b)
+            print_event(out, "  b: ", event_b);
+        else
+            fprintf(out, "  b: (end of trace)\n");
+        return record;
+    }
+}
@@ -0,0 +1,203 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Profiler.h"
+#include "SpscRing.h"
+
+// Bytes per chunk handed to the writer thread, and chunks in the ring
+#define TRACE_CHUNK_BYTES (1 << 20)
+#define TRACE_CHUNKS 64
+// Longest record the encoder can emit, checked once per record
+#define TRACE_MAX_RECORD 32
+#define TRACE_MAGIC "GBTRACE1"
+
+// Record kinds. An instruction record's first byte is the mask of
+// fields that changed (below), a memory write's is TRACE_WRITE.
+#define TRACE_WRITE 0x80
+enum trace_field {TRACE_BANK=0, TRACE_AF=1, TRACE_BC=2, TRACE_DE=3, TRACE_HL=4, TRACE_SP=5, TRACE_FIELDS=6};
+
+// One decoded record. Instructions carry the cycle they started on and
+// the registers after they ran; writes are every store to RAM or I/O
+// since the previous instruction record (the CPU's own, and the PPU,
+// timer and interrupt ones in between). location is page << 8 | offset,
+// with cart RAM at pages 0x100 and up.
+struct TraceEvent
+{
+    bool is_write;
+    uint64_t cycle;
+    WORD pc;
+    BYTE opcode;
+    BYTE extended;
+    WORD fields[TRACE_FIELDS];
+    uint32_t location;
+    BYTE data;
+};
+
+// Execution trace recorder, run as a GB::run_frame policy (GB::update()
+// does that while one is attached with GB::attach_trace). Records are
+// delta coded against the previous one into 1MB chunks; full chunks go
+// through a ring to a background thread that writes them out. Each
+// chunk starts from a blank delta state, so a file is a sequence of
+// independently decodable chunks. The emulator waits if the writer
+// falls behind by the whole ring, so a trace is never missing records.
+class TraceRecorder
+{
+public:
+    enum { enabled = 1 };
+
+    TraceRecorder();
+    ~TraceRecorder();
+
+    bool open(const std::string& path);
+    void close();
+    void print_stats() const;
+
+    // run_frame hooks
+    void enter(int subsystem) {}
+    void instruction(WORD bank, WORD pc, BYTE opcode, BYTE extended, int cycles)
+    {
+        pending_bank = bank;
+        pending_pc = pc;
+        pending_opcode = opcode;
+        pending_extended = extended;
+    }
+    void registers(const CpuSnapshot& cpu)
+    {
+        reserve();
+        BYTE* out = cursor;
+        BYTE* header = out++;
+        out = put_varint(out, zigzag((int16_t)(pending_pc - last_pc)));
+        *out++ = pending_opcode;
+        if (pending_opcode == 0xCB)
+            *out++ = pending_extended;
+        out = put_varint(out, cpu.cycle - last_cycle);
+        WORD fields[TRACE_FIELDS] = {pending_bank, cpu.af, cpu.bc, cpu.de, cpu.hl, cpu.sp};
+        BYTE mask = 0;
+        for (int i = 0; i < TRACE_FIELDS; i++)
+        {
+            if (fields[i] == last_fields[i])
+                continue;
+            mask |= 1 << i;
+            *out++ = fields[i] & 0xFF;
+            *out++ = fields[i] >> 8;
+            last_fields[i] = fields[i];
+        }
+        *header = mask;
+        last_pc = pending_pc;
+        last_cycle = cpu.cycle;
+        cursor = out;
+        records++;
+    }
+    void halted(int cycles) {}
+    void end_frame() {}
+    bool stop_before(WORD pc) { return false; }
+
+    // from GB's write slow path
+    void memory_write(uint32_t location, BYTE data)
+    {
+        reserve();
+        BYTE* out = cursor;
+        *out++ = TRACE_WRITE;
+        out = put_varint(out, zigzag((int32_t)(location - last_location)));
+        *out++ = data;
+        last_location = location;
+        cursor = out;
+        records++;
+    }
+
+    static uint64_t zigzag(int64_t value)
+    {
+        return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+    }
+
+    static BYTE* put_varint(BYTE* out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            *out++ = (BYTE)value | 0x80;
+            value >>= 7;
+        }
+        *out++ = (BYTE)value;
+        return out;
+    }
+
+private:
+    struct Chunk
+    {
+        BYTE* data;
+        uint32_t size;
+    };
+
+    void reserve()
+    {
+        if (cursor + TRACE_MAX_RECORD > limit)
+            next_chunk();
+    }
+    void next_chunk();
+    void reset_deltas();
+    void writer_loop();
+
+    FILE* file;
+    std::vector<BYTE*> buffers;
+    SpscRing<BYTE*> free_chunks;
+    SpscRing<Chunk> full_chunks;
+    BYTE* chunk;
+    BYTE* cursor;
+    BYTE* limit;
+
+    WORD pending_bank;
+    WORD pending_pc;
+    BYTE pending_opcode;
+    BYTE pending_extended;
+    WORD last_pc;
+    uint64_t last_cycle;
+    WORD last_fields[TRACE_FIELDS];
+    uint32_t last_location;
+
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t stalls;
+
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::atomic<bool> running;
+};
+
+// Reads a trace back one record at a time
+class TraceReader
+{
+public:
+    TraceReader();
+    ~TraceReader();
+
+    bool open(const std::string& path);
+    bool next(TraceEvent& event);
+
+private:
+    bool read_chunk();
+    bool get_varint(uint64_t& value);
+
+    FILE* file;
+    std::vector<BYTE> chunk;
+    size_t position;
+    WORD last_pc;
+    uint64_t last_cycle;
+    WORD last_fields[TRACE_FIELDS];
+    uint32_t last_location;
+};
+
+// Finds the first record where two traces differ and prints it with the
+// instructions leading up to it. Returns the record number, -1 if the
+// traces are identical or -2 if one can't be opened.
+long trace_diff(const std::string& path_a, const std::string& path_b, FILE* out);
+
+#endif
@@ -0,0 +1,64 @@
+#include <string.h>
+#include "WavWriter.h"
+
+static void write_u32(FILE* file, uint32_t value)
+{
+    fwrite(&value, 4, 1, file);
+}
+
+static void write_u16(FILE* file, uint16_t value)
+{
+    fwrite(&value, 2, 1, file);
+}
+
+WavWriter::WavWriter() : file(NULL), data_bytes(0)
+{
+}
+
+WavWriter::~WavWriter()
+{
+    close();
+}
+
+bool WavWriter::open(const std::string& path, int sample_rate)
+{
+    close();
+    file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    data_bytes = 0;
+
+    fwrite("RIFF", 1, 4, file);
+    write_u32(file, 0);             // patched by close()
+    fwrite("WAVEfmt ", 1, 8, file);
+    write_u32(file, 16);
+    write_u16(file, 1);             // PCM
+    write_u16(file, 2);             // stereo
+    write_u32(file, sample_rate);
+    write_u32(file, sample_rate * 4);
+    write_u16(file, 4);             // bytes per frame
+    write_u16(file, 16);
+    fwrite("data", 1, 4, file);
+    write_u32(file, 0);             // patched by close()
+    return true;
+}
+
+void WavWriter::write(const int16_t* samples, size_t frames)
+{
+    if (!file)
+        return;
+    fwrite(samples, 4, frames, file);
+    data_bytes += frames * 4;
+}
+
+void WavWriter::close()
+{
+    if (!file)
+        return;
+    fseek(file, 4, SEEK_SET);
+    write_u32(file, 36 + data_bytes);
+    fseek(file, 40, SEEK_SET);
+    write_u32(file, data_bytes);
+    fclose(file);
+    file = NULL;
+}
@@ -0,0 +1,25 @@
+#ifndef WAVWRITER_H
+#define WAVWRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+
+// 16-bit stereo PCM .wav output for headless runs. The header's sizes
+// are filled in by close().
+class WavWriter
+{
+public:
+    WavWriter();
+    ~WavWriter();
+
+    bool open(const std::string& path, int sample_rate);
+    void write(const int16_t* samples, size_t frames);
+    void close();
+
+private:
+    FILE* file;
+    uint32_t data_bytes;
+};
+
+#endif
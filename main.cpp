@@ -0,0 +1,374 @@
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <chrono>
+#include <thread>
+#include "GB.h"
+#include "Profiler.h"
+#include "Movie.h"
+#include "WavWriter.h"
+#include "Recompiler.h"
+#include "FramePacer.h"
+#include "RunAhead.h"
+
+static const char* stop_reasons[] = {"", "breakpoint", "read watchpoint", "write watchpoint", "step"};
+
+static void print_registers(const GB& gb)
+{
+    CpuSnapshot cpu = gb.cpu_snapshot();
+    printf("PC=%04X AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X cycle %llu\n", cpu.pc, cpu.af, cpu.bc,
+           cpu.de, cpu.hl, cpu.sp, (unsigned long long)cpu.cycle);
+}
+
+static void print_stop(const GB& gb, const Debugger& debugger)
+{
+    const DebugStop& stop = debugger.last_stop();
+    if ((stop.reason == DEBUG_WATCH_READ) || (stop.reason == DEBUG_WATCH_WRITE))
+        printf("%s %d: %04X = %02X\n", stop_reasons[stop.reason], stop.id, stop.address, stop.value);
+    else if (stop.reason == DEBUG_BREAKPOINT)
+        printf("%s %d\n", stop_reasons[stop.reason], stop.id);
+    print_registers(gb);
+}
+
+static bool is_hex(const char* token)
+{
+    if (!*token)
+        return false;
+    for (; *token; token++)
+    {
+        if (!isxdigit((unsigned char)*token))
+            return false;
+    }
+    return true;
+}
+
+// Reads commands from stdin:
+//   b ADDR                 breakpoint
+//   w START [END] [r|w|rw] watchpoint, writes by default
+//   d ID                   delete a breakpoint or watchpoint
+//   c                      continue, for up to a minute of frames
+//   s / n                  step / step over
+//   r                      registers
+//   x ADDR [COUNT]         memory
+//   q                      quit
+static void debug_console(GB& gb)
+{
+    Debugger debugger(gb);
+    char line[256];
+    print_registers(gb);
+    while (printf("> "), fflush(stdout), fgets(line, sizeof(line), stdin))
+    {
+        // the command, up to two hex numbers, then w's kind if any
+        char command = 0;
+        char tokens[3][16];
+        int fields = sscanf(line, " %c %15s %15s %15s", &command, tokens[0], tokens[1], tokens[2]);
+        unsigned int values[2] = {0, 0};
+        int numbers = 0;
+        while ((numbers < 2) && (numbers + 1 < fields) && is_hex(tokens[numbers]))
+        {
+            values[numbers] = strtoul(tokens[numbers], NULL, 16);
+            numbers++;
+        }
+        const char* kinds = (numbers + 1 < fields) ? tokens[numbers] : "w";
+        unsigned int first = values[0];
+        unsigned int second = (numbers == 2) ? values[1] : first;
+
+        if (command == 'q')
+            break;
+        else if ((command == 'b') && (numbers >= 1))
+            printf("breakpoint %d\n", debugger.add_breakpoint(first));
+        else if ((command == 'w') && (numbers >= 1))
+        {
+            int watch = (strchr(kinds, 'r') ? WATCH_READ : 0) | (strchr(kinds, 'w') ? WATCH_WRITE : 0);
+            printf("watchpoint %d\n", debugger.add_watchpoint(first, second, watch ? watch : WATCH_WRITE));
+        }
+        else if ((command == 'd') && (numbers >= 1))
+            debugger.remove(first);
+        else if (command == 'c')
+        {
+            bool stopped = false;
+            for (int frame = 0; (frame < 3600) && !stopped; frame++)
+                stopped = debugger.run();
+            if (stopped)
+                print_stop(gb, debugger);
+            else
+                printf("no break in 3600 frames\n");
+        }
+        else if ((command == 's') || (command == 'n'))
+        {
+            for (int frame = 0; frame < 3600; frame++)
+            {
+                if (command == 's')
+                    debugger.step();
+                else
+                    debugger.step_over();
+                if (debugger.last_stop().reason != DEBUG_NONE)
+                    break;
+            }
+            print_stop(gb, debugger);
+        }
+        else if (command == 'r')
+            print_registers(gb);
+        else if ((command == 'x') && (numbers >= 1))
+        {
+            int count = (numbers == 2) ? second : 16;
+            for (int i = 0; i < count; i++)
+                printf("%s%02X", (i % 16) ? " " : (i ? "\n" : ""), gb.read_memory(first + i));
+            printf("\n");
+        }
+        else if (command)
+            printf("b ADDR | w START [END] [r|w|rw] | d ID | c | s | n | r | x ADDR [COUNT] | q\n");
+    }
+}
+
+// gameboy [--replay movie.gbm] [--wav out.wav frames] [--link frames [--deterministic]]
+//         [--profile frames [out.folded]] [--metrics out.json|out.prom frames]
+//         [--trace out.trace frames] [--trace-diff a.trace b.trace] [--debug]
+//         [--recompile out.cpp [seed.trace]] [--recompiled module.so frames]
+//         [--realtime frames [speed]] [--runahead frames [ahead]]
+int main(int argc, char** argv) 
+{
+    std::cout << "Hello World!\n";
+    GB gb;
+
+    // headless run, sound goes to a .wav instead of the sound card
+    if ((argc == 4) && (string(argv[1]) == "--wav"))
+    {
+        WavWriter wav;
+        if (!wav.open(argv[2], gb.get_audio_sample_rate()))
+        {
+            std::cout << "Couldn't open " << argv[2] << "\n";
+            return 1;
+        }
+        gb.set_rendering(false);
+        int16_t samples[2048 * 2];
+        for (int frame = atoi(argv[3]); frame > 0; frame--)
+        {
+            gb.update();
+            size_t count;
+            while ((count = gb.read_audio(samples, 2048)) > 0)
+                wav.write(samples, count);
+        }
+        return 0;
+    }
+
+    // two linked instances, one per thread
+    if ((argc >= 3) && (string(argv[1]) == "--link"))
+    {
+        bool deterministic = (argc == 4) && (string(argv[3]) == "--deterministic");
+        int frames = atoi(argv[2]);
+        LinkCable cable(deterministic);
+        GB other;
+        gb.set_rendering(false);
+        other.set_rendering(false);
+        gb.connect_link(&cable, 0);
+        other.connect_link(&cable, 1);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::thread second([&]()
+        {
+            for (int frame = 0; frame < frames; frame++)
+                other.update();
+            other.disconnect_link();
+        });
+        for (int frame = 0; frame < frames; frame++)
+            gb.update();
+        gb.disconnect_link();
+        second.join();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        cable.print_stats();
+        printf("%d frames each in %.3f s (%.0f frames/sec per instance)\n",
+               frames, elapsed.count(), frames / elapsed.count());
+        printf("state hashes %016llx %016llx\n",
+               (unsigned long long)gb.state_hash(), (unsigned long long)other.state_hash());
+        return 0;
+    }
+
+    // headless run exporting counters every second, .prom for Prometheus
+    // text instead of JSON
+    if ((argc == 4) && (string(argv[1]) == "--metrics"))
+    {
+        string path = argv[2];
+        bool prometheus = (path.size() > 5) && (path.compare(path.size() - 5, 5, ".prom") == 0);
+        Metrics metrics;
+        gb.set_counters(metrics.add_instance("gb0"));
+        gb.set_rendering(false);
+        metrics.start(path, prometheus ? METRICS_PROMETHEUS : METRICS_JSON);
+        for (int frame = atoi(argv[3]); frame > 0; frame--)
+            gb.update();
+        metrics.stop();
+        metrics.write(stdout, prometheus ? METRICS_PROMETHEUS : METRICS_JSON);
+        return 0;
+    }
+
+    // per opcode / hot spot / subsystem profile of a headless run
+    if ((argc >= 3) && (string(argv[1]) == "--profile"))
+    {
+        Profiler profiler;
+        for (int frame = atoi(argv[2]); frame > 0; frame--)
+            gb.run_frame(profiler);
+        profiler.print_report(stdout);
+        if (argc == 4)
+        {
+            FILE* folded = fopen(argv[3], "w");
+            if (!folded)
+            {
+                std::cout << "Couldn't open " << argv[3] << "\n";
+                return 1;
+            }
+            profiler.write_folded(folded);
+            fclose(folded);
+        }
+        return 0;
+    }
+
+    // headless run recording an execution trace
+    if ((argc == 4) && (string(argv[1]) == "--trace"))
+    {
+        TraceRecorder recorder;
+        if (!recorder.open(argv[2]))
+        {
+            std::cout << "Couldn't open " << argv[2] << "\n";
+            return 1;
+        }
+        gb.set_rendering(false);
+        gb.attach_trace(&recorder);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int frames = atoi(argv[3]);
+        for (int frame = 0; frame < frames; frame++)
+            gb.update();
+        gb.attach_trace(NULL);
+        recorder.close();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        recorder.print_stats();
+        printf("%d frames in %.3f s (%.0f frames/sec)\n", frames, elapsed.count(), frames / elapsed.count());
+        return 0;
+    }
+
+    // headless, driven from stdin
+    if ((argc == 2) && (string(argv[1]) == "--debug"))
+    {
+        debug_console(gb);
+        return 0;
+    }
+
+    // first record where two traces disagree
+    if ((argc == 4) && (string(argv[1]) == "--trace-diff"))
+        return (trace_diff(argv[2], argv[3], stdout) == -1) ? 0 : 1;
+
+    // static recompile of the cartridge to C++
+    if (((argc == 3) || (argc == 4)) && (string(argv[1]) == "--recompile"))
+        return (recompile_rom(gb.cartridge_image(), argv[2], (argc == 4) ? argv[3] : "", stdout) < 0) ? 1 : 0;
+
+    // the same headless run interpreted and with a recompiled module,
+    // timed and checked against each other
+    if ((argc == 4) && (string(argv[1]) == "--recompiled"))
+    {
+        GB interpreted;
+        if (!gb.load_recompiled(argv[2]))
+            return 1;
+        int frames = atoi(argv[3]);
+        gb.set_rendering(false);
+        interpreted.set_rendering(false);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < frames; frame++)
+            interpreted.update();
+        std::chrono::duration<double> interpreted_time = std::chrono::steady_clock::now() - start;
+        start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < frames; frame++)
+            gb.update();
+        std::chrono::duration<double> recompiled_time = std::chrono::steady_clock::now() - start;
+
+        printf("interpreted %.0f frames/sec, recompiled %.0f frames/sec, %.1f%% of instructions recompiled\n",
+               frames / interpreted_time.count(), frames / recompiled_time.count(), gb.recompiled_coverage() * 100);
+        bool same = gb.full_state_hash() == interpreted.full_state_hash();
+        printf("state after %d frames %s\n", frames, same ? "matches" : "DIFFERS");
+        return same ? 0 : 1;
+    }
+
+    // paced at the real frame rate (times speed) with sound going to a
+    // stand-in sound card, then how steady the frame times were
+    if (((argc == 3) || (argc == 4)) && (string(argv[1]) == "--realtime"))
+    {
+        Metrics metrics;
+        InstanceCounters* counters = metrics.add_instance("gb0");
+        gb.set_counters(counters);
+        AudioOutput audio;
+        audio.set_counters(counters);
+        audio.start(AudioOutput::Sink());
+        FramePacer pacer;
+        pacer.set_counters(counters);
+        pacer.set_audio_clock(&audio);
+        if (argc == 4)
+            pacer.set_speed(atof(argv[3]));
+
+        for (int frame = atoi(argv[2]); frame > 0; frame--)
+        {
+            gb.update();
+            audio.pull_from(gb);
+            pacer.wait();
+        }
+        audio.stop();
+        pacer.print_stats(stdout);
+        printf("%ld audio underruns, %ld frames of sound dropped on overrun, %zu queued\n",
+               audio.underruns(), audio.overruns(), audio.buffered());
+        return 0;
+    }
+
+    // run-ahead against a plain run fed the same input. A presented frame
+    // shows the plain run's frame `ahead` later, so it has to match it
+    // whenever the input held still across the frames run ahead.
+    if (((argc == 3) || (argc == 4)) && (string(argv[1]) == "--runahead"))
+    {
+        int frames = atoi(argv[2]);
+        int ahead = (argc == 4) ? atoi(argv[3]) : 2;
+        // a direction or button held for 15 frames out of every 45
+        std::vector<BYTE> inputs(frames + ahead);
+        for (size_t frame = 0; frame < inputs.size(); frame++)
+            inputs[frame] = ((frame % 45) < 15) ? (1 << ((frame / 45) % 6)) : 0;
+
+        GB plain;
+        for (int frame = 0; frame < ahead; frame++)
+        {
+            plain.set_joypad(inputs[frame]);
+            plain.update();
+        }
+        RunAhead runahead(gb, ahead);
+        int compared = 0;
+        int differing = 0;
+        for (int frame = 0; frame < frames; frame++)
+        {
+            const ScreenBuffer& shown = runahead.run_frame(inputs[frame]);
+            plain.set_joypad(inputs[frame + ahead]);
+            plain.update();
+
+            bool held = true;
+            for (int i = 1; i <= ahead; i++)
+                held = held && (inputs[frame + i] == inputs[frame]);
+            if (!held)
+                continue;
+            compared++;
+            if (memcmp(shown.pixels, plain.get_screen().pixels, sizeof(shown.pixels)) != 0)
+                differing++;
+        }
+        runahead.print_stats();
+        printf("%d of %d presented frames differ from the plain run\n", differing, compared);
+        return (differing == 0) ? 0 : 1;
+    }
+
+    if ((argc == 3) && (string(argv[1]) == "--replay"))
+    {
+        Movie movie;
+        if (!movie.load(argv[2]))
+        {
+            std::cout << "Couldn't load movie " << argv[2] << "\n";
+            return 1;
+        }
+        ReplayResult result = replay_movie(gb, movie);
+        print_replay_result(result);
+        return ((result.first_divergent_frame < 0) && !result.bad_savestate) ? 0 : 1;
+    }
+    return 0;
+}